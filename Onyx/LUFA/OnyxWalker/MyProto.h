@@ -8,7 +8,9 @@ enum Opcode {
     OpReadServo = 0x30,     //  ID, Reg, Count
     OpOutText = 0x40,       //  <actual text>
     OpRawWrite = 0x50,      //  <actual bytes>
-    OpRawRead = 0x60        //  MaxBytes
+    OpRawRead = 0x60,       //  MaxBytes
+    OpSyncWrite = 0x70,     //  Reg, Len, { ID, <Len bytes of data> } ...
+    OpBulkRead = 0x80       //  Reg, Count, ID ...
 };
 
 enum Target {
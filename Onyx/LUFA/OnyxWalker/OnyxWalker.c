@@ -22,6 +22,7 @@
 
 #define DXL_READ_DATA 0x2
 #define DXL_WRITE_DATA 0x3
+#define DXL_SYNC_WRITE 0x83
 
 #define ID_BROADCAST 0xfe
 
@@ -271,6 +272,28 @@ void write_servo(unsigned char id, unsigned char reg, unsigned char sz, unsigned
     sei();
 }
 
+/*  One SYNC_WRITE packet to the broadcast ID updates the same registers 
+    in several servos; the data is ID, <len bytes> for each servo.
+ */
+void sync_write(unsigned char reg, unsigned char len, unsigned char sz, unsigned char const *ptr) {
+
+    if (len == 0 || len > MAX_WRITE_SIZE || sz % (len + 1)) {
+        MY_Failure("Sync Size", sz, len);
+    }
+    for (unsigned char ix = 0; ix < sz; ix += len + 1) {
+        if (ptr[ix] >= MAX_SERVOS) {
+            MY_Failure("Servo ID", ptr[ix], MAX_SERVOS-1);
+        }
+    }
+
+    cli();
+
+    unsigned char cmd[3] = { DXL_SYNC_WRITE, reg, len };
+    servo_cmd(ID_BROADCAST, 3, cmd, sz, ptr);
+
+    sei();
+}
+
 unsigned char read_servo_buf[MAX_READ_SIZE + 9];
 
 bool waitchar(unsigned char ptr) {
@@ -382,6 +405,19 @@ out:
     sei();
 }
 
+/*  Read the same registers from several servos, one after the other; 
+    each servo gets its own OpReadServo response. Servos whose response 
+    would not fit in the in packet are skipped; the host asks again.
+ */
+void bulk_read(unsigned char reg, unsigned char cnt, unsigned char sz, unsigned char const *ids) {
+    for (unsigned char ix = 0; ix != sz; ++ix) {
+        if (sizeof(in_packet) - in_packet_ptr < cnt + 4) {
+            break;
+        }
+        read_servo(ids[ix], reg, cnt);
+    }
+}
+
 void out_text(unsigned char sz, unsigned char const *ptr) {
     for (unsigned char p = 0; p != WIDTH; ++p) {
         if (p < sz) {
@@ -444,6 +480,8 @@ static const PROGMEM unsigned char min_size[] = {
     0x2,    //  text out
     0x1,    //  raw write
     0x1,    //  raw read
+    0x4,    //  sync write
+    0x3,    //  bulk read
 };
 
 static void dispatch_out(void) {
@@ -503,6 +541,12 @@ unknown_op:
         case OpRawRead:
             raw_read(base[0]);
             break;
+        case OpSyncWrite:
+            sync_write(base[0], base[1], sz-2, base+2);
+            break;
+        case OpBulkRead:
+            bulk_read(base[0], base[1], sz-2, base+2);
+            break;
         default:
             goto unknown_op;
         }
@@ -16,6 +16,10 @@ static ITime *itime;
 static GuiState g_state;
 static int g_win = -1;
 static bool to_upload = false;
+//  the last image that went on screen, for gui_shown_latency()
+static boost::shared_ptr<Image> g_shown;
+static bool g_shownNew = false;
+static double g_shownLatency = 0;
 static GLuint g_imgTex = 0;
 static GLuint g_bubble = 0;
 static GLuint g_ring = 0;
@@ -269,6 +273,12 @@ static void do_display() {
     }
     glColor4f(0.8f, 0.8f, 0.8f, 0.8f);
     draw_val("%.01f V", bat / 10.0, 200, 684);
+    if (g_state.glass > 0) {
+        draw_val("video %.0f ms", g_state.glass, 320, 684);
+    }
+    if (g_state.rtt > 0) {
+        draw_val("ping %.0f ms", g_state.rtt, 480, 684);
+    }
     glColor4f(0.8f, 0.8f, 0.8f, 0.8f);
     draw_sprite(g_crouch, 32, 32, 160, 22);
     draw_sprite(g_stretch, 32, 32, 228, 22);
@@ -277,6 +287,13 @@ static void do_display() {
     draw_val("%d", g_state.pose, 200, 30);
 
     glutSwapBuffers();
+    if (!!g_state.image && g_state.image != g_shown) {
+        g_shown = g_state.image;
+        if (g_state.captured > 0) {
+            g_shownLatency = read_clock() - g_state.captured;
+            g_shownNew = g_shownLatency > 0;
+        }
+    }
 }
 
 void open_gui(GuiState const &state, ITime *it) {
@@ -317,6 +334,15 @@ void step_gui() {
     glutMainLoopEvent();
 }
 
+bool gui_shown_latency(double &oLatency) {
+    if (!g_shownNew) {
+        return false;
+    }
+    g_shownNew = false;
+    oLatency = g_shownLatency;
+    return true;
+}
+
 void close_gui() {
     glutDestroyWindow(g_win);
     g_win = -1;
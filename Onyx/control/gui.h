@@ -14,6 +14,9 @@ enum {
 };
 struct GuiState {
     boost::shared_ptr<Image> image;
+    //  when the robot captured image, on this machine's clock; 0 if not 
+    //  known
+    double captured;
     bool image_old;
     float trot;
     unsigned char pose;
@@ -22,6 +25,10 @@ struct GuiState {
     unsigned char status;
     unsigned char loss;
     unsigned short battery;
+    //  latest glass-to-glass video latency and ping round trip, in ms; 
+    //  0 if not known
+    float glass;
+    float rtt;
 };
 
 class ITime;
@@ -29,6 +36,10 @@ class ITime;
 void open_gui(GuiState const &state, ITime *it);
 void update_gui(GuiState const &state);
 void step_gui();
+//  From capture to swapping the decoded image onto the screen, for the 
+//  last new image shown; false if none (with a capture time) since the 
+//  last call.
+bool gui_shown_latency(double &oLatency);
 void close_gui();
 void show_gui_score(MWScore &sc);
 void hide_gui_score();
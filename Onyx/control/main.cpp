@@ -8,9 +8,12 @@
 #include "Image.h"
 #include "mwscore.h"
 #include "Settings.h"
+#include "VideoRateController.h"
+#include "Histogram.h"
 #include <iostream>
 #include <boost/lexical_cast.hpp>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -19,10 +22,13 @@
 
 //  never run faster than 125 Hz?
 #define MIN_LOOP_TIME 0.008
+//  how often to re-send the video request (rate is set by the controller)
 #define VIDEO_REQUEST_INTERVAL 0.25
-#define VIDEO_REQUEST_WIDTH 1280
-#define VIDEO_REQUEST_HEIGHT 720
+//  default round-trip bound for the video rate controller; "max_latency" in control.json
+#define VIDEO_MAX_LATENCY 0.15
 #define Q_CHECK_INTERVAL 0.25
+//  how often to log latency percentiles
+#define LATENCY_LOG_INTERVAL 5.0
 
 unsigned short port = 6969;
 
@@ -33,11 +39,14 @@ INetwork *inet;
 IPacketizer *ipacketizer;
 
 bool has_robot = false;
+//  watching the video_group only: no input, no video requests, no lock
+bool spectating = false;
 double last_status_time = 0;
 int hitpoints = 21;
 unsigned short battery = 0;
 
 double last_vf_request;
+VideoRateController *video_rate;
 static GuiState gs;
 bool showing_score = false;
 bool inited_score = false;
@@ -219,7 +228,9 @@ void do_info(P_Info const *info) {
 
 void do_status(P_Status const *status) {
     if (!has_robot) {
-        inet->lock_address(5);
+        if (!spectating) {
+            inet->lock_address(5);
+        }
         has_robot = true;
     }
     last_status_time = itime->now();
@@ -234,6 +245,13 @@ void do_status(P_Status const *status) {
 boost::shared_ptr<Image> last_image;
 unsigned short last_image_seq;
 double last_image_time = 0;
+//  when the robot captured last_image, on my clock, or 0
+double last_image_captured = 0;
+//  from the robot's camera capturing a frame to it being decoded and on 
+//  screen here (see gui_shown_latency())
+LatencyHistogram glass_latency;
+HistogramCounts glass_prev;
+double last_glass = 0;
 
 void do_videoframe(P_VideoFrame const *videoframe, size_t size) {
     /*
@@ -248,6 +266,31 @@ void do_videoframe(P_VideoFrame const *videoframe, size_t size) {
     memcpy(d, &videoframe[1], size - sizeof(P_VideoFrame));
     last_image->complete_compressed(size - sizeof(P_VideoFrame));
     last_image_time = itime->now();
+    unsigned short nowms = (unsigned short)(long)(last_image_time * 1000);
+    unsigned short rtt = nowms - videoframe->stamp - videoframe->delay;
+    video_rate->on_rtt(rtt * 0.001);
+    video_rate->on_overflow(videoframe->overflows);
+    double offset = 0, clockRtt = 0;
+    last_image_captured = 0;
+    if (videoframe->capture != 0 && inet->peer_clock(offset, clockRtt)) {
+        //  the capture time is on the robot's clock
+        last_image_captured = videoframe->capture - offset;
+    }
+}
+
+void log_latency() {
+    HistogramCounts cur;
+    glass_latency.collect(cur);
+    LatencySummary glass;
+    LatencyHistogram::summarize(cur, glass_prev, glass);
+    glass_prev = cur;
+    LatencySummary rtt;
+    inet->rtt_latency(rtt);
+    char buf[200];
+    snprintf(buf, sizeof(buf), "glass-to-glass: %u frames  p50 %.1f  p99 %.1f ms;  "
+        "rtt: %u pings  p50 %.1f  p99 %.1f ms",
+        glass.count, glass.p50, glass.p99, rtt.count, rtt.p50, rtt.p99);
+    istatus->message(buf);
 }
 
 void dispatch(unsigned char type, size_t size, void const *data) {
@@ -304,17 +347,45 @@ void connect_mwscore(std::string const &addr) {
 }
 
 int main(int argc, char const *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--spectate")) {
+            spectating = true;
+        }
+        else {
+            fprintf(stderr, "usage: control [--spectate]\n");
+            exit(1);
+        }
+    }
 
     itime = newclock();
     istatus = mkstatus(itime, true);
     isocks = mksocks(port, istatus);
     inet = scan(isocks, itime, istatus);
+    //  a spectator can't NACK; the robot is locked to the pilot
+    inet->set_reliable(!spectating);
     ipacketizer = packetize(inet, istatus);
+    //  only the newest input and status matter
+    ipacketizer->set_state_channel(C2R_SetInput);
+    ipacketizer->set_state_channel(R2C_Status);
 
     boost::shared_ptr<Settings> theSettings(Settings::load("control.json"));
     if (theSettings->has_name("mwscore")) {
         connect_mwscore(theSettings->get_value("mwscore")->get_string());
     }
+    double maxLatency = VIDEO_MAX_LATENCY;
+    maybe_get(theSettings, "max_latency", maxLatency);
+    video_rate = new VideoRateController(maxLatency);
+    //  the robot sends video to this multicast group, if it has one
+    std::string video_group;
+    if (maybe_get(theSettings, "video_group", video_group)) {
+        if (!isocks->join_group(group_address(video_group))) {
+            istatus->error("Could not join video_group " + video_group + ".");
+        }
+    }
+    else if (spectating) {
+        fprintf(stderr, "control: --spectate needs a video_group in control.json\n");
+        exit(1);
+    }
 
     joyopen();
 
@@ -323,6 +394,7 @@ int main(int argc, char const *argv[]) {
     double then = itime->now();
     double bc = 0;
     double lastQCheck = then;
+    double lastLatencyLog = then;
     double q = 1;
     while (true) {
         double now = itime->now();
@@ -339,7 +411,7 @@ int main(int argc, char const *argv[]) {
             has_robot = false;
             inet->unlock_address();
         }
-        if (has_robot) {
+        if (has_robot && !spectating) {
             P_SetInput seti;
             memset(&seti, 0, sizeof(seti));
             seti.trot = trotvals[joytrotix];
@@ -353,14 +425,18 @@ int main(int argc, char const *argv[]) {
             ipacketizer->respond(C2R_SetInput, sizeof(seti), &seti);
             if (now > last_vf_request + VIDEO_REQUEST_INTERVAL) {
                 P_RequestVideo rv;
-                rv.width = VIDEO_REQUEST_WIDTH;
-                rv.height = VIDEO_REQUEST_HEIGHT;
+                rv.width = video_rate->width();
+                rv.height = video_rate->height();
                 rv.millis = (unsigned short)(VIDEO_REQUEST_INTERVAL * 1000 * 3);
+                rv.interval = (unsigned short)(video_rate->interval() * 1000);
+                rv.stamp = (unsigned short)(long)(now * 1000);
+                rv.fecData = video_rate->fec_data();
+                rv.fecParity = video_rate->fec_parity();
                 ipacketizer->respond(C2R_RequestVideo, sizeof(rv), &rv);
                 last_vf_request = now;
             }
         }
-        if (!has_robot && now > bc) {
+        if (!has_robot && !spectating && now > bc) {
             scan_for_robots();
             bc = now + 1;
         }
@@ -376,6 +452,13 @@ int main(int argc, char const *argv[]) {
             int lost = 0;
             int received = 0;
             inet->check_clear_loss(lost, received);
+            video_rate->on_loss(lost, received);
+            std::vector<PeerStats> peers;
+            inet->check_clear_loss(peers);
+            for (auto ptr(peers.begin()), end(peers.end()); ptr != end; ++ptr) {
+                video_rate->on_fragments((*ptr).received_, (*ptr).lost_, (*ptr).recovered_);
+            }
+            video_rate->update();
             if (lost == 0) {
                 q = q * 0.9 + 0.1;
             }
@@ -383,12 +466,20 @@ int main(int argc, char const *argv[]) {
                 q = q * 0.9 + 0.1 * ((double)received / ((double)received + lost));
             }
         }
+        if (now >= lastLatencyLog + LATENCY_LOG_INTERVAL) {
+            lastLatencyLog = now;
+            log_latency();
+        }
         gs.image = last_image;
+        gs.captured = last_image_captured;
         gs.image_old = (now - last_image_time > 0.2);
         gs.trot = trotvals[joytrotix];
         gs.pose = joypose;
         gs.hitpoints = hitpoints;
         gs.battery = battery;
+        double offset = 0, rtt = 0;
+        gs.rtt = inet->peer_clock(offset, rtt) ? rtt * 1000 : 0;
+        gs.glass = gs.image_old ? 0 : last_glass * 1000;
         gs.loss = q > 1 ? 0 : q < 0 ? 255 : (255 - (unsigned char)(255 * q));
         step_score();
         if (showing_score) {
@@ -399,6 +490,11 @@ int main(int argc, char const *argv[]) {
         }
         update_gui(gs);
         step_gui();
+        double glass = 0;
+        if (gui_shown_latency(glass)) {
+            glass_latency.record(glass);
+            last_glass = glass;
+        }
     }
 
     return 1;
@@ -71,6 +71,8 @@ void connect_score(char const *addr, unsigned short port, IStatus *status, ISock
     memcpy(&sin.sin_addr, ucbuf, 4);
     sin.sin_port = htons(port);
     sock = socks->connect(sin);
+    //  a line at a time; step_score() gives up on longer lines anyway
+    sock->set_max_buffer(64 * 1024);
     sock->send("add me please\n", 14);
     sock->step();
 }
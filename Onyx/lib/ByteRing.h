@@ -0,0 +1,151 @@
+#if !defined(rl2_ByteRing_h)
+#define rl2_ByteRing_h
+
+#include <sys/uio.h>
+#include <string.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+#include <boost/noncopyable.hpp>
+
+//  ByteRing is a circular byte buffer for stream sockets. It starts small
+//  and doubles (up to maxSize) as data piles up, so it only costs what the
+//  stream needs. The data, and the free space, are each at most two spans
+//  (either side of the wrap point), so they can go straight to readv()
+//  and writev() without compacting.
+//  Not thread safe.
+class ByteRing : public boost::noncopyable {
+public:
+    enum {
+        MIN_SIZE = 4096
+    };
+
+    ByteRing(size_t maxSize) : maxSize_(maxSize), head_(0), tail_(0) {}
+
+    //  bytes of data in the ring
+    size_t size() const {
+        return head_ - tail_;
+    }
+    //  bytes that may still be written, growing as needed
+    size_t space() const {
+        return size() < maxSize_ ? maxSize_ - size() : 0;
+    }
+    size_t capacity() const {
+        return buf_.size();
+    }
+    size_t max_size() const {
+        return maxSize_;
+    }
+    //  Lowering the cap below size() keeps what's there, but nothing more
+    //  can be written until it's read.
+    void set_max_size(size_t maxSize) {
+        maxSize_ = maxSize;
+    }
+
+    //  Grow so that at least min(want, space()) bytes can be written
+    //  without wrapping over the data.
+    void reserve(size_t want) {
+        if (want > space()) {
+            want = space();
+        }
+        size_t need = size() + want;
+        if (need <= buf_.size()) {
+            return;
+        }
+        size_t cap = buf_.empty() ? (size_t)MIN_SIZE : buf_.size();
+        while (cap < need) {
+            cap *= 2;
+        }
+        std::vector<char> nu(cap);
+        iovec data[2];
+        size_t n = read_spans(data);
+        size_t pos = 0;
+        for (size_t i = 0; i != n; ++i) {
+            memcpy(&nu[pos], data[i].iov_base, data[i].iov_len);
+            pos += data[i].iov_len;
+        }
+        buf_.swap(nu);
+        tail_ = 0;
+        head_ = pos;
+    }
+
+    //  The data, oldest first; returns the number of spans (0 to 2).
+    size_t read_spans(iovec oSpans[2]) {
+        return spans(tail_, size(), oSpans);
+    }
+    //  The free space, up to the cap, without growing; returns the
+    //  number of spans. Call reserve() first to get more.
+    size_t write_spans(iovec oSpans[2]) {
+        size_t avail = buf_.size() - size();
+        if (avail > space()) {
+            avail = space();
+        }
+        return spans(head_, avail, oSpans);
+    }
+
+    //  data was written to the write_spans()
+    void wrote(size_t n) {
+        head_ += n;
+    }
+    //  data was taken out of the read_spans()
+    void consumed(size_t n) {
+        tail_ += n;
+        if (tail_ == head_) {
+            //  empty; start over at the front, so small messages don't wrap
+            tail_ = head_ = 0;
+        }
+    }
+
+    //  copying versions of the above
+    size_t write(void const *src, size_t sz) {
+        reserve(sz);
+        iovec v[2];
+        size_t n = write_spans(v);
+        size_t done = 0;
+        for (size_t i = 0; i != n && done != sz; ++i) {
+            size_t c = std::min(v[i].iov_len, sz - done);
+            memcpy(v[i].iov_base, (char const *)src + done, c);
+            done += c;
+        }
+        wrote(done);
+        return done;
+    }
+    size_t peek(void *dst, size_t sz) {
+        iovec v[2];
+        size_t n = read_spans(v);
+        size_t done = 0;
+        for (size_t i = 0; i != n && done != sz; ++i) {
+            size_t c = std::min(v[i].iov_len, sz - done);
+            memcpy((char *)dst + done, v[i].iov_base, c);
+            done += c;
+        }
+        return done;
+    }
+
+private:
+    size_t spans(size_t pos, size_t len, iovec oSpans[2]) {
+        if (len == 0) {
+            return 0;
+        }
+        size_t mask = buf_.size() - 1;
+        size_t start = pos & mask;
+        size_t first = std::min(len, buf_.size() - start);
+        oSpans[0].iov_base = &buf_[start];
+        oSpans[0].iov_len = first;
+        if (first == len) {
+            return 1;
+        }
+        oSpans[1].iov_base = &buf_[0];
+        oSpans[1].iov_len = len - first;
+        return 2;
+    }
+
+    std::vector<char> buf_;
+    size_t maxSize_;
+    //  head_ is where the next byte goes, tail_ where the oldest is; both
+    //  count up, and are taken modulo the (power of two) capacity
+    size_t head_;
+    size_t tail_;
+};
+
+#endif  //  rl2_ByteRing_h
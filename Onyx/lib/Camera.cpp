@@ -2,6 +2,7 @@
 #include "Camera.h"
 #include "Image.h"
 #include "Settings.h"
+#include "util.h"
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -236,14 +237,30 @@ void Camera::wait() {
         throw std::runtime_error(error);
     }
     bufs_[vbuf.index].queued = false;
+    //  The driver stamps the buffer when the frame starts coming in; turn 
+    //  that into read_clock() time by how long ago it was.
+    double captured = read_clock();
+    if ((vbuf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        double age = (ts.tv_sec - vbuf.timestamp.tv_sec) +
+            (ts.tv_nsec * 1e-9 - vbuf.timestamp.tv_usec * 1e-6);
+        if (age > 0 && age < 1) {
+            captured -= age;
+        }
+    }
 
     /* shuffle the data over to the output buffer here */
     unsigned int osz = vbuf.bytesused;
     void *iptr = bufs_[vbuf.index].ptr;
-    void *optr = forGrabbing_[nextImgToUse_]->alloc_compressed(osz);
-    memcpy(optr, iptr, osz);
+    if (!forGrabbing_[nextImgToUse_].unique()) {
+        //  Someone (the network send queue) still references the bits of 
+        //  this image, so it can't be overwritten. Grab into a new one.
+        forGrabbing_[nextImgToUse_] = boost::shared_ptr<Image>(new Image());
+    }
     try {
-        forGrabbing_[nextImgToUse_]->complete_compressed(osz);
+        forGrabbing_[nextImgToUse_]->assign_compressed(iptr, osz);
+        forGrabbing_[nextImgToUse_]->set_capture_time(captured);
         nextImgToUse_ += 1;
         if (nextImgToUse_ == NUM_BUFS) {
             nextImgToUse_ = 0;
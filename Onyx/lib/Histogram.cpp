@@ -0,0 +1,93 @@
+
+#include "Histogram.h"
+#include <string.h>
+
+
+HistogramCounts::HistogramCounts() {
+    memset(counts_, 0, sizeof(counts_));
+    max_ = 0;
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for (size_t i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+        counts_[i] = 0;
+    }
+    max_ = 0;
+}
+
+size_t LatencyHistogram::bucket_of(uint32_t usec) {
+    if (usec < HISTOGRAM_SUB_COUNT) {
+        return usec;
+    }
+    int shift = 31 - __builtin_clz(usec) - HISTOGRAM_SUB_BITS;
+    size_t b = ((shift + 1) << HISTOGRAM_SUB_BITS) + ((usec >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+    if (b >= HISTOGRAM_BUCKETS) {
+        b = HISTOGRAM_BUCKETS - 1;
+    }
+    return b;
+}
+
+uint32_t LatencyHistogram::bucket_top(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_COUNT) {
+        return bucket;
+    }
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    return ((HISTOGRAM_SUB_COUNT + (bucket & (HISTOGRAM_SUB_COUNT - 1)) + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(double seconds) {
+    uint32_t usec = 0;
+    if (seconds > 0) {
+        usec = (seconds >= 4000.0) ? 0xffffffffU : (uint32_t)(seconds * 1e6);
+    }
+    counts_[bucket_of(usec)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t m = max_.load(std::memory_order_relaxed);
+    while (usec > m && !max_.compare_exchange_weak(m, usec, std::memory_order_relaxed)) {
+        //  m was re-loaded; try again
+    }
+}
+
+void LatencyHistogram::collect(HistogramCounts &oCounts) {
+    for (size_t i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+        oCounts.counts_[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    oCounts.max_ = max_.exchange(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::summarize(HistogramCounts const &cur, HistogramCounts const &prev,
+    LatencySummary &oSummary) {
+    uint32_t total = 0;
+    for (size_t i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+        total += cur.counts_[i] - prev.counts_[i];
+    }
+    oSummary.count = total;
+    oSummary.max = cur.max_ * 1e-3f;
+    double const quantiles[3] = { 0.5, 0.99, 0.999 };
+    float *values[3] = { &oSummary.p50, &oSummary.p99, &oSummary.p999 };
+    size_t b = 0;
+    uint32_t seen = 0;
+    for (size_t q = 0; q != 3; ++q) {
+        *values[q] = 0;
+        if (!total) {
+            continue;
+        }
+        //  the smallest bucket that has at least this many samples at or below it
+        uint32_t want = (uint32_t)(quantiles[q] * total);
+        if (want < 1) {
+            want = 1;
+        }
+        while (b != HISTOGRAM_BUCKETS) {
+            uint32_t n = cur.counts_[b] - prev.counts_[b];
+            if (seen + n >= want) {
+                break;
+            }
+            seen += n;
+            ++b;
+        }
+        uint32_t top = bucket_top(b < HISTOGRAM_BUCKETS ? b : HISTOGRAM_BUCKETS - 1);
+        if (top > cur.max_) {
+            top = cur.max_;
+        }
+        *values[q] = top * 1e-3f;
+    }
+}
@@ -0,0 +1,54 @@
+#if !defined(rl2_Histogram_h)
+#define rl2_Histogram_h
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include <boost/noncopyable.hpp>
+
+//  LatencyHistogram counts latencies in log-spaced buckets, the way HDR
+//  histograms do: values are kept in microseconds, and each power of two
+//  is split into 1 << HISTOGRAM_SUB_BITS linear buckets, so every bucket
+//  is within 12.5% of the values in it. record() is lock-free and may be
+//  called from any thread; collect() is for a single reader, which 
+//  turns two collections into a LatencySummary for the time in between.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+//  up to 2^27 microseconds, or about two minutes
+#define HISTOGRAM_OCTAVES 24
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_OCTAVES + 1) * HISTOGRAM_SUB_COUNT)
+
+struct HistogramCounts {
+    HistogramCounts();
+    uint32_t counts_[HISTOGRAM_BUCKETS];
+    //  largest value since the previous collect()
+    uint32_t max_;
+};
+
+//  This is what goes into the log, so keep it plain.
+struct LatencySummary {
+    uint32_t count;
+    float p50;
+    float p99;
+    float p999;
+    float max;
+};
+
+class LatencyHistogram : public boost::noncopyable {
+public:
+    LatencyHistogram();
+    void record(double seconds);
+    void collect(HistogramCounts &oCounts);
+
+    static size_t bucket_of(uint32_t usec);
+    static uint32_t bucket_top(size_t bucket);
+    //  summary of what was recorded between prev and cur, in milliseconds
+    static void summarize(HistogramCounts const &cur, HistogramCounts const &prev,
+        LatencySummary &oSummary);
+
+private:
+    std::atomic<uint32_t> counts_[HISTOGRAM_BUCKETS];
+    std::atomic<uint32_t> max_;
+};
+
+#endif  //  rl2_Histogram_h
@@ -15,7 +15,8 @@ Image::Image() :
     width_(0),
     height_(0),
     dirty_(0),
-    hashuff_(false) {
+    hashuff_(false),
+    captureTime_(0) {
 }
 
 Image::~Image() {
@@ -49,6 +50,34 @@ void Image::complete_compressed(size_t size) {
     dirty_ = size;
 }
 
+void Image::assign_compressed(void const *data, size_t size, bool has_huff) {
+    hashuff_ = has_huff;
+    if (has_huff) {
+        compressed_.resize(size);
+        memcpy(&compressed_[0], data, size);
+        dirty_ = size;
+        return;
+    }
+    unsigned char const *src = (unsigned char const *)data;
+    unsigned char const *ptr = src;
+    unsigned char const *end = src + size;
+    while (ptr + 1 < end) {
+        if (ptr[0] == 0xff && ptr[1] == 0xda) {
+            break;
+        }
+        ++ptr;
+    }
+    if (ptr + 1 >= end) {
+        throw std::runtime_error("Invalid MJPEG data in Image::assign_compressed()");
+    }
+    compressed_.resize(size + huff_size);
+    size_t head = ptr - src;
+    memcpy(&compressed_[0], src, head);
+    memcpy(&compressed_[head], huff_table, huff_size);
+    memcpy(&compressed_[head + huff_size], ptr, end - ptr);
+    dirty_ = size;
+}
+
 size_t Image::width(ImageBits kind) const {
     undirty();
     return (kind == ThumbnailBits) ? width_t() : width_;
@@ -79,6 +108,14 @@ size_t Image::size(ImageBits ib) const {
     return vec(ib).size();
 }
 
+double Image::capture_time() const {
+    return captureTime_;
+}
+
+void Image::set_capture_time(double t) {
+    captureTime_ = t;
+}
+
 std::vector<char> const &Image::vec(ImageBits ib) const {
     switch (ib) {
         case CompressedBits:
@@ -103,6 +140,38 @@ void Image::undirty() const {
 }
 
 
+void Image::compress(ImageBits kind, int quality, std::vector<char> &out) const {
+    undirty();
+    if (kind == CompressedBits) {
+        throw std::runtime_error("Image::compress() of CompressedBits");
+    }
+    jpeg_compress_struct cinfo;
+    memset(&cinfo, 0, sizeof(cinfo));
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char *mem = 0;
+    unsigned long memsize = 0;
+    jpeg_mem_dest(&cinfo, &mem, &memsize);
+    cinfo.image_width = width(kind);
+    cinfo.image_height = height(kind);
+    cinfo.input_components = BytesPerPixel;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    unsigned char *data = (unsigned char *)&vec(kind)[0];
+    size_t rowbytes = cinfo.image_width * BytesPerPixel;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = data + cinfo.next_scanline * rowbytes;
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    out.assign((char const *)mem, (char const *)mem + memsize);
+    free(mem);
+}
+
 void Image::decompress(size_t size) const {
     jpeg_decompress_struct cinfo;
     memset(&cinfo, 0, sizeof(cinfo));
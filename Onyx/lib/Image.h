@@ -24,17 +24,28 @@ public:
     //  JPEG data, to decompress it and calculate the thumbnail
     void *alloc_compressed(size_t size, bool has_huff = false);
     void complete_compressed(size_t size);
+    //  assign_compressed() is alloc_compressed() + copy + complete_compressed() 
+    //  in one pass, splicing in the Huffman table while copying instead of 
+    //  moving the data around afterwards.
+    void assign_compressed(void const *data, size_t size, bool has_huff = false);
+    //  compress() encodes the FullBits or ThumbnailBits as a JPEG (with 
+    //  Huffman tables) into out.
+    void compress(ImageBits kind, int quality, std::vector<char> &out) const;
     size_t width(ImageBits kind = FullBits) const;
     size_t height(ImageBits kind = FullBits) const;
     size_t width_t() const;
     size_t height_t() const;
     void const *bits(ImageBits) const;
     size_t size(ImageBits) const;
+    //  when the camera captured the image, as read_clock(), or 0 if unknown
+    double capture_time() const;
+    void set_capture_time(double t);
 private:
     mutable size_t width_;
     mutable size_t height_;
     mutable size_t dirty_;
     mutable bool hashuff_;
+    double captureTime_;
     mutable std::vector<char> compressed_;
     mutable std::vector<char> uncompressed_;
     mutable std::vector<char> thumbnail_;
@@ -0,0 +1,219 @@
+
+#include "NetEmulator.h"
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <stdexcept>
+#include <algorithm>
+
+
+class EmuSockets : public ISockets {
+public:
+    EmuSockets(NetEmulator *emu, unsigned short port) : emu_(emu), port_(port) {}
+
+    virtual int recvfrom(void *buf, size_t sz, sockaddr_in &addr) {
+        return emu_->receive(port_, buf, sz, addr);
+    }
+    virtual int sendto(void const *buf, size_t sz, sockaddr_in const &addr) {
+        emu_->send(port_, buf, sz, addr);
+        return (int)sz;
+    }
+    virtual bool join_group(sockaddr_in const &group) {
+        return emu_->join(port_, group);
+    }
+    virtual boost::shared_ptr<ISocket> connect(sockaddr_in const &addr) {
+        throw std::runtime_error("NetEmulator does not do TCP connections.");
+    }
+
+    NetEmulator *emu_;
+    unsigned short port_;
+};
+
+
+LinkParams::LinkParams() :
+    latency(0),
+    jitter(0),
+    bandwidth(0),
+    queueBytes(256 * 1024),
+    pGoodBad(0),
+    pBadGood(1),
+    lossGood(0),
+    lossBad(0),
+    reorder(0),
+    reorderDelay(0.005) {
+}
+
+
+NetEmulator::NetEmulator(ITime *time, unsigned int seed) :
+    time_(time),
+    random_(seed * 0x9e3779b97f4a7c15ULL + 1) {
+}
+
+NetEmulator::~NetEmulator() {
+    for (auto ptr(nodes_.begin()), end(nodes_.end()); ptr != end; ++ptr) {
+        delete (*ptr)->socks_;
+        delete *ptr;
+    }
+}
+
+ISockets *NetEmulator::endpoint(unsigned short port, LinkParams const &up) {
+    boost::mutex::scoped_lock lock(lock_);
+    if (port == 0 || find(port)) {
+        throw std::runtime_error("NetEmulator endpoint port is zero or already taken.");
+    }
+    node *n = new node();
+    n->port_ = port;
+    n->socks_ = new EmuSockets(this, port);
+    n->up_.params_ = up;
+    memset(&n->up_.stats_, 0, sizeof(n->up_.stats_));
+    n->up_.bad_ = false;
+    n->up_.wireFree_ = 0;
+    n->up_.lastDue_ = 0;
+    nodes_.push_back(n);
+    return n->socks_;
+}
+
+void NetEmulator::set_link(unsigned short port, LinkParams const &up) {
+    boost::mutex::scoped_lock lock(lock_);
+    node *n = find(port);
+    if (!n) {
+        throw std::runtime_error("NetEmulator has no endpoint at that port.");
+    }
+    n->up_.params_ = up;
+}
+
+LinkStats NetEmulator::stats(unsigned short port) {
+    boost::mutex::scoped_lock lock(lock_);
+    node *n = find(port);
+    if (!n) {
+        throw std::runtime_error("NetEmulator has no endpoint at that port.");
+    }
+    return n->up_.stats_;
+}
+
+NetEmulator::node *NetEmulator::find(unsigned short port) {
+    for (auto ptr(nodes_.begin()), end(nodes_.end()); ptr != end; ++ptr) {
+        if ((*ptr)->port_ == port) {
+            return *ptr;
+        }
+    }
+    return 0;
+}
+
+//  xorshift64*; good enough for coin flips, and the same everywhere
+double NetEmulator::uniform() {
+    random_ ^= random_ >> 12;
+    random_ ^= random_ << 25;
+    random_ ^= random_ >> 27;
+    return (double)((random_ * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool NetEmulator::join(unsigned short port, sockaddr_in const &group) {
+    boost::mutex::scoped_lock lock(lock_);
+    node *n = find(port);
+    if (!n || !IN_MULTICAST(ntohl(group.sin_addr.s_addr))) {
+        return false;
+    }
+    n->groups_.push_back(group.sin_addr.s_addr);
+    return true;
+}
+
+void NetEmulator::send(unsigned short fromPort, void const *buf, size_t sz, sockaddr_in const &to) {
+    boost::mutex::scoped_lock lock(lock_);
+    node *src = find(fromPort);
+    double now = time_->now();
+    unsigned short port = ntohs(to.sin_port);
+    bool mcast = IN_MULTICAST(ntohl(to.sin_addr.s_addr));
+    bool bcast = !mcast && (port == 0 || to.sin_addr.s_addr == INADDR_BROADCAST);
+    for (auto ptr(nodes_.begin()), end(nodes_.end()); ptr != end; ++ptr) {
+        if (*ptr == src) {
+            continue;
+        }
+        if (mcast ? std::find((*ptr)->groups_.begin(), (*ptr)->groups_.end(),
+                to.sin_addr.s_addr) != (*ptr)->groups_.end() :
+                (bcast || (*ptr)->port_ == port)) {
+            transmit(*src, **ptr, buf, sz, now);
+        }
+    }
+}
+
+void NetEmulator::transmit(node &src, node &dst, void const *buf, size_t sz, double now) {
+    link &l(src.up_);
+    LinkParams const &p(l.params_);
+    l.stats_.sent_ += 1;
+    l.stats_.bytes_ += sz;
+
+    //  the wire (and its queue) comes first; what doesn't fit is dropped
+    double depart = now;
+    if (p.bandwidth > 0) {
+        double start = std::max(now, l.wireFree_);
+        if ((start - now) * p.bandwidth > p.queueBytes) {
+            l.stats_.queueDrops_ += 1;
+            return;
+        }
+        depart = start + sz / p.bandwidth;
+        l.wireFree_ = depart;
+    }
+
+    if (l.bad_) {
+        l.bad_ = uniform() >= p.pBadGood;
+    }
+    else {
+        l.bad_ = uniform() < p.pGoodBad;
+    }
+    if (uniform() < (l.bad_ ? p.lossBad : p.lossGood)) {
+        l.stats_.lost_ += 1;
+        return;
+    }
+
+    double due = depart + p.latency + p.jitter * uniform();
+    if (p.reorder > 0 && uniform() < p.reorder) {
+        due += p.reorderDelay;
+        l.stats_.reordered_ += 1;
+    }
+    else {
+        //  jitter doesn't reorder a FIFO link
+        due = std::max(due, l.lastDue_);
+        l.lastDue_ = due;
+    }
+    l.stats_.delivered_ += 1;
+
+    packet &pk((*dst.inbox_.insert(std::pair<double, packet>(due, packet()))).second);
+    memset(&pk.from_, 0, sizeof(pk.from_));
+    pk.from_.sin_family = AF_INET;
+    pk.from_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pk.from_.sin_port = htons(src.port_);
+    pk.data_.assign((char const *)buf, (char const *)buf + sz);
+}
+
+int NetEmulator::receive(unsigned short port, void *buf, size_t sz, sockaddr_in &from) {
+    boost::mutex::scoped_lock lock(lock_);
+    node *n = find(port);
+    double now = time_->now();
+    if (!n || n->inbox_.empty() || (*n->inbox_.begin()).first > now) {
+        errno = EAGAIN;
+        return -1;
+    }
+    packet &pk((*n->inbox_.begin()).second);
+    //  like UDP, a short buffer truncates the datagram
+    size_t r = std::min(sz, pk.data_.size());
+    if (r) {
+        memcpy(buf, &pk.data_[0], r);
+    }
+    from = pk.from_;
+    n->inbox_.erase(n->inbox_.begin());
+    return (int)r;
+}
+
+
+VirtualTime::VirtualTime(double start) :
+    time_(start) {
+}
+
+double VirtualTime::now() {
+    return time_;
+}
+
+void VirtualTime::sleep(double t) {
+    time_ += t;
+}
@@ -0,0 +1,115 @@
+#if !defined(rl2_NetEmulator_h)
+#define rl2_NetEmulator_h
+
+#include "inetwork.h"
+#include "itime.h"
+#include <map>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+//  One direction of an emulated link, from an endpoint to its peers.
+struct LinkParams {
+    LinkParams();
+    //  one way delay, plus up to jitter more (uniformly distributed);
+    //  packets still arrive in order, unless reordered below
+    double latency;
+    double jitter;
+    //  bytes per second on the wire, or 0 for no limit; past queueBytes
+    //  waiting to go out, the link drops what's sent (drop tail)
+    double bandwidth;
+    size_t queueBytes;
+    //  Gilbert-Elliott loss: each packet, the link goes from good to bad
+    //  with probability pGoodBad, and back with pBadGood, then loses the
+    //  packet with the probability for the state it's in
+    double pGoodBad;
+    double pBadGood;
+    double lossGood;
+    double lossBad;
+    //  chance that a packet is held back reorderDelay longer than the
+    //  rest, so later packets pass it
+    double reorder;
+    double reorderDelay;
+};
+
+//  What happened to the packets an endpoint sent.
+struct LinkStats {
+    size_t sent_;
+    size_t bytes_;
+    size_t delivered_;
+    size_t lost_;
+    size_t queueDrops_;
+    size_t reordered_;
+};
+
+class EmuSockets;
+
+//  NetEmulator is an in-process network between ISockets endpoints,
+//  for running a robot and a control station (or any two INetworks)
+//  against each other on one machine under repeatable conditions.
+//  Every endpoint is 127.0.0.1 at some port; a datagram to port 0 or to
+//  the broadcast address goes to all the other endpoints, and one to a
+//  multicast address to the endpoints that joined that group. Packets
+//  become receivable when the time says they have crossed the link, so
+//  with a VirtualTime the whole thing runs as fast as the CPU allows, and
+//  the same seed gives the same losses. Endpoints have no descriptor to wait
+//  on, so threaded INetworks fall back to sleeping.
+//  The emulator owns the endpoints. It is thread safe.
+class NetEmulator : public boost::noncopyable {
+public:
+    NetEmulator(ITime *time, unsigned int seed = 1);
+    ~NetEmulator();
+
+    //  what the endpoint at port sends goes over a link with params up
+    ISockets *endpoint(unsigned short port, LinkParams const &up);
+    void set_link(unsigned short port, LinkParams const &up);
+    LinkStats stats(unsigned short port);
+
+private:
+    friend class EmuSockets;
+    struct packet {
+        sockaddr_in from_;
+        std::vector<char> data_;
+    };
+    struct link {
+        LinkParams params_;
+        LinkStats stats_;
+        bool bad_;
+        //  when the wire is free again, and when the last in-order
+        //  packet arrives
+        double wireFree_;
+        double lastDue_;
+    };
+    struct node {
+        unsigned short port_;
+        EmuSockets *socks_;
+        link up_;
+        std::vector<in_addr_t> groups_;
+        //  by arrival time; equal times stay in send order
+        std::multimap<double, packet> inbox_;
+    };
+
+    bool join(unsigned short port, sockaddr_in const &group);
+    void send(unsigned short fromPort, void const *buf, size_t sz, sockaddr_in const &to);
+    int receive(unsigned short port, void *buf, size_t sz, sockaddr_in &from);
+    void transmit(node &src, node &dst, void const *buf, size_t sz, double now);
+    node *find(unsigned short port);
+    double uniform();
+
+    ITime *time_;
+    boost::mutex lock_;
+    std::vector<node *> nodes_;
+    unsigned long long random_;
+};
+
+//  VirtualTime only moves when slept (or advanced); share one between
+//  the INetworks and the NetEmulator to run in simulated time.
+class VirtualTime : public ITime {
+public:
+    VirtualTime(double start = 1.0);
+    virtual double now();
+    virtual void sleep(double t);
+    double time_;
+};
+
+#endif  //  rl2_NetEmulator_h
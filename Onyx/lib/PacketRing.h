@@ -0,0 +1,92 @@
+#if !defined(rl2_PacketRing_h)
+#define rl2_PacketRing_h
+
+#include <atomic>
+#include <assert.h>
+#include <stddef.h>
+#include <boost/noncopyable.hpp>
+
+#define CACHE_LINE_SIZE 64
+
+//  Packet is one USB transfer worth of data. Packets live in the slots
+//  of a PacketRing, and are padded to a whole number of cache lines.
+//  (Not alignas(), as that needs aligned operator new, which gnu++11 
+//  doesn't have.)
+class Packet {
+public:
+    Packet() : size_(0), time_(0) {}
+    void set_size(size_t sz) { assert(sz <= max_size()); size_ = sz; }
+    //  when the packet was queued
+    void set_time(double t) { time_ = t; }
+    double time() const { return time_; }
+    unsigned char *buffer() { return data_; }
+    unsigned char const *buffer() const { return data_; }
+    size_t size() const { return size_; };
+    size_t max_size() const { return sizeof(data_); }
+private:
+    unsigned char data_[128];
+    size_t size_;
+    double time_;
+    char pad_[CACHE_LINE_SIZE - sizeof(size_t) - sizeof(double)];
+};
+
+//  PacketRing is a fixed size single-producer, single-consumer queue of
+//  Packets (or of some other plain type T). The producer fills in the 
+//  slot from begin_write() and publishes it with end_write(); the 
+//  consumer looks at the slot from begin_read() and gives it back with 
+//  end_read(). Neither side locks or allocates. Exactly one thread may 
+//  be the producer, and exactly one thread may be the consumer (or 
+//  several, taking turns under a lock).
+//  The "ahead" argument lets the producer fill, or the consumer look at,
+//  slots past the next one, for keeping several transfers in flight;
+//  slots are still published and given back strictly in order.
+template<size_t Size, typename T = Packet>
+class PacketRing : public boost::noncopyable {
+public:
+    PacketRing() : head_(0), tail_(0) {
+        static_assert((Size & (Size - 1)) == 0, "PacketRing size must be a power of two");
+    }
+
+    //  producer side
+    T *begin_write(size_t ahead = 0) {
+        size_t h = head_.load(std::memory_order_relaxed) + ahead;
+        if (h - tail_.load(std::memory_order_acquire) >= Size) {
+            return 0;
+        }
+        return &slots_[h & (Size - 1)];
+    }
+    void end_write() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    //  consumer side
+    T *begin_read(size_t ahead = 0) {
+        size_t t = tail_.load(std::memory_order_relaxed);
+        if (head_.load(std::memory_order_acquire) - t <= ahead) {
+            return 0;
+        }
+        return &slots_[(t + ahead) & (Size - 1)];
+    }
+    void end_read() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    //  a snapshot; exact only from the producer or consumer thread
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+    size_t capacity() const {
+        return Size;
+    }
+
+private:
+    //  head_ is written by the producer only, and tail_ by the consumer 
+    //  only; keep them on different cache lines.
+    std::atomic<size_t> head_;
+    char pad1_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail_;
+    char pad2_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+    T slots_[Size];
+};
+
+#endif  //  rl2_PacketRing_h
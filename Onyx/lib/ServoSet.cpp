@@ -2,7 +2,9 @@
 #include "Settings.h"
 #include "ServoSet.h"
 #include "USBLink.h"
+#include "USBSim.h"
 #include "util.h"
+#include "TelemetryScheduler.h"
 #include "istatus.h"
 #include <stdexcept>
 #include <boost/lexical_cast.hpp>
@@ -25,70 +27,21 @@
 #define DEFAULT_TORQUE_LIMIT 1023
 #define DEFAULT_TORQUE_STEPS 1
 
+//  at least this many packets may be outstanding; more if the USBLink 
+//  keeps more transfers in flight
 #define MAX_OUTSTANDING_PACKETS 3
 
-static const unsigned char read_regs[] = {
-    REG_MODEL_NUMBER,
-    REG_MODEL_NUMBER_HI,
-    REG_VERSION,
-    REG_ID,
-    REG_BAUD_RATE,
-    REG_RETURN_DELAY_TIME,
-    REG_CW_ANGLE_LIMIT,
-    REG_CW_ANGLE_LIMIT_HI,
-    REG_CCW_ANGLE_LIMIT,
-    REG_CCW_ANGLE_LIMIT_HI,
-    REG_HIGHEST_LIMIT_TEMPERATURE,
-    REG_LOWEST_LIMIT_VOLTAGE,
-    REG_HIGHEST_LIMIT_VOLTAGE,
-    REG_MAX_TORQUE,
-    REG_MAX_TORQUE_HI,
-    REG_STATUS_RETURN_LEVEL,
-    REG_ALARM_LED,
-    REG_ALARM_SHUTDOWN,
-
-    //  Volatile
-    REG_TORQUE_ENABLE,
-    REG_LED,
-    REG_D_GAIN,
-    REG_I_GAIN,
-    REG_P_GAIN,
-    REG_GOAL_POSITION,
-    REG_GOAL_POSITION_HI,
-    REG_MOVING_SPEED,
-    REG_MOVING_SPEED_HI,
-    REG_TORQUE_LIMIT,
-    REG_TORQUE_LIMIT_HI,
-    REG_PRESENT_POSITION,
-    REG_PRESENT_POSITION_HI,
-    REG_PRESENT_SPEED,
-    REG_PRESENT_SPEED_HI,
-    REG_PRESENT_LOAD,
-    REG_PRESENT_LOAD_HI,
-    REG_PRESENT_VOLTAGE,
-    REG_PRESENT_TEMPERATURE,
-    REG_REGISTERED,
-    REG_MOVING,
-    REG_LOCK,
-    REG_PUNCH,
-    REG_PUNCH_HI,
-    REG_CURRENT,
-    REG_CURRENT_HI,
-    REG_TORQUE_CONTROL_MODE_ENABLE,
-    REG_GOAL_TORQUE,
-    REG_GOAL_TORQUE_HI,
-    REG_GOAL_ACCELERATION,
-};
-
-static const unsigned char frequent_read_regs[] = {
-    REG_PRESENT_POSITION, 8,
-    REG_CURRENT, 2
-};
+#define USB_PACKET_SIZE 64
+//  what packets were limited to before OpSyncWrite/OpBulkRead
+#define LEGACY_PACKET_SIZE 56
+//  out bytes of each packet that reads may use; writes get the rest
+#define READ_PACKET_BYTES 20
+//  torque ramps (see Servo::set_torque()) take a step this often
+#define TORQUE_STEP_PERIOD 0.1
 
 Servo::Servo(unsigned char id, unsigned short neutral, ServoSet &ss) :
     ss_(ss),
     id_(id),
-    lastSlowRd_(0),
     updateTorque_(10),
     torqueSteps_(10),
     neutral_(neutral),
@@ -125,6 +78,7 @@ void Servo::set_goal_position(unsigned short gp) {
     //  don't update the position if it's already updated
     if (get_reg2(REG_GOAL_POSITION) != gp) {
         set_reg2(REG_GOAL_POSITION, gp);
+        ss_.store_->set(TF_GOAL, id_, gp, read_clock());
     }
 }
 
@@ -207,15 +161,7 @@ unsigned short Servo::get_reg2(unsigned char reg) const {
 }
 
 unsigned int Servo::queue_depth() const {
-    unsigned int cnt = 0;
-    for (std::vector<servo_cmd>::iterator ptr(ss_.cmds_.begin()), end(ss_.cmds_.end());
-        ptr != end;
-        ++ptr) {
-        if ((*ptr).id == id_) {
-            ++cnt;
-        }
-    }
-    return cnt;
+    return ss_.servoDepth_[id_];
 }
 
 
@@ -239,30 +185,76 @@ DummyStatus dummy_status;
 
 
 ServoSet::ServoSet(bool usb, boost::shared_ptr<Logger> const &l, IStatus *status) {
-    if (!status) {
-        status = &dummy_status;
-    }
-    istatus_ = status;
     boost::shared_ptr<Settings> st(Settings::load("settings.ini"));
     if (usb) {
-        usbModule_ = USBLink::open(st, l);
-        usb_ = usbModule_->cast_as<USBLink>();
+        //  "backend":"sim" runs against a simulated board and servos
+        std::string backend("usb");
+        maybe_get(st, "backend", backend);
+        if (backend == "sim") {
+            usbModule_ = USBSim::open(st, l);
+            usb_ = usbModule_->cast_as<USBSim>();
+        }
+        else if (backend == "usb") {
+            usbModule_ = USBLink::open(st, l);
+            usb_ = usbModule_->cast_as<USBLink>();
+        }
+        else {
+            throw std::runtime_error("Unknown backend '" + backend + "' in settings.ini.");
+        }
     }
     else {
         usb_ = nullptr;
     }
-    pollIx_ = 0;
+    //  Batching needs firmware that knows OpSyncWrite and OpBulkRead; 
+    //  older boards stop on the first one, so it's only on when asked for.
+    long batch = 0;
+    maybe_get(st, "batch", batch);
+    batching_ = batch != 0;
+    //  "telemetry":{"position":200,"eeprom":0,...} changes read rates
+    boost::shared_ptr<Settings> rates;
+    if (!!st) {
+        rates = st->get_value("telemetry");
+    }
+    if (!!rates) {
+        for (size_t i = 0, n = rates->num_names(); i != n; ++i) {
+            std::string const &name(rates->get_name_at(i));
+            telemetry_.set_rate(name, rates->get_value(name)->get_double());
+        }
+    }
+    init(status);
+}
+
+ServoSet::ServoSet(IUSBLink *usb, IStatus *status) {
+    usb_ = usb;
+    batching_ = false;
+    init(status);
+}
+
+void ServoSet::init(IStatus *status) {
+    if (!status) {
+        status = &dummy_status;
+    }
+    istatus_ = status;
+    maxOutstanding_ = MAX_OUTSTANDING_PACKETS;
+    if (usb_ && usb_->in_flight() > maxOutstanding_) {
+        maxOutstanding_ = usb_->in_flight();
+    }
     torqueLimit_ = DEFAULT_TORQUE_LIMIT; //  some fraction of max power
     torqueSteps_ = DEFAULT_TORQUE_STEPS;
-    lastServoId_ = 0;
     lastSeq_ = nextSeq_ = 0;
     lastOutSeq_ = -1;
+    fifoHead_ = 0;
+    fifoCount_ = 0;
+    cmdDepth_ = 0;
+    memset(regDepth_, 0, sizeof(regDepth_));
     lastStep_ = 0;
+    lastTorqueStep_ = 0;
     lastSend_ = 0;
     battery_ = 0;
     power_ = 0;
     powerFail_ = 0;
-    if (usb) {
+    store_ = boost::shared_ptr<TelemetryStore>(new TelemetryStore());
+    if (usb_) {
         //  Compensate for a bug: first packet doesn't register unless 
         //  the receiver board is freshly reset (?!)
         unsigned char nop[] = { 0, OpGetStatus | 1, TargetPower };
@@ -286,6 +278,7 @@ Servo &ServoSet::add_servo(unsigned char id, unsigned short neutral) {
     assert(neutral < 4096);
     if (servos_.size() <= id) {
         servos_.resize(id + 1);
+        grow_cmds(id + 1);
     }
     if (!!servos_[id]) {
         throw new std::runtime_error("Servo with duplicate ID added.");
@@ -296,6 +289,7 @@ Servo &ServoSet::add_servo(unsigned char id, unsigned short neutral) {
 #define GET_REGS (OpReadServo | 3)
 
     servos_[id] = boost::shared_ptr<Servo>(new Servo(id, neutral, *this));
+    telemetry_.add_servo(id, read_clock());
     unsigned short torque = std::min((unsigned short)103, torqueLimit_);
     if (!!usb_) {
         unsigned char set_regs_pack[] = {
@@ -343,17 +337,15 @@ void ServoSet::step() {
     }
 
     //  pack up as many commands as can fit in a single USB packet
-    unsigned char buf[56];
+    unsigned char buf[USB_PACKET_SIZE];
     unsigned char bufptr = 0;
 
-    //  keep track of size of reply
-    bool delayread = false;
     bool timeready = false;
     double now = read_clock();
     if (now - lastStep_ >= 0.001) {
         lastStep_ = floor(now * 1000) * 0.001;
         timeready = true;
-        if (nextSeq_ - lastSeq_ >= 3) {
+        if ((unsigned char)(nextSeq_ - lastSeq_) >= maxOutstanding_) {
             //  force out at least one packet per 100 ms
             if (now - lastSend_ > SEQ_TIMEOUT) {
                 std::stringstream strstr;
@@ -368,94 +360,26 @@ void ServoSet::step() {
 
     //  select next servo
     if (timeready && servos_.size()) {
-        if ((unsigned char)(nextSeq_ - lastSeq_) < MAX_OUTSTANDING_PACKETS) {
+        if ((unsigned char)(nextSeq_ - lastSeq_) < maxOutstanding_) {
             buf[bufptr++] = nextSeq_;
             ++nextSeq_;
-            while (true) {
-                ++lastServoId_;
-                if (lastServoId_ >= servos_.size()) {
-                    lastServoId_ = -1;  //  so that next iteration becomes 0
-                    //  read the status for all servos
-                    buf[bufptr++] = OpGetStatus | 1;
-                    buf[bufptr++] = TargetPower;
-                    buf[bufptr++] = OpGetStatus | 1;
-                    buf[bufptr++] = TargetServos;
-                    delayread = true;
-                    break;
-                }
-                if (!!servos_[lastServoId_]) {
-                    break;
-                }
+            if (now - lastTorqueStep_ >= TORQUE_STEP_PERIOD) {
+                lastTorqueStep_ = now;
+                step_torque();
             }
-            if (!delayread) {
-                //  read stuff from the selected servo
-                //  all "fast read" values
-                unsigned char const *rdcmd = frequent_read_regs;
-                unsigned char const *rdend = &frequent_read_regs[sizeof(frequent_read_regs)];
-                while (rdcmd < rdend) {
-                    buf[bufptr++] = GET_REGS;
-                    buf[bufptr++] = lastServoId_;
-                    buf[bufptr++] = rdcmd[0];
-                    buf[bufptr++] = rdcmd[1];
-                    rdcmd += 2;
-                }
-                //  some "slow read" values, if there's space
-                Servo &s = *servos_[lastServoId_];
-                if (s.lastSlowRd_ >= sizeof(read_regs)) {
-                    s.lastSlowRd_ = 0;
-                    if (s.updateTorque_) {
-                        s.updateTorque_--;
-                        unsigned short torque =
-                            (s.nextTorque_ * (s.torqueSteps_ - s.updateTorque_) + s.prevTorque_ * s.updateTorque_) / s.torqueSteps_;
-                        s.set_reg2(REG_TORQUE_LIMIT, torque);
-                        std::stringstream strstr;
-                        strstr << "torque for servo " << (int)lastServoId_ << " is " << torque << " "
-                            << (int)s.updateTorque_ << "/" << (int)s.torqueSteps_;
-                        istatus_->message(strstr.str());
-                    }
-                }
-                buf[bufptr++] = GET_REGS;
-                buf[bufptr++] = lastServoId_;
-                buf[bufptr++] = read_regs[s.lastSlowRd_];
-                buf[bufptr++] = 1;
-                s.lastSlowRd_++;
-                //  coalesce contiguous registers, up to a buffer size of 8
-                while (s.lastSlowRd_ < sizeof(read_regs) && buf[bufptr-1] < 8) {
-                    if (read_regs[s.lastSlowRd_] != buf[bufptr-2] + buf[bufptr-1]) {
-                        break;
-                    }
-                    buf[bufptr - 1]++;
-                    s.lastSlowRd_++;
-                }
+            bufptr = telemetry_.add_reads(buf, bufptr, 1 + READ_PACKET_BYTES, batching_, now);
+            if (batching_) {
+                bufptr = add_sync_writes(buf, bufptr, sizeof(buf));
             }
-
-            //  drain the command queue
-            std::vector<servo_cmd>::iterator ptr(cmds_.begin()), end(cmds_.end());
-            while (ptr != end) {
-                if (bufptr >= sizeof(buf)-4) {
-                    break;
-                }
-                if ((*ptr).reg & 0x80) {
-                    buf[bufptr++] = SET_REG2;
-                    buf[bufptr++] = (*ptr).id;
-                    buf[bufptr++] = (*ptr).reg & ~0x80;
-                    buf[bufptr++] = (*ptr).value & 0xff;
-                    buf[bufptr++] = ((*ptr).value >> 8) & 0xff;
-                }
-                else {
-                    buf[bufptr++] = SET_REG1;
-                    buf[bufptr++] = (*ptr).id;
-                    buf[bufptr++] = (*ptr).reg;
-                    buf[bufptr++] = (*ptr).value & 0xff;
-                }
-                ++ptr;
+            else {
+                bufptr = add_writes(buf, bufptr, LEGACY_PACKET_SIZE);
             }
             if ((bufptr > 1) || (now - lastSend_ > MIN_SEND_PERIOD)) {
                 lastSend_ = now;
                 if (!!usb_) {
                     usb_->raw_send(buf, bufptr);
+                    telemetry_.sent(buf[0], now);
                 }
-                cmds_.erase(cmds_.begin(), ptr);
             }
             lastOutSeq_ = -1;
         }
@@ -472,7 +396,8 @@ void ServoSet::step() {
 
     usb_->step();
 
-    //  drain receive queue
+    //  drain receive queue; readers of the store see all of it or none
+    TelemetryWrite tw(*store_);
     while (true) {
         size_t sz = 0, szs = 0;
         unsigned char const *d = usb_->begin_receive(sz);
@@ -482,6 +407,7 @@ void ServoSet::step() {
         }
         szs = sz;
         lastSeq_ = *d;
+        telemetry_.acked(lastSeq_, read_clock());
         d++;
         sz--;
         while (sz > 0) {
@@ -530,6 +456,114 @@ void ServoSet::step() {
     }
 }
 
+//  Move each servo's torque limit a step along its ramp.
+void ServoSet::step_torque() {
+    for (auto ptr(servos_.begin()), end(servos_.end()); ptr != end; ++ptr) {
+        if (!*ptr || !(*ptr)->updateTorque_) {
+            continue;
+        }
+        Servo &s(**ptr);
+        s.updateTorque_--;
+        unsigned short torque =
+            (s.nextTorque_ * (s.torqueSteps_ - s.updateTorque_) + s.prevTorque_ * s.updateTorque_) / s.torqueSteps_;
+        s.set_reg2(REG_TORQUE_LIMIT, torque);
+        std::stringstream strstr;
+        strstr << "torque for servo " << (int)s.id_ << " is " << torque << " "
+            << (int)s.updateTorque_ << "/" << (int)s.torqueSteps_;
+        istatus_->message(strstr.str());
+    }
+}
+
+//  drain the command queue, one write op per command
+unsigned char ServoSet::add_writes(unsigned char *buf, unsigned char bufptr, unsigned char bufsize) {
+    while (true) {
+        pop_clean_cmds();
+        if (!fifoCount_ || bufptr >= bufsize-4) {
+            break;
+        }
+        size_t ix = fifo_[fifoHead_];
+        servo_cmd sc(slot_cmd(ix));
+        if (sc.reg & 0x80) {
+            buf[bufptr++] = SET_REG2;
+            buf[bufptr++] = sc.id;
+            buf[bufptr++] = sc.reg & ~0x80;
+            buf[bufptr++] = sc.value & 0xff;
+            buf[bufptr++] = (sc.value >> 8) & 0xff;
+        }
+        else {
+            buf[bufptr++] = SET_REG1;
+            buf[bufptr++] = sc.id;
+            buf[bufptr++] = sc.reg;
+            buf[bufptr++] = sc.value & 0xff;
+        }
+        take_cmd(ix);
+    }
+    return bufptr;
+}
+
+//  Drain the command queue, collapsing all writes to the same register 
+//  into one OpSyncWrite. Commands that don't fit stay queued, in order.
+unsigned char ServoSet::add_sync_writes(unsigned char *buf, unsigned char bufptr, unsigned char bufsize) {
+    size_t cap = fifo_.size();
+    for (size_t i = 0; i != fifoCount_; ++i) {
+        size_t ix = fifo_[(fifoHead_ + i) % cap];
+        if (!slots_[ix].dirty) {
+            continue;
+        }
+        size_t r = ix % CMD_SLOTS_PER_SERVO;
+        servo_cmd sc(slot_cmd(ix));
+        unsigned char len = (sc.reg & 0x80) ? 2 : 1;
+        size_t same = regDepth_[r];
+        if (same == 1) {
+            if (bufptr + 3 + len > bufsize) {
+                break;
+            }
+            buf[bufptr++] = (len == 2) ? SET_REG2 : SET_REG1;
+            buf[bufptr++] = sc.id;
+            buf[bufptr++] = sc.reg & ~0x80;
+            buf[bufptr++] = sc.value & 0xff;
+            if (len == 2) {
+                buf[bufptr++] = (sc.value >> 8) & 0xff;
+            }
+            take_cmd(ix);
+            continue;
+        }
+        //  op, size, reg, len, then id and data for each servo
+        size_t room = (bufsize > bufptr + 4) ? bufsize - bufptr - 4 : 0;
+        if (same > room / (1 + len)) {
+            same = room / (1 + len);
+        }
+        if (same < 2) {
+            break;
+        }
+        unsigned char sz = 2 + same * (1 + len);
+        if (sz < 15) {
+            buf[bufptr++] = OpSyncWrite | sz;
+        }
+        else {
+            buf[bufptr++] = OpSyncWrite | 0xf;
+            buf[bufptr++] = sz;
+        }
+        buf[bufptr++] = sc.reg & ~0x80;
+        buf[bufptr++] = len;
+        //  in FIFO order, so that a partial group doesn't starve anyone
+        for (size_t j = i; j != fifoCount_ && same > 0; ++j) {
+            size_t jx = fifo_[(fifoHead_ + j) % cap];
+            if (slots_[jx].dirty && jx % CMD_SLOTS_PER_SERVO == r) {
+                buf[bufptr++] = jx / CMD_SLOTS_PER_SERVO;
+                buf[bufptr++] = slots_[jx].value & 0xff;
+                if (len == 2) {
+                    buf[bufptr++] = (slots_[jx].value >> 8) & 0xff;
+                }
+                take_cmd(jx);
+                --same;
+            }
+        }
+    }
+    pop_clean_cmds();
+    return bufptr;
+}
+
 void ServoSet::set_torque(unsigned short thousandths, unsigned char steps) {
     if (thousandths >= 1024) {
         throw std::runtime_error("Bad argument to ServoSet::set_torque().");
@@ -547,23 +581,106 @@ void ServoSet::set_torque(unsigned short thousandths, unsigned char steps) {
 }
 
 unsigned int ServoSet::queue_depth() {
-    return cmds_.size();
+    return cmdDepth_;
+}
+
+void ServoSet::set_batching(bool batching) {
+    batching_ = batching;
+}
+
+bool ServoSet::batching() const {
+    return batching_;
+}
+
+TelemetryScheduler const &ServoSet::telemetry() const {
+    return telemetry_;
+}
+
+boost::shared_ptr<TelemetryStore> const &ServoSet::store() const {
+    return store_;
+}
+
+void ServoSet::set_store(boost::shared_ptr<TelemetryStore> const &store) {
+    if (!store) {
+        throw std::runtime_error("ServoSet::set_store() needs a store.");
+    }
+    store_ = store;
+}
+
+//  Pending writes live in a dense table with a slot per servo, register 
+//  and width, so a new write to a register that's already pending just 
+//  replaces the value and keeps its place in line. The FIFO holds slot 
+//  indices in the order they were dirtied. Slots that were sent out of 
+//  order (by add_sync_writes()) stay in the FIFO, clean, until they get 
+//  to the front; a slot that's dirtied again before then keeps its old 
+//  place. Each slot is in the FIFO at most once, so it never overflows.
+size_t ServoSet::slot_index(servo_cmd const &cmd) {
+    return cmd.id * CMD_SLOTS_PER_SERVO + (cmd.reg & 0x7f) +
+        ((cmd.reg & 0x80) ? NUM_SERVO_REGS : 0);
+}
+
+servo_cmd ServoSet::slot_cmd(size_t ix) {
+    servo_cmd sc;
+    sc.id = ix / CMD_SLOTS_PER_SERVO;
+    size_t r = ix % CMD_SLOTS_PER_SERVO;
+    sc.reg = (r >= NUM_SERVO_REGS) ? ((r - NUM_SERVO_REGS) | 0x80) : r;
+    sc.value = slots_[ix].value;
+    return sc;
+}
+
+void ServoSet::grow_cmds(size_t nservos) {
+    if (slots_.size() >= nservos * CMD_SLOTS_PER_SERVO) {
+        return;
+    }
+    slots_.resize(nservos * CMD_SLOTS_PER_SERVO);
+    servoDepth_.resize(nservos);
+    //  slot indices don't change when servos are added; the FIFO just 
+    //  needs straightening out into the bigger ring
+    std::vector<unsigned int> fifo(slots_.size());
+    for (size_t i = 0; i != fifoCount_; ++i) {
+        fifo[i] = fifo_[(fifoHead_ + i) % fifo_.size()];
+    }
+    fifo_.swap(fifo);
+    fifoHead_ = 0;
+}
+
+void ServoSet::take_cmd(size_t ix) {
+    cmd_slot &cs(slots_[ix]);
+    assert(cs.dirty);
+    cs.dirty = false;
+    --servoDepth_[ix / CMD_SLOTS_PER_SERVO];
+    --regDepth_[ix % CMD_SLOTS_PER_SERVO];
+    --cmdDepth_;
+}
+
+void ServoSet::pop_clean_cmds() {
+    while (fifoCount_ && !slots_[fifo_[fifoHead_]].dirty) {
+        slots_[fifo_[fifoHead_]].queued = false;
+        fifoHead_ = (fifoHead_ + 1) % fifo_.size();
+        --fifoCount_;
+    }
 }
 
 void ServoSet::add_cmd(servo_cmd const &cmd) {
-    //  already pending write in queue?
-    for (std::vector<servo_cmd>::iterator ptr(cmds_.begin()), end(cmds_.end());
-        ptr != end;
-        ++ptr) {
-        servo_cmd &sc(*ptr);
-        if (sc.id == cmd.id && sc.reg == cmd.reg) {
-            //  Drop older data but keep queue location for fairness
-            sc = cmd;
-            return;
-        }
+    if (!usb_) {
+        return;
     }
-    if (!!usb_) {
-        cmds_.push_back(cmd);
+    size_t ix = slot_index(cmd);
+    assert(ix < slots_.size());
+    cmd_slot &cs(slots_[ix]);
+    //  Drop older data but keep queue location for fairness
+    cs.value = cmd.value;
+    if (cs.dirty) {
+        return;
+    }
+    cs.dirty = true;
+    ++servoDepth_[cmd.id];
+    ++regDepth_[ix % CMD_SLOTS_PER_SERVO];
+    ++cmdDepth_;
+    if (!cs.queued) {
+        cs.queued = true;
+        fifo_[(fifoHead_ + fifoCount_) % fifo_.size()] = ix;
+        ++fifoCount_;
     }
 }
 
@@ -587,6 +704,18 @@ void ServoSet::do_read_complete(unsigned char const *pack, unsigned char sz) {
         return;
     }
     memcpy(&s.registers_[reg], pack, sz);
+    double now = read_clock();
+    telemetry_.received(id, reg, sz, now);
+    //  TF_GOAL is what the servo was told, not what it says
+    for (int f = 0; f != TF_GOAL; ++f) {
+        TelemetryField tf = (TelemetryField)f;
+        int r = TelemetryStore::reg_of(tf);
+        unsigned char n = TelemetryStore::size_of(tf);
+        if (r < (int)reg || r + n > (int)(reg + sz)) {
+            continue;
+        }
+        store_->set(tf, id, (n == 2) ? s.get_reg2(r) : s.get_reg1(r), now);
+    }
 }
 
 void ServoSet::do_status_complete(unsigned char const *pack, unsigned char sz) {
@@ -614,6 +743,7 @@ void ServoSet::do_status_power(unsigned char const *buf, unsigned char n) {
     battery_ = buf[0] + ((unsigned short)buf[1] << 8);
     power_ = buf[2];
     powerFail_ = buf[3];
+    store_->set_power(battery_, power_, powerFail_, read_clock());
 }
 
 void ServoSet::do_status_servos(unsigned char const *buf, unsigned char n) {
@@ -621,6 +751,10 @@ void ServoSet::do_status_servos(unsigned char const *buf, unsigned char n) {
         status_.resize(n + 1);
     }
     memcpy(&status_[1], buf, n);
+    double now = read_clock();
+    for (size_t i = 1; i <= n; ++i) {
+        store_->set(TF_STATUS, i, status_[i], now);
+    }
 }
 
 unsigned char ServoSet::get_status(unsigned char *buf, unsigned char n) {
@@ -4,8 +4,10 @@
 #include <boost/shared_ptr.hpp>
 //  eek!
 #include "../LUFA/OnyxWalker/MyProto.h"
+#include "TelemetryScheduler.h"
+#include "TelemetryStore.h"
 
-class USBLink;
+class IUSBLink;
 class Module;
 class Logger;
 class IStatus;
@@ -16,6 +18,16 @@ struct servo_cmd {
     unsigned short value;
 };
 
+//  two slots per register: one-byte and two-byte writes
+#define CMD_SLOTS_PER_SERVO (2 * NUM_SERVO_REGS)
+
+struct cmd_slot {
+    cmd_slot() : value(0), dirty(false), queued(false) {}
+    unsigned short value;
+    bool dirty;     //  value is waiting to be sent
+    bool queued;    //  index is in the FIFO
+};
+
 struct cmd_pose {
     unsigned char id;
     unsigned short pose;
@@ -114,7 +126,6 @@ private:
     ServoSet &ss_;
     unsigned char registers_[NUM_SERVO_REGS];
     unsigned char id_;
-    unsigned char lastSlowRd_;
     unsigned char updateTorque_;
     unsigned char torqueSteps_;
     unsigned short neutral_;
@@ -125,6 +136,8 @@ private:
 class ServoSet {
 public:
     ServoSet(bool usb, boost::shared_ptr<Logger> const &l, IStatus *status = 0);
+    //  use a link that the caller owns, such as a Fakeusb
+    ServoSet(IUSBLink *usb, IStatus *status = 0);
     ~ServoSet();
 
     Servo &add_servo(unsigned char id, unsigned short neutral = 2048);
@@ -133,6 +146,18 @@ public:
     void step();
     void set_torque(unsigned short thousandths, unsigned char steps = 1);
     unsigned int queue_depth();
+    //  Batching sends all writes to the same register in one OpSyncWrite, 
+    //  and reads several servos with one OpBulkRead. It's off unless 
+    //  settings.ini says "batch":1, since boards without the firmware 
+    //  that knows those ops stop on them.
+    void set_batching(bool batching);
+    bool batching() const;
+    //  what gets read how often; settings.ini "telemetry" sets the rates
+    TelemetryScheduler const &telemetry() const;
+    //  What's been heard from the servos and the power board, for other
+    //  threads to read. ServoSet makes one; set_store() shares another.
+    boost::shared_ptr<TelemetryStore> const &store() const;
+    void set_store(boost::shared_ptr<TelemetryStore> const &store);
     //  byte 0 .. n-1 is status byte for servo 0 .. n-1.
     //  return value is number of actual status bytes
     unsigned char get_status(unsigned char *bytes, unsigned char cnt);
@@ -152,17 +177,27 @@ public:
 private:
     friend class Servo;
     std::vector<boost::shared_ptr<Servo>> servos_;
-    std::vector<servo_cmd> cmds_;
+    //  pending writes; see add_cmd()
+    std::vector<cmd_slot> slots_;
+    std::vector<unsigned int> fifo_;
+    size_t fifoHead_;
+    size_t fifoCount_;
+    size_t cmdDepth_;
+    std::vector<unsigned short> servoDepth_;
+    unsigned short regDepth_[CMD_SLOTS_PER_SERVO];
     std::vector<unsigned char> status_;
     boost::shared_ptr<Module> usbModule_;
+    TelemetryScheduler telemetry_;
+    boost::shared_ptr<TelemetryStore> store_;
     double lastStep_;
+    double lastTorqueStep_;
     double lastSend_;
-    USBLink *usb_;
+    IUSBLink *usb_;
     IStatus *istatus_;
-    size_t pollIx_;
+    size_t maxOutstanding_;
     unsigned short torqueLimit_;
     unsigned short torqueSteps_;
-    unsigned char lastServoId_;
+    bool batching_;
     unsigned char lastSeq_;
     unsigned char nextSeq_;
     int lastOutSeq_;
@@ -170,6 +205,15 @@ private:
     unsigned char power_;
     unsigned char powerFail_;
 
+    void init(IStatus *status);
+    void step_torque();
+    unsigned char add_writes(unsigned char *buf, unsigned char bufptr, unsigned char bufsize);
+    unsigned char add_sync_writes(unsigned char *buf, unsigned char bufptr, unsigned char bufsize);
+    size_t slot_index(servo_cmd const &cmd);
+    servo_cmd slot_cmd(size_t ix);
+    void grow_cmds(size_t nservos);
+    void take_cmd(size_t ix);
+    void pop_clean_cmds();
     void add_cmd(servo_cmd const &cmd);
     void do_read_complete(unsigned char const *pack, unsigned char sz);
     void do_status_complete(unsigned char const *pack, unsigned char sz);
@@ -0,0 +1,272 @@
+#include "TelemetryScheduler.h"
+#include "ServoSet.h"
+#include <string.h>
+#include <stdexcept>
+#include <algorithm>
+
+
+//  the board's in packet, less the sequence number
+#define IN_ROOM 63
+//  power status is 6 bytes of response, servo status 27
+#define STATUS_IN_BYTES 33
+#define STATUS_OUT_BYTES 4
+//  Bus time of a read of n registers: 8 bytes of command and 6 + n of
+//  response at 1 Mbps, plus the return delay ServoSet sets, the
+//  firmware's hold time and its turnaround.
+#define BYTE_TIME 10e-6
+#define READ_OVERHEAD 30e-6
+#define READ_BYTES 14
+//  Reads may use this much bus time per packet. Packets go out once a
+//  millisecond at most, and writes need some too; but there's always
+//  room for a position read.
+#define MIN_BUDGET 0.25e-3
+#define MAX_BUDGET 0.9e-3
+#define INITIAL_BUDGET 0.5e-3
+#define BUDGET_STEP 2e-6
+#define BUDGET_BACKOFF 0.9
+//  round trips this much longer than the fastest mean the bus is backed up
+#define QUEUE_DELAY_LIMIT 2e-3
+//  the fastest round trip is forgotten after this long
+#define MIN_RTT_WINDOW 10.0
+//  reads that should happen once are asked for again after this long
+#define ONCE_RETRY 0.5
+
+static const TelemetryGroup default_groups[] = {
+    { "position", REG_PRESENT_POSITION, 6, 100, 0 },    //  position, speed, load
+    { "current", REG_CURRENT, 2, 50, 1 },
+    { "eeprom", REG_MODEL_NUMBER, REG_ALARM_SHUTDOWN + 1, 0, 2 },
+    { "temperature", REG_PRESENT_VOLTAGE, 2, 1, 3 },    //  voltage, temperature
+    { "control", REG_TORQUE_ENABLE, REG_TORQUE_LIMIT_HI + 1 - REG_TORQUE_ENABLE, 1, 4 },
+    { "flags", REG_REGISTERED, REG_PUNCH_HI + 1 - REG_REGISTERED, 1, 4 },
+    { "torque_mode", REG_TORQUE_CONTROL_MODE_ENABLE,
+        REG_GOAL_ACCELERATION + 1 - REG_TORQUE_CONTROL_MODE_ENABLE, 1, 4 },
+};
+#define NUM_GROUPS (sizeof(default_groups) / sizeof(default_groups[0]))
+
+
+bool TelemetryScheduler::pick::operator<(pick const &o) const {
+    if (priority_ != o.priority_) {
+        return priority_ < o.priority_;
+    }
+    return due_ < o.due_;
+}
+
+TelemetryScheduler::TelemetryScheduler() :
+    groups_(default_groups, default_groups + NUM_GROUPS),
+    counts_(groups_.size()),
+    achieved_(groups_.size()),
+    ratesStart_(0),
+    statusDue_(0),
+    budget_(INITIAL_BUDGET),
+    minRtt_(0),
+    minRttTime_(0) {
+    memset(sentAt_, 0, sizeof(sentAt_));
+}
+
+void TelemetryScheduler::add_servo(unsigned char id, double now) {
+    if (index_.size() <= id) {
+        index_.resize(id + 1, -1);
+    }
+    if (index_[id] >= 0) {
+        return;
+    }
+    index_[id] = (short)ids_.size();
+    ids_.push_back(id);
+    for (size_t g = 0; g != groups_.size(); ++g) {
+        entry e = { now, false };
+        entries_.push_back(e);
+    }
+}
+
+void TelemetryScheduler::set_rate(std::string const &name, double rate) {
+    if (rate < 0) {
+        throw std::runtime_error("Bad rate for telemetry group " + name + ".");
+    }
+    for (auto ptr(groups_.begin()), end(groups_.end()); ptr != end; ++ptr) {
+        if ((*ptr).name == name) {
+            (*ptr).rate = rate;
+            return;
+        }
+    }
+    throw std::runtime_error("Unknown telemetry group " + name + ".");
+}
+
+unsigned char TelemetryScheduler::add_reads(unsigned char *buf, unsigned char bufptr,
+    unsigned char bufsize, bool bulk, double now) {
+    update_rates(now);
+    size_t inRoom = IN_ROOM;
+    double busRoom = budget_;
+
+    if (now >= statusDue_ && bufptr + STATUS_OUT_BYTES <= bufsize) {
+        buf[bufptr++] = OpGetStatus | 1;
+        buf[bufptr++] = TargetPower;
+        buf[bufptr++] = OpGetStatus | 1;
+        buf[bufptr++] = TargetServos;
+        inRoom -= STATUS_IN_BYTES;
+        statusDue_ = std::max(statusDue_ + TELEMETRY_STATUS_PERIOD, now);
+    }
+
+    size_t ng = groups_.size();
+    picks_.clear();
+    for (size_t s = 0; s != ids_.size(); ++s) {
+        for (size_t g = 0; g != ng; ++g) {
+            entry const &e(entries_[s * ng + g]);
+            if (!e.done_ && e.due_ <= now) {
+                pick p = { groups_[g].priority, e.due_, (unsigned short)s, (unsigned short)g, false };
+                picks_.push_back(p);
+            }
+        }
+    }
+    std::sort(picks_.begin(), picks_.end());
+
+    //  choose what fits, then lay it out by group
+    size_t outRoom = (bufsize > bufptr) ? bufsize - bufptr : 0;
+    size_t perGroup[NUM_GROUPS] = { 0 };
+    size_t taken = 0;
+    for (auto ptr(picks_.begin()), end(picks_.end()); ptr != end; ++ptr) {
+        TelemetryGroup const &grp(groups_[(*ptr).group_]);
+        size_t n = perGroup[(*ptr).group_];
+        size_t out = 4;
+        if (bulk && n > 0) {
+            //  one more id, and a size byte once the op gets that long
+            out = (2 + n + 1 == 15) ? 2 : 1;
+        }
+        double bus = BYTE_TIME * (READ_BYTES + grp.len) + READ_OVERHEAD;
+        if (out > outRoom || (size_t)grp.len + 4 > inRoom || bus > busRoom) {
+            continue;
+        }
+        outRoom -= out;
+        inRoom -= grp.len + 4;
+        busRoom -= bus;
+        perGroup[(*ptr).group_] = n + 1;
+        (*ptr).taken_ = true;
+        ++taken;
+        entry &e(entries_[(*ptr).servo_ * ng + (*ptr).group_]);
+        if (grp.rate > 0) {
+            e.due_ += 1.0 / grp.rate;
+            if (e.due_ < now) {
+                e.due_ = now;
+            }
+        }
+        else {
+            e.due_ = now + ONCE_RETRY;
+        }
+    }
+    if (!taken) {
+        return bufptr;
+    }
+    for (size_t g = 0; g != ng; ++g) {
+        if (!perGroup[g]) {
+            continue;
+        }
+        TelemetryGroup const &grp(groups_[g]);
+        if (bulk) {
+            unsigned char sz = 2 + perGroup[g];
+            if (sz < 15) {
+                buf[bufptr++] = OpBulkRead | sz;
+            }
+            else {
+                buf[bufptr++] = OpBulkRead | 0xf;
+                buf[bufptr++] = sz;
+            }
+            buf[bufptr++] = grp.reg;
+            buf[bufptr++] = grp.len;
+        }
+        for (auto ptr(picks_.begin()), end(picks_.end()); ptr != end; ++ptr) {
+            if (!(*ptr).taken_ || (*ptr).group_ != g) {
+                continue;
+            }
+            if (!bulk) {
+                buf[bufptr++] = OpReadServo | 3;
+            }
+            buf[bufptr++] = ids_[(*ptr).servo_];
+            if (!bulk) {
+                buf[bufptr++] = grp.reg;
+                buf[bufptr++] = grp.len;
+            }
+        }
+    }
+    return bufptr;
+}
+
+void TelemetryScheduler::sent(unsigned char seq, double now) {
+    sentAt_[seq] = now;
+}
+
+void TelemetryScheduler::acked(unsigned char seq, double now) {
+    if (sentAt_[seq] == 0) {
+        return;
+    }
+    double rtt = now - sentAt_[seq];
+    sentAt_[seq] = 0;
+    if (minRtt_ == 0 || rtt < minRtt_ || now - minRttTime_ > MIN_RTT_WINDOW) {
+        minRtt_ = rtt;
+        minRttTime_ = now;
+    }
+    if (rtt - minRtt_ > QUEUE_DELAY_LIMIT) {
+        budget_ = std::max(MIN_BUDGET, budget_ * BUDGET_BACKOFF);
+    }
+    else {
+        budget_ = std::min(MAX_BUDGET, budget_ + BUDGET_STEP);
+    }
+}
+
+void TelemetryScheduler::received(unsigned char id, unsigned char reg, unsigned char sz,
+    double now) {
+    if (id >= index_.size() || index_[id] < 0) {
+        return;
+    }
+    size_t ng = groups_.size();
+    for (size_t g = 0; g != ng; ++g) {
+        if (reg <= groups_[g].reg && reg + sz >= groups_[g].reg + groups_[g].len) {
+            ++counts_[g];
+            entries_[index_[id] * ng + g].done_ = (groups_[g].rate == 0);
+        }
+    }
+}
+
+void TelemetryScheduler::update_rates(double now) {
+    if (ratesStart_ == 0) {
+        ratesStart_ = now;
+        return;
+    }
+    double dt = now - ratesStart_;
+    if (dt < TELEMETRY_RATE_PERIOD) {
+        return;
+    }
+    for (size_t g = 0; g != groups_.size(); ++g) {
+        achieved_[g] = ids_.empty() ? 0 : counts_[g] / dt / ids_.size();
+        counts_[g] = 0;
+    }
+    ratesStart_ = now;
+}
+
+size_t TelemetryScheduler::num_groups() const {
+    return groups_.size();
+}
+
+TelemetryGroup const &TelemetryScheduler::group(size_t ix) const {
+    if (ix >= groups_.size()) {
+        throw std::runtime_error("index out of range in TelemetryScheduler::group()");
+    }
+    return groups_[ix];
+}
+
+double TelemetryScheduler::achieved(size_t ix) const {
+    return (ix < achieved_.size()) ? achieved_[ix] : 0;
+}
+
+size_t TelemetryScheduler::complete(size_t ix) const {
+    size_t n = 0;
+    size_t ng = groups_.size();
+    for (size_t s = 0; s != ids_.size() && ix < ng; ++s) {
+        if (entries_[s * ng + ix].done_) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+double TelemetryScheduler::budget() const {
+    return budget_;
+}
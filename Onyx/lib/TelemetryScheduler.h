@@ -0,0 +1,98 @@
+#if !defined(rl2_TelemetryScheduler_h)
+#define rl2_TelemetryScheduler_h
+
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+//  power and servo status are read this often
+#define TELEMETRY_STATUS_PERIOD 0.05
+//  achieved rates are counted over this long
+#define TELEMETRY_RATE_PERIOD 1.0
+
+//  A range of servo registers that's read together, this often.
+struct TelemetryGroup {
+    std::string name;
+    unsigned char reg;
+    unsigned char len;
+    //  reads per second of each servo, or 0 for once after connecting
+    double rate;
+    //  lower goes first when there isn't room for everything that's due
+    int priority;
+};
+
+//  TelemetryScheduler decides which servo registers ServoSet reads in
+//  each packet. Every servo has its own due time for each group; each
+//  packet gets the due reads in priority order (most overdue first
+//  within a priority), as many as fit the board's 64 byte in packet, the
+//  out bytes ServoSet can spare, and a bus time budget. The budget is
+//  measured: it shrinks while packets come back later than the fastest
+//  recent round trip by more than a packet or two (the bus is backed up)
+//  and grows back otherwise. Power and servo status are read every
+//  TELEMETRY_STATUS_PERIOD, ahead of everything else.
+//  The default groups are position/speed/load at 100 Hz, current at
+//  50 Hz, voltage and temperature at 1 Hz, the rest of the RAM registers
+//  at 1 Hz, and the EEPROM once.
+//  Not thread safe; ServoSet calls it from its own step().
+class TelemetryScheduler : public boost::noncopyable {
+public:
+    TelemetryScheduler();
+
+    void add_servo(unsigned char id, double now);
+    //  throws if there's no group by that name, or the rate is negative
+    void set_rate(std::string const &group, double rate);
+
+    //  Appends the reads for the next packet to buf, up to bufsize, as
+    //  one OpBulkRead per group when bulk, else as OpReadServo ops.
+    unsigned char add_reads(unsigned char *buf, unsigned char bufptr,
+        unsigned char bufsize, bool bulk, double now);
+    //  a packet went out, or the board has seen it
+    void sent(unsigned char seq, double now);
+    void acked(unsigned char seq, double now);
+    //  a read came back
+    void received(unsigned char id, unsigned char reg, unsigned char sz, double now);
+
+    size_t num_groups() const;
+    TelemetryGroup const &group(size_t ix) const;
+    //  reads per second of each servo that came back, over the last
+    //  TELEMETRY_RATE_PERIOD
+    double achieved(size_t ix) const;
+    //  servos that have been read at least once
+    size_t complete(size_t ix) const;
+    //  bus time per packet that reads may use, in seconds
+    double budget() const;
+
+private:
+    struct entry {
+        double due_;
+        bool done_;
+    };
+    struct pick {
+        int priority_;
+        double due_;
+        unsigned short servo_;
+        unsigned short group_;
+        bool taken_;
+        bool operator<(pick const &o) const;
+    };
+
+    void update_rates(double now);
+
+    std::vector<TelemetryGroup> groups_;
+    std::vector<unsigned char> ids_;
+    //  servo index by id, or -1
+    std::vector<short> index_;
+    //  [servo * groups_.size() + group]
+    std::vector<entry> entries_;
+    std::vector<pick> picks_;
+    std::vector<size_t> counts_;
+    std::vector<double> achieved_;
+    double ratesStart_;
+    double statusDue_;
+    double budget_;
+    double minRtt_;
+    double minRttTime_;
+    double sentAt_[256];
+};
+
+#endif  //  rl2_TelemetryScheduler_h
@@ -0,0 +1,215 @@
+#include "TelemetryStore.h"
+#include "ServoSet.h"
+#include <sched.h>
+#include <string.h>
+#include <algorithm>
+
+//  a reader that has to copy again this many times gives the writer
+//  the CPU before trying again
+#define READ_SPINS 16
+
+static const struct {
+    int reg;
+    unsigned char size;
+} field_regs[TF_COUNT] = {
+    { REG_PRESENT_POSITION, 2 },
+    { REG_PRESENT_SPEED, 2 },
+    { REG_PRESENT_LOAD, 2 },
+    { REG_CURRENT, 2 },
+    { REG_PRESENT_VOLTAGE, 1 },
+    { REG_PRESENT_TEMPERATURE, 1 },
+    { -1, 1 },
+    { REG_GOAL_POSITION, 2 },
+};
+
+
+unsigned char TelemetrySnapshot::status() const {
+    unsigned char st = 0;
+    for (size_t i = 0; i != TELEMETRY_MAX_SERVOS; ++i) {
+        st |= value[TF_STATUS][i];
+    }
+    return st;
+}
+
+TelemetryStore::TelemetryStore() :
+    seq_(0),
+    depth_(0),
+    battery_(0),
+    power_(0),
+    powerFail_(0),
+    batteryTime_(0) {
+    for (size_t f = 0; f != TF_COUNT; ++f) {
+        for (size_t i = 0; i != TELEMETRY_MAX_SERVOS; ++i) {
+            value_[f][i].store(0, std::memory_order_relaxed);
+            time_[f][i].store(0, std::memory_order_relaxed);
+            count_[f][i].store(0, std::memory_order_relaxed);
+            for (size_t h = 0; h != TELEMETRY_HISTORY; ++h) {
+                history_[f][i][h].value_.store(0, std::memory_order_relaxed);
+                history_[f][i][h].time_.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+void TelemetryStore::begin_write() {
+    if (depth_++ == 0) {
+        //  odd while writing
+        seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+}
+
+void TelemetryStore::end_write() {
+    if (--depth_ == 0) {
+        seq_.store(seq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+}
+
+void TelemetryStore::set(TelemetryField f, unsigned char id, unsigned short value,
+    double time) {
+    if (f >= TF_COUNT || id >= TELEMETRY_MAX_SERVOS) {
+        return;
+    }
+    begin_write();
+    value_[f][id].store(value, std::memory_order_relaxed);
+    time_[f][id].store(time, std::memory_order_relaxed);
+    unsigned int n = count_[f][id].load(std::memory_order_relaxed);
+    sample &s(history_[f][id][n % TELEMETRY_HISTORY]);
+    s.value_.store(value, std::memory_order_relaxed);
+    s.time_.store(time, std::memory_order_relaxed);
+    count_[f][id].store(n + 1, std::memory_order_relaxed);
+    end_write();
+}
+
+void TelemetryStore::set_power(unsigned short battery, unsigned char power,
+    unsigned char fail, double time) {
+    begin_write();
+    battery_.store(battery, std::memory_order_relaxed);
+    power_.store(power, std::memory_order_relaxed);
+    powerFail_.store(fail, std::memory_order_relaxed);
+    batteryTime_.store(time, std::memory_order_relaxed);
+    end_write();
+}
+
+//  Run copy until it gets through without a write in the middle.
+template<typename Copy> void TelemetryStore::read(Copy const &copy) const {
+    for (unsigned int tries = 1; ; ++tries) {
+        unsigned int before = seq_.load(std::memory_order_acquire);
+        if (!(before & 1)) {
+            copy();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_.load(std::memory_order_relaxed) == before) {
+                return;
+            }
+        }
+        if (!(tries % READ_SPINS)) {
+            sched_yield();
+        }
+    }
+}
+
+void TelemetryStore::snapshot(TelemetrySnapshot &oSnap) const {
+    read([&]() {
+        for (size_t f = 0; f != TF_COUNT; ++f) {
+            for (size_t i = 0; i != TELEMETRY_MAX_SERVOS; ++i) {
+                oSnap.value[f][i] = value_[f][i].load(std::memory_order_relaxed);
+                oSnap.time[f][i] = time_[f][i].load(std::memory_order_relaxed);
+            }
+        }
+        oSnap.battery = battery_.load(std::memory_order_relaxed);
+        oSnap.power = power_.load(std::memory_order_relaxed);
+        oSnap.powerFail = powerFail_.load(std::memory_order_relaxed);
+        oSnap.batteryTime = batteryTime_.load(std::memory_order_relaxed);
+    });
+}
+
+unsigned short TelemetryStore::get(TelemetryField f, unsigned char id, double *oTime) const {
+    if (f >= TF_COUNT || id >= TELEMETRY_MAX_SERVOS) {
+        if (oTime) {
+            *oTime = 0;
+        }
+        return 0;
+    }
+    unsigned short v = 0;
+    double t = 0;
+    read([&]() {
+        v = value_[f][id].load(std::memory_order_relaxed);
+        t = time_[f][id].load(std::memory_order_relaxed);
+    });
+    if (oTime) {
+        *oTime = t;
+    }
+    return v;
+}
+
+unsigned short TelemetryStore::battery() const {
+    return battery_.load(std::memory_order_relaxed);
+}
+
+size_t TelemetryStore::history(TelemetryField f, unsigned char id, unsigned short *oValues,
+    double *oTimes, size_t max) const {
+    if (f >= TF_COUNT || id >= TELEMETRY_MAX_SERVOS) {
+        return 0;
+    }
+    size_t n = 0;
+    read([&]() {
+        unsigned int count = count_[f][id].load(std::memory_order_relaxed);
+        n = std::min(std::min((size_t)count, (size_t)TELEMETRY_HISTORY), max);
+        for (size_t i = 0; i != n; ++i) {
+            sample const &s(history_[f][id][(count - 1 - i) % TELEMETRY_HISTORY]);
+            oValues[i] = s.value_.load(std::memory_order_relaxed);
+            oTimes[i] = s.time_.load(std::memory_order_relaxed);
+        }
+    });
+    return n;
+}
+
+double TelemetryStore::velocity(TelemetryField f, unsigned char id, double window,
+    double now) const {
+    unsigned short values[TELEMETRY_HISTORY];
+    double times[TELEMETRY_HISTORY];
+    size_t n = history(f, id, values, times, TELEMETRY_HISTORY);
+    //  relative to now, to keep the sums well conditioned
+    double st = 0, sv = 0, stt = 0, stv = 0;
+    size_t k = 0;
+    for (size_t i = 0; i != n; ++i) {
+        double t = times[i] - now;
+        if (t < -window) {
+            break;
+        }
+        st += t;
+        sv += values[i];
+        stt += t * t;
+        stv += t * values[i];
+        ++k;
+    }
+    if (k < 2) {
+        return 0;
+    }
+    double d = k * stt - st * st;
+    if (d <= 0) {
+        return 0;
+    }
+    return (k * stv - st * sv) / d;
+}
+
+unsigned int TelemetryStore::version() const {
+    return seq_.load(std::memory_order_acquire) >> 1;
+}
+
+int TelemetryStore::field_of(unsigned char reg) {
+    for (size_t f = 0; f != TF_COUNT; ++f) {
+        if (field_regs[f].reg == reg) {
+            return (int)f;
+        }
+    }
+    return -1;
+}
+
+int TelemetryStore::reg_of(TelemetryField f) {
+    return (f < TF_COUNT) ? field_regs[f].reg : -1;
+}
+
+unsigned char TelemetryStore::size_of(TelemetryField f) {
+    return (f < TF_COUNT) ? field_regs[f].size : 0;
+}
@@ -0,0 +1,112 @@
+#if !defined(rl2_TelemetryStore_h)
+#define rl2_TelemetryStore_h
+
+#include <atomic>
+#include <boost/noncopyable.hpp>
+
+//  servo ids 0 .. TELEMETRY_MAX_SERVOS-1 are kept
+#define TELEMETRY_MAX_SERVOS 32
+//  samples kept of each field of each servo, for velocity()
+#define TELEMETRY_HISTORY 16
+
+enum TelemetryField {
+    TF_POSITION,
+    TF_SPEED,
+    TF_LOAD,
+    TF_CURRENT,
+    TF_VOLTAGE,
+    TF_TEMPERATURE,
+    //  the board's status byte for the servo
+    TF_STATUS,
+    //  what the servo was last told, not read back
+    TF_GOAL,
+    TF_COUNT
+};
+
+//  A consistent copy of everything in a TelemetryStore. Values are raw
+//  register values; times are read_clock() when they arrived, or 0 for
+//  never.
+struct TelemetrySnapshot {
+    unsigned short value[TF_COUNT][TELEMETRY_MAX_SERVOS];
+    double time[TF_COUNT][TELEMETRY_MAX_SERVOS];
+    unsigned short battery;
+    unsigned char power;
+    unsigned char powerFail;
+    double batteryTime;
+    //  OR of the status of all servos
+    unsigned char status() const;
+};
+
+//  TelemetryStore is where ServoSet publishes what it hears from the
+//  servos and the power board, for other threads to read without locks.
+//  Each field is an array across servos, with the time each value came
+//  in. One thread (the one calling ServoSet::step()) writes; any number
+//  of threads read. Writes are bracketed by a sequence count, and a
+//  reader that sees it change (or odd) during its copy copies again, so
+//  a snapshot() never mixes two packets' worth of values. ServoSet
+//  brackets each receive drain, so a snapshot is always whole packets.
+//  Each field also keeps its last TELEMETRY_HISTORY samples per servo.
+class TelemetryStore : public boost::noncopyable {
+public:
+    TelemetryStore();
+
+    //  writer side; begin_write()/end_write() nest
+    void begin_write();
+    void end_write();
+    //  ids out of range are ignored
+    void set(TelemetryField f, unsigned char id, unsigned short value, double time);
+    void set_power(unsigned short battery, unsigned char power, unsigned char fail,
+        double time);
+
+    //  reader side; safe from any thread
+    void snapshot(TelemetrySnapshot &oSnap) const;
+    unsigned short get(TelemetryField f, unsigned char id, double *oTime = 0) const;
+    unsigned short battery() const;
+    //  newest first; returns the number of samples copied
+    size_t history(TelemetryField f, unsigned char id, unsigned short *oValues,
+        double *oTimes, size_t max) const;
+    //  least squares slope, in raw units per second, of the samples from
+    //  the last window seconds before now; 0 with fewer than two
+    double velocity(TelemetryField f, unsigned char id, double window, double now) const;
+    //  write brackets completed so far
+    unsigned int version() const;
+
+    //  the field that starts at register reg, or -1
+    static int field_of(unsigned char reg);
+    //  the register a field is read from, or -1 for TF_STATUS
+    static int reg_of(TelemetryField f);
+    //  1 or 2
+    static unsigned char size_of(TelemetryField f);
+
+private:
+    struct sample {
+        std::atomic<unsigned short> value_;
+        std::atomic<double> time_;
+    };
+
+    template<typename Copy> void read(Copy const &copy) const;
+
+    std::atomic<unsigned int> seq_;
+    //  only touched by the writer
+    unsigned int depth_;
+    std::atomic<unsigned short> value_[TF_COUNT][TELEMETRY_MAX_SERVOS];
+    std::atomic<double> time_[TF_COUNT][TELEMETRY_MAX_SERVOS];
+    sample history_[TF_COUNT][TELEMETRY_MAX_SERVOS][TELEMETRY_HISTORY];
+    //  samples ever written; the newest is at (count - 1) % TELEMETRY_HISTORY
+    std::atomic<unsigned int> count_[TF_COUNT][TELEMETRY_MAX_SERVOS];
+    std::atomic<unsigned short> battery_;
+    std::atomic<unsigned char> power_;
+    std::atomic<unsigned char> powerFail_;
+    std::atomic<double> batteryTime_;
+};
+
+//  Brackets a scope with begin_write()/end_write(), even if it throws.
+class TelemetryWrite : public boost::noncopyable {
+public:
+    TelemetryWrite(TelemetryStore &store) : store_(store) { store_.begin_write(); }
+    ~TelemetryWrite() { store_.end_write(); }
+private:
+    TelemetryStore &store_;
+};
+
+#endif  //  rl2_TelemetryStore_h
@@ -8,6 +8,11 @@
 #include <stdexcept>
 #include <sstream>
 #include <assert.h>
+#include <atomic>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 //#include "protocol.h"
 
@@ -20,43 +25,65 @@ int outCount_;
 int outComplete_;
 
 
+//  Packets going in either direction are handed between the libusb 
+//  thread and the thread using the USBLink through lock-free rings.
+#define IN_RING_SIZE 128
+#define OUT_RING_SIZE 128
+//  drop outgoing packets when this many are waiting
+#define OUT_DROP_DEPTH 100
+//  Up to this many transfers are kept submitted in each direction, so 
+//  that the next packet is already queued in the host controller when 
+//  the previous one completes.
+#define MAX_IN_FLIGHT 16
+#define DEFAULT_IN_FLIGHT 4
+
+//  how often latency percentiles are updated and logged, in seconds
+#define LATENCY_PERIOD 1.0
+//  how often the libusb thread tries to restart reading after a failed 
+//  submit, in milliseconds; otherwise it sleeps until there's an event
+#define RETRY_INTERVAL_MS 100
+
+class Transfer;
+
+//  One submitted (or submittable) libusb transfer. Flight n is used for 
+//  ring position n modulo MAX_IN_FLIGHT, so flights complete and are 
+//  retired in ring order.
+struct Flight {
+    Flight() : xfer_(libusb_alloc_transfer(0)), owner_(0), submitted_(0), done_(false), retrying_(false) {}
+    ~Flight() { libusb_free_transfer(xfer_); }
+    libusb_transfer *xfer_;
+    Transfer *owner_;
+    double submitted_;
+    std::atomic<bool> done_;
+    bool retrying_;
+};
+
 class Transfer {
 public:
-    Transfer(libusb_device_handle *dh, unsigned char iep, unsigned char oep, boost::shared_ptr<Logger> const &l) :
+    Transfer(libusb_device_handle *dh, unsigned char iep, unsigned char oep, size_t inFlight, boost::shared_ptr<Logger> const &l) :
         dh_(dh),
         iep_(iep),
         oep_(oep),
-        inPack_(0),
-        inReady_(0),
-        inXfer_(libusb_alloc_transfer(0)),
-        outPack_(0),
-        outXfer_(libusb_alloc_transfer(0)),
-        outQueueDepth_(0),
-        outRetrying_(false),
+        inFlight_(inFlight),
+        inFirst_(0),
+        inBusy_(0),
+        outFirst_(0),
+        outBusy_(0),
+        pumping_(false),
+        pending_(0),
+        failed_(false),
         complained_(false),
         logger_(l)
     {
-
-        memset(dd_out, 0, sizeof(dd_out));
-        dn_out = 0;
-        dm_out = 0;
-        memset(dd_in, 0, sizeof(dd_in));
-        dn_in = 0;
-        dm_in = 0;
-
-        boost::unique_lock<boost::mutex> lock(lock_);
-        start_in_inner();
+        for (size_t i = 0; i != MAX_IN_FLIGHT; ++i) {
+            inFlights_[i].owner_ = this;
+            outFlights_[i].owner_ = this;
+        }
+        //  the libusb thread isn't running yet
+        pump();
     }
     ~Transfer() {
         dh_ = 0;
-        libusb_free_transfer(inXfer_);
-        libusb_free_transfer(outXfer_);
-        BOOST_FOREACH(auto p, inQueue_) {
-            p->destroy();
-        }
-        BOOST_FOREACH(auto p, outQueue_) {
-            p->destroy();
-        }
     }
 
     void log_output_data(void const *data, size_t size)
@@ -76,196 +103,249 @@ public:
         logger_->log_data(LogUSBRead, data, size);
     }
 
-    unsigned int in_ready() {
-        return inReady_.nonblocking_available();
+    //  consumer of the in ring
+    Packet *in_peek() {
+        return inRing_.begin_read();
     }
-    Packet *in_dequeue() {
-        inReady_.acquire();
-        boost::unique_lock<boost::mutex> lock(lock_);
-        Packet *ret = inQueue_.front();
-        inQueue_.pop_front();
-        return ret;
+    void in_pop() {
+        inRing_.end_read();
+        //  there's room for another in transfer now
+        if (inBusy_ < inFlight_) {
+            pump();
+        }
     }
 
+    //  producer of the out ring
     void out_write(void const *data, size_t sz) {
-        Packet *p = Packet::create();
-        p->set_size(sz);
-        memcpy(p->buffer(), data, sz);
-        boost::unique_lock<boost::mutex> lock(lock_);
-        if (outQueueDepth_ > 16) {
-            if (!(outQueueDepth_ & 15)) {
-                std::cerr << "outQueueDepth_: " << outQueueDepth_ << std::endl;
-            }
-            if (outQueueDepth_ >= 100) {
-                //  drop the packet
-                if (!complained_) {
-                    std::cerr << "dropping packet (out queue depth " << outQueueDepth_ << ")" << std::endl;
-                    complained_ = false;
-                }
-                return;
+        size_t depth = outRing_.size();
+        Packet *p = outRing_.begin_write();
+        if (!p || depth >= OUT_DROP_DEPTH) {
+            //  drop the packet
+            if (!complained_) {
+                std::cerr << "dropping packet (out queue depth " << depth << ")" << std::endl;
+                complained_ = true;
             }
+            return;
         }
         complained_ = false;
-        outQueue_.push_back(p);
-        outQueueDepth_ = outQueue_.size();
-        //  I think LibUSB is not re-entrant
-        // start_out_inner();
+        p->set_size(sz);
+        p->set_time(read_clock());
+        memcpy(p->buffer(), data, sz);
+        outRing_.end_write();
+        pump();
     }
 
     size_t out_queue_depth() {
-        return outQueueDepth_;
+        return outRing_.size();
+    }
+    size_t in_flight() const {
+        return inFlight_;
+    }
+    size_t in_busy() const {
+        return inBusy_;
+    }
+    size_t out_busy() const {
+        return outBusy_;
+    }
+    bool failed() const {
+        return failed_;
+    }
+    LatencyHistogram &in_latency() {
+        return inLatency_;
+    }
+    LatencyHistogram &out_latency() {
+        return outLatency_;
+    }
+    LatencyHistogram &submit_latency() {
+        return submitLatency_;
     }
 
-    void poke() {
-        if (!outPack_) {
-            boost::unique_lock<boost::mutex> lock(lock_);
-            start_out_inner();
+    //  Retire completed transfers and submit new ones. This is called 
+    //  from the completion callbacks, and from the user thread when it 
+    //  writes or consumes a packet. Only one thread pumps at a time; a 
+    //  thread that finds the pump busy leaves the work to the pumping 
+    //  thread, which goes around again.
+    void pump() {
+        ++pending_;
+        while (!pumping_.exchange(true)) {
+            while (pending_.exchange(0) != 0) {
+                pump_out();
+                pump_in();
+            }
+            pumping_ = false;
+            if (pending_ == 0) {
+                break;
+            }
         }
     }
 
-    double dd_out[16];
-    int dn_out;
-    int dm_out;
-    double dd_in[16];
-    int dn_in;
-    int dm_in;
-
 private:
-    //  must be called with lock held
-    void start_out_inner() {
+    //  The pump is the consumer of the out ring and the producer of the 
+    //  in ring.
+    void pump_out() {
         #if WRITE_USB
-        if (!outPack_ && !outQueue_.empty()) {
-            outPack_ = outQueue_.front();
-            outQueue_.pop_front();
-            outQueueDepth_ = outQueue_.size();
-            start_out_xfer();
+        while (outBusy_ > 0) {
+            Flight &f = outFlights_[outFirst_ & (MAX_IN_FLIGHT - 1)];
+            if (!f.done_) {
+                break;
+            }
+            f.done_ = false;
+            if (f.xfer_->status != LIBUSB_TRANSFER_COMPLETED) {
+                std::cerr << "out transfer status: " << f.xfer_->status << std::endl;
+            }
+            if (f.xfer_->status == 1 && !f.retrying_ && outBusy_ == 1) {
+                //  Re-try, but only when nothing later has gone out yet; 
+                //  the board must see packets in order. Otherwise this one 
+                //  is lost, and ServoSet's sequence timeout recovers.
+                f.retrying_ = true;
+                submit_out(f, outRing_.begin_read());
+                break;
+            }
+            f.retrying_ = false;
+            outRing_.end_read();
+            ++outFirst_;
+            --outBusy_;
+        }
+        if (outBusy_ > 0 && outFlights_[outFirst_ & (MAX_IN_FLIGHT - 1)].retrying_) {
+            //  the retry goes out alone
+            return;
+        }
+        while (outBusy_ < inFlight_ && !failed_) {
+            Packet *p = outRing_.begin_read(outBusy_);
+            if (!p) {
+                break;
+            }
+            Flight &f = outFlights_[(outFirst_ + outBusy_) & (MAX_IN_FLIGHT - 1)];
+            ++outBusy_;
+            log_output_data(p->buffer(), p->size());
+            if (!submit_out(f, p)) {
+                break;
+            }
+            submitLatency_.record(f.submitted_ - p->time());
         }
         #endif
     }
 
-    void start_out_xfer() {
-        dd_out[dn_out++ & 0xf] = read_clock();
-
-        memset(outXfer_, 0, sizeof(*outXfer_));
-        outXfer_->dev_handle = dh_;
-        log_output_data(outPack_->buffer(), outPack_->size());
-        libusb_fill_bulk_transfer(outXfer_, dh_, oep_, outPack_->buffer(), outPack_->size(),
-                &Transfer::out_callback, this, 1000); //  a second is a long time!
+    bool submit_out(Flight &f, Packet *p) {
+        f.submitted_ = read_clock();
+        memset(f.xfer_, 0, sizeof(*f.xfer_));
+        f.xfer_->dev_handle = dh_;
+        libusb_fill_bulk_transfer(f.xfer_, dh_, oep_, p->buffer(), p->size(),
+                &Transfer::out_callback, &f, 1000); //  a second is a long time!
         outCount_++;
-        int err = libusb_submit_transfer(outXfer_);
+        int err = libusb_submit_transfer(f.xfer_);
         if (err != 0) {
             outCount_--;
             std::cerr << "libusb_submit_transfer() failed writing to board: "
                 << libusb_error_name(err) << " (" << err << ")" << std::endl;
-            outPack_->destroy();
-            outPack_ = 0;
-            throw std::runtime_error("Failed writing to board.");
+            //  raw_send() reports this to the user
+            failed_ = true;
+            f.xfer_->status = LIBUSB_TRANSFER_ERROR;
+            f.retrying_ = true;
+            f.done_ = true;
+            return false;
         }
     #if DUMP_WRITE_DATA
         std::cout << std::hex;
-        unsigned char *ptr = (unsigned char *)outPack_->buffer();
-        for (size_t i = 0, n = outPack_->size(); i != n; ++i) {
+        unsigned char *ptr = (unsigned char *)p->buffer();
+        for (size_t i = 0, n = p->size(); i != n; ++i) {
             std::cout << " 0x" << (int)ptr[i];
         }
         std::cout << std::dec << std::endl;
     #endif
+        return true;
     }
 
     static void out_callback(libusb_transfer *cbArg) {
         #if WRITE_USB
         outComplete_++;
-        reinterpret_cast<Transfer *>(cbArg->user_data)->out_complete();
+        Flight *f = reinterpret_cast<Flight *>(cbArg->user_data);
+        f->owner_->complete(*f, f->owner_->outLatency_, "out");
         #endif
     }
 
-    void out_complete() {
-        #if WRITE_USB
-        double t = read_clock();
-        t -= dd_out[dm_out++ & 0xf];
-        if (t > 0.1) {
-            fprintf(stderr, "out %.4f\n", t);
-        }
-
-        if (outXfer_->status != LIBUSB_TRANSFER_COMPLETED) {
-            std::cerr << "out transfer status: " << outXfer_->status << std::endl;
-        }
-        boost::unique_lock<boost::mutex> lock(lock_);
-        if (outXfer_->status == 1 && !outRetrying_) {
-            //re-try
-            outRetrying_ = true;
-            start_out_xfer();
-        }
-        else {
-            outRetrying_ = false;
-            outPack_->destroy();
-            outPack_ = 0;
-            start_out_inner();
+    void pump_in() {
+        while (inBusy_ > 0) {
+            Flight &f = inFlights_[inFirst_ & (MAX_IN_FLIGHT - 1)];
+            if (!f.done_) {
+                break;
+            }
+            f.done_ = false;
+            if (f.xfer_->status != LIBUSB_TRANSFER_COMPLETED) {
+                std::cerr << "in transfer status: " << f.xfer_->status << std::endl;
+            }
+            Packet *p = inRing_.begin_write();
+            p->set_size(f.xfer_->actual_length);
+            log_input_data(p->buffer(), p->size());
+            inRing_.end_write();
+            ++inFirst_;
+            --inBusy_;
         }
-        #endif
-    }
-
-    //  must be called with lock held
-    void start_in_inner() {
-        if (!inPack_) {
-            dd_in[dn_in++ & 0xf] = read_clock();
-            inPack_ = Packet::create();
-            memset(inXfer_, 0, sizeof(*inXfer_));
-            inXfer_->dev_handle = dh_;
-            libusb_fill_bulk_transfer(inXfer_, dh_, iep_, inPack_->buffer(), inPack_->max_size(),
-                    &Transfer::in_callback, this, 1000); //  a second is a long time!
+        while (inBusy_ < inFlight_) {
+            Packet *p = inRing_.begin_write(inBusy_);
+            if (!p) {
+                //  the reader is behind; in_pop() will pump again
+                break;
+            }
+            Flight &f = inFlights_[(inFirst_ + inBusy_) & (MAX_IN_FLIGHT - 1)];
+            f.submitted_ = read_clock();
+            memset(f.xfer_, 0, sizeof(*f.xfer_));
+            f.xfer_->dev_handle = dh_;
+            libusb_fill_bulk_transfer(f.xfer_, dh_, iep_, p->buffer(), p->max_size(),
+                    &Transfer::in_callback, &f, 1000); //  a second is a long time!
             inCount_++;
-            int err = libusb_submit_transfer(inXfer_);
+            int err = libusb_submit_transfer(f.xfer_);
             if (err != 0) {
                 inCount_--;
                 std::cerr << "libusb_submit_transfer() failed reading from board: "
                     << libusb_error_name(err) << " (" << err << ")" << std::endl;
-                inPack_->destroy();
-                inPack_ = 0;
+                break;
             }
+            ++inBusy_;
         }
     }
 
     static void in_callback(libusb_transfer *cbArg) {
         inComplete_++;
-        reinterpret_cast<Transfer *>(cbArg->user_data)->in_complete();
+        Flight *f = reinterpret_cast<Flight *>(cbArg->user_data);
+        f->owner_->complete(*f, f->owner_->inLatency_, "in");
     }
 
-    void in_complete() {
-        double t = read_clock();
-        t -= dd_in[dm_in++ & 0xf];
+    //  called on the libusb thread
+    void complete(Flight &f, LatencyHistogram &hist, char const *dir) {
+        double t = read_clock() - f.submitted_;
         if (t > 0.1) {
-            fprintf(stderr, "in %.4f\n", t);
-        }
-
-        if (inXfer_->status != LIBUSB_TRANSFER_COMPLETED) {
-            std::cerr << "in transfer status: " << inXfer_->status << std::endl;
+            fprintf(stderr, "%s %.4f\n", dir, t);
         }
-        boost::unique_lock<boost::mutex> lock(lock_);
-        inPack_->set_size(inXfer_->actual_length);
-        log_input_data(inPack_->buffer(), inPack_->size());
-        inQueue_.push_back(const_cast<Packet *>(inPack_));
-        inPack_ = 0;
-        inReady_.release();
-        start_in_inner();
+        hist.record(t);
+        f.done_ = true;
+        pump();
     }
 
     libusb_device_handle *dh_;
     unsigned char iep_;
     unsigned char oep_;
-    boost::mutex lock_;
-
-    Packet *volatile inPack_;
-    std::deque<Packet *> inQueue_;
-    semaphore inReady_;
-    libusb_transfer *inXfer_;
-
-    Packet *volatile outPack_;
-    std::deque<Packet *> outQueue_;
-    libusb_transfer *outXfer_;
-    size_t outQueueDepth_;
-    bool outRetrying_;
+    size_t inFlight_;
+
+    PacketRing<IN_RING_SIZE> inRing_;
+    Flight inFlights_[MAX_IN_FLIGHT];
+    size_t inFirst_;
+    std::atomic<size_t> inBusy_;
+
+    PacketRing<OUT_RING_SIZE> outRing_;
+    Flight outFlights_[MAX_IN_FLIGHT];
+    size_t outFirst_;
+    std::atomic<size_t> outBusy_;
+
+    std::atomic<bool> pumping_;
+    std::atomic<int> pending_;
+    std::atomic<bool> failed_;
     bool complained_;
 
+    LatencyHistogram inLatency_;
+    LatencyHistogram outLatency_;
+    LatencyHistogram submitLatency_;
+
     boost::shared_ptr<Logger> logger_;
 };
 
@@ -276,6 +356,7 @@ boost::shared_ptr<Module> USBLink::open(boost::shared_ptr<Settings> const &set,
     std::string pid("0002");
     std::string ep_output("2");
     std::string ep_input("81");
+    long inFlight = DEFAULT_IN_FLIGHT;
     auto v = set->get_value("vid");
     if (!!v) {
         vid = v->get_string();
@@ -292,24 +373,43 @@ boost::shared_ptr<Module> USBLink::open(boost::shared_ptr<Settings> const &set,
     if (!!v) {
         ep_output = v->get_string();
     }
-    return boost::shared_ptr<Module>(new USBLink(vid, pid, ep_input, ep_output, l));
+    maybe_get(set, "in_flight", inFlight);
+    if (inFlight < 1 || inFlight > MAX_IN_FLIGHT) {
+        throw std::runtime_error("Bad in_flight setting in USBLink::open().");
+    }
+    return boost::shared_ptr<Module>(new USBLink(vid, pid, ep_input, ep_output, inFlight, l));
 }
 
 void USBLink::step() {
-    while (xfer_->in_ready()) {
-        Packet *pack = xfer_->in_dequeue();
-        ++inPackets_;
-        size_t size = pack->size();
-        if (size > 0) {
-            recvQ_.push_back(pack);
-        }
-        else {
-            pack->destroy();
-        }
-    }
     inPacketsProperty_->set<long>(inPackets_);
     outPacketsProperty_->set<long>(outPackets_);
     dropPacketsProperty_->set<long>(dropPackets_);
+    queueDepthProperty_->set<long>(xfer_->out_queue_depth());
+    inBusyProperty_->set<long>(xfer_->in_busy());
+    outBusyProperty_->set<long>(xfer_->out_busy());
+    double now = read_clock();
+    if (now - lastLatency_ >= LATENCY_PERIOD) {
+        lastLatency_ = now;
+        update_latency(xfer_->in_latency(), inCounts_, LogUSBReadLatency, &latencyProperties_[0]);
+        update_latency(xfer_->out_latency(), outCounts_, LogUSBWriteLatency, &latencyProperties_[4]);
+        update_latency(xfer_->submit_latency(), submitCounts_, LogUSBSubmitLatency, &latencyProperties_[8]);
+    }
+}
+
+void USBLink::update_latency(LatencyHistogram &hist, HistogramCounts &prev,
+    LogWhat what, boost::shared_ptr<Property> const *props) {
+    HistogramCounts cur;
+    hist.collect(cur);
+    LatencySummary sum;
+    LatencyHistogram::summarize(cur, prev, sum);
+    prev = cur;
+    props[0]->set<double>(sum.p50);
+    props[1]->set<double>(sum.p99);
+    props[2]->set<double>(sum.p999);
+    props[3]->set<double>(sum.max);
+    if (!!logger_) {
+        logger_->log_data(what, &sum, sizeof(sum));
+    }
 }
 
 void USBLink::thread_fn() {
@@ -319,19 +419,69 @@ void USBLink::thread_fn() {
         std::cerr << "USBLink::thread_fn(): pthread_setschedparam(): " << err << std::endl;
     }
 
-    while (!thread_->interruption_requested()) {
-        struct timeval tv = { 0, 5000 };
-        libusb_handle_events_timeout_completed(ctx_, &tv, 0);
-        xfer_->poke();
+    //  Transfers are submitted by whoever queues or consumes a packet, and 
+    //  resubmitted from their completion callbacks, so this thread only 
+    //  wakes up when libusb has an event (or a timeout) to handle, when 
+    //  it's told to stop, or to restart reading after a failed submit.
+    bool fdTimeouts = libusb_pollfds_handle_timeouts(ctx_) != 0;
+    while (!boost::this_thread::interruption_requested()) {
+        int timeout = -1;
+        timeval tv;
+        if (!fdTimeouts && libusb_get_next_timeout(ctx_, &tv) == 1) {
+            timeout = (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+        }
+        if (xfer_->in_busy() == 0 && (timeout < 0 || timeout > RETRY_INTERVAL_MS)) {
+            timeout = RETRY_INTERVAL_MS;
+        }
+        epoll_event evs[8];
+        int n = epoll_wait(epfd_, evs, 8, timeout);
+        bool usb = (n == 0);
+        for (int i = 0; i < n; ++i) {
+            if (evs[i].data.fd == wake_) {
+                uint64_t v;
+                ssize_t r = ::read(wake_, &v, sizeof(v));
+                (void)r;
+            }
+            else {
+                usb = true;
+            }
+        }
+        if (usb) {
+            //  just handle what's ready; the waiting was done above
+            timeval zero = { 0, 0 };
+            libusb_handle_events_timeout_completed(ctx_, &zero, 0);
+        }
+        if (xfer_->in_busy() == 0) {
+            xfer_->pump();
+        }
     }
 }
 
+static unsigned int epoll_events(short events) {
+    return ((events & POLLIN) ? EPOLLIN : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+void USBLink::pollfd_added(int fd, short events, void *self) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_events(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(((USBLink *)self)->epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        std::string err(strerror(errno));
+        std::cerr << "USBLink: could not watch libusb descriptor: " << err << std::endl;
+    }
+}
+
+void USBLink::pollfd_removed(int fd, void *self) {
+    epoll_ctl(((USBLink *)self)->epfd_, EPOLL_CTL_DEL, fd, 0);
+}
+
 std::string const &USBLink::name() {
     return name_;
 }
 
 size_t USBLink::num_properties() {
-    return 3;
+    return 6 + latencyProperties_.size();
 }
 
 boost::shared_ptr<Property> USBLink::get_property_at(size_t ix) {
@@ -339,13 +489,22 @@ boost::shared_ptr<Property> USBLink::get_property_at(size_t ix) {
     case 0: return inPacketsProperty_;
     case 1: return outPacketsProperty_;
     case 2: return dropPacketsProperty_;
+    case 3: return queueDepthProperty_;
+    case 4: return inBusyProperty_;
+    case 5: return outBusyProperty_;
     default:
+        if (ix - 6 < latencyProperties_.size()) {
+            return latencyProperties_[ix - 6];
+        }
         throw std::runtime_error("index out of range in USBLink::get_property_at()");
     }
 }
 
 USBLink::~USBLink() {
     thread_->interrupt();
+    uint64_t one = 1;
+    ssize_t w = ::write(wake_, &one, sizeof(one));
+    (void)w;
     pickup_.release();
     return_.release();
     thread_->join();
@@ -353,25 +512,43 @@ USBLink::~USBLink() {
         libusb_close(dh_);
     }
     if (ctx_ ) {
+        libusb_set_pollfd_notifiers(ctx_, 0, 0, 0);
         libusb_exit(ctx_);
     }
     delete xfer_;
+    if (epfd_ >= 0) {
+        ::close(epfd_);
+    }
+    if (wake_ >= 0) {
+        ::close(wake_);
+    }
 }
 
 static std::string str_in_packets("in_packets");
 static std::string str_out_packets("out_packets");
 static std::string str_drop_packets("drop_packets");
+static std::string str_queue_depth("queue_depth");
+static std::string str_in_busy("in_busy");
+static std::string str_out_busy("out_busy");
+static std::string str_latency[12] = {
+    "in_latency_p50", "in_latency_p99", "in_latency_p999", "in_latency_max",
+    "out_latency_p50", "out_latency_p99", "out_latency_p999", "out_latency_max",
+    "out_submit_p50", "out_submit_p99", "out_submit_p999", "out_submit_max",
+};
 
 //  for debugging
 USBLink *lastUsbLink_;
 
-USBLink::USBLink(std::string const &vid, std::string const &pid, std::string const &ep_input, std::string const &ep_output, boost::shared_ptr<Logger> const &l) :
+USBLink::USBLink(std::string const &vid, std::string const &pid, std::string const &ep_input, std::string const &ep_output, size_t inFlight, boost::shared_ptr<Logger> const &l) :
     vid_(vid),
     pid_(pid),
     ep_input_(ep_input),
     ep_output_(ep_output),
+    inFlight_(inFlight),
     ctx_(0),
     dh_(0),
+    epfd_(-1),
+    wake_(-1),
     xfer_(0),
     pickup_(0),
     return_(0),
@@ -381,8 +558,17 @@ USBLink::USBLink(std::string const &vid, std::string const &pid, std::string con
     inPacketsProperty_(new PropertyImpl<long>(str_in_packets)),
     outPacketsProperty_(new PropertyImpl<long>(str_out_packets)),
     dropPacketsProperty_(new PropertyImpl<long>(str_drop_packets)),
+    queueDepthProperty_(new PropertyImpl<long>(str_queue_depth)),
+    inBusyProperty_(new PropertyImpl<long>(str_in_busy)),
+    outBusyProperty_(new PropertyImpl<long>(str_out_busy)),
+    lastLatency_(0),
+    logger_(l),
     name_(vid + ":" + pid)
 {
+    for (size_t i = 0; i != 12; ++i) {
+        latencyProperties_.push_back(boost::shared_ptr<Property>(
+            new PropertyImpl<double>(str_latency[i])));
+    }
 
     lastUsbLink_ = this;
 
@@ -409,13 +595,33 @@ USBLink::USBLink(std::string const &vid, std::string const &pid, std::string con
         throw std::runtime_error("Could not claim USB interface for comm board " +
             name_ + ". Is another process using it? " + libusb_error_name(er));
     }
-    xfer_ = new Transfer(dh_, iep_, oep_, l);
+    xfer_ = new Transfer(dh_, iep_, oep_, inFlight_, l);
     libusb_device_descriptor ldd;
     er = libusb_get_device_descriptor(libusb_get_device(dh_), &ldd);
     if (er < 0) {
         throw std::runtime_error("Could not find USB descriptor for comm board " + 
             name_);
     }
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ < 0 || wake_ < 0) {
+        throw std::runtime_error("Could not set up the USB thread for " + name_ + ": " +
+            strerror(errno));
+    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, wake_, &ev);
+    libusb_set_pollfd_notifiers(ctx_, &USBLink::pollfd_added, &USBLink::pollfd_removed, this);
+    libusb_pollfd const **fds = libusb_get_pollfds(ctx_);
+    if (!fds) {
+        throw std::runtime_error("Could not get the libusb descriptors for " + name_);
+    }
+    for (libusb_pollfd const **ptr = fds; *ptr; ++ptr) {
+        pollfd_added((*ptr)->fd, (*ptr)->events, this);
+    }
+    libusb_free_pollfds(fds);
     thread_ = boost::shared_ptr<boost::thread>(new boost::thread(
         boost::bind(&USBLink::thread_fn, this)));
 }
@@ -424,25 +630,33 @@ void USBLink::raw_send(void const *data, unsigned char sz) {
     if (sz > 64) {
         throw std::runtime_error("Too large buffer in raw_send()");
     }
+    if (xfer_->failed()) {
+        throw std::runtime_error("Failed writing to board.");
+    }
     xfer_->out_write(data, sz);
     ++outPackets_;
 }
 
+//  The returned data lives in the in ring slot until end_receive().
 unsigned char const *USBLink::begin_receive(size_t &oSize) {
-    if (recvQ_.empty()) {
-        oSize = 0;
-        return 0;
+    while (Packet *p = xfer_->in_peek()) {
+        if (p->size() > 0) {
+            oSize = p->size();
+            return p->buffer();
+        }
+        //  empty transfers are not interesting
+        xfer_->in_pop();
+        ++inPackets_;
     }
-    Packet *p = recvQ_.front();
-    oSize = p->size();
-    return p->buffer();
+    oSize = 0;
+    return 0;
 }
 
 void USBLink::end_receive(size_t size) {
-    if (!recvQ_.empty() && (size || (recvQ_.front()->size() == 0))) {
-        Packet *p = recvQ_.front();
-        recvQ_.pop_front();
-        p->destroy();
+    Packet *p = xfer_->in_peek();
+    if (p && (size || (p->size() == 0))) {
+        xfer_->in_pop();
+        ++inPackets_;
     }
 }
 
@@ -450,4 +664,8 @@ size_t USBLink::queue_depth() {
     return xfer_->out_queue_depth();
 }
 
+size_t USBLink::in_flight() {
+    return inFlight_;
+}
+
 
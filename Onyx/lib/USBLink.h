@@ -3,9 +3,13 @@
 
 #include "Module.h"
 #include "semaphore.h"
+#include "PacketRing.h"
+#include "Histogram.h"
+#include "iusblink.h"
 #include <assert.h>
 #include <boost/thread.hpp>
 #include <deque>
+#include <vector>
 
 struct libusb_context;
 struct libusb_device_handle;
@@ -14,20 +18,6 @@ class Transfer;
 class Board;
 class Logger;
 
-class Packet {
-public:
-    static inline Packet *create() { return new Packet(); }
-    void destroy() { delete this; }
-    void set_size(size_t sz) { assert(sz <= max_size()); size_ = sz; }
-    unsigned char *buffer() { return data_; }
-    size_t size() const { return size_; };
-    size_t max_size() const { return sizeof(data_); }
-private:
-    unsigned char data_[128];
-    size_t size_;
-    Packet() : size_(0) {}
-};
-
 class USBReceiver {
 public:
     virtual size_t on_data(unsigned char const *info, size_t sz) = 0;
@@ -36,7 +26,12 @@ public:
 
 enum LogWhat {
     LogUSBWrite = 1,
-    LogUSBRead = 2
+    LogUSBRead = 2,
+    //  a LatencySummary, once per LATENCY_PERIOD
+    LogUSBWriteLatency = 3,
+    LogUSBReadLatency = 4,
+    //  from raw_send() to the transfer being submitted
+    LogUSBSubmitLatency = 5
 };
 
 class Logger {
@@ -45,7 +40,7 @@ public:
     virtual ~Logger() {}
 };
 
-class USBLink : public cast_as_impl<Module, USBLink> {
+class USBLink : public cast_as_impl<Module, USBLink>, public IUSBLink {
 public:
     static boost::shared_ptr<Module> open(boost::shared_ptr<Settings> const &set,
         boost::shared_ptr<Logger> const &l);
@@ -55,16 +50,24 @@ public:
 
     virtual size_t num_properties();
     virtual boost::shared_ptr<Property> get_property_at(size_t ix);
+    //  raw_send() must only be called from one thread, and 
+    //  begin_receive()/end_receive() from one thread.
     void raw_send(void const *data, unsigned char sz);
     unsigned char const *begin_receive(size_t &oSize);
     void end_receive(size_t sz);
     size_t queue_depth();
+    //  number of transfers kept submitted in each direction
+    size_t in_flight();
 private:
     friend class USBReturn;
     USBLink(std::string const &vid, std::string const &pid,
         std::string const &ep_input, std::string const &ep_output,
-        boost::shared_ptr<Logger> const &logger);
+        size_t inFlight, boost::shared_ptr<Logger> const &logger);
     void thread_fn();
+    static void pollfd_added(int fd, short events, void *self);
+    static void pollfd_removed(int fd, void *self);
+    void update_latency(LatencyHistogram &hist, HistogramCounts &prev,
+        LogWhat what, boost::shared_ptr<Property> const *props);
 
     std::string vid_;
     std::string pid_;
@@ -74,14 +77,17 @@ private:
     unsigned short ipid_;
     unsigned int iep_;
     unsigned int oep_;
+    size_t inFlight_;
     libusb_context *ctx_;
     libusb_device_handle *dh_;
+    //  the libusb thread sleeps in epoll on libusb's descriptors and wake_
+    int epfd_;
+    int wake_;
     Transfer *xfer_;
     semaphore pickup_;
     semaphore return_;
     boost::mutex queueLock_;
     std::deque<Packet *> queue_;
-    std::deque<Packet *> recvQ_;
     boost::shared_ptr<boost::thread> thread_;
     size_t inPackets_;
     size_t outPackets_;
@@ -89,6 +95,16 @@ private:
     boost::shared_ptr<Property> inPacketsProperty_;
     boost::shared_ptr<Property> outPacketsProperty_;
     boost::shared_ptr<Property> dropPacketsProperty_;
+    boost::shared_ptr<Property> queueDepthProperty_;
+    boost::shared_ptr<Property> inBusyProperty_;
+    boost::shared_ptr<Property> outBusyProperty_;
+    //  p50, p99, p999 and max in milliseconds; in, then out, then submit
+    std::vector<boost::shared_ptr<Property>> latencyProperties_;
+    HistogramCounts inCounts_;
+    HistogramCounts outCounts_;
+    HistogramCounts submitCounts_;
+    double lastLatency_;
+    boost::shared_ptr<Logger> logger_;
     unsigned char sendBuf_[1024];
     unsigned int sendBufBegin_;
     unsigned int sendBufEnd_;
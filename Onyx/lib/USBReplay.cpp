@@ -0,0 +1,143 @@
+#include "USBReplay.h"
+#include "logger.h"
+#include "util.h"
+#include <string.h>
+#include <stdexcept>
+
+
+USBReplay::USBReplay(std::string const &logfile, bool realtime, size_t inFlight) :
+    realtime_(realtime),
+    inFlight_(inFlight),
+    start_(0),
+    nextIn_(0),
+    matched_(0),
+    differed_(0),
+    extra_(0),
+    firstDifference_(-1) {
+    loghdr lh;
+    if (!logger_open_read(logfile.c_str(), &lh)) {
+        throw std::runtime_error("Could not read USB replay log " + logfile);
+    }
+    logrec lr;
+    void const *data;
+    size_t size;
+    while (logger_read_next(&lr, &data, &size)) {
+        if ((lr.key != LogKeyUSBOutTimed && lr.key != LogKeyUSBInTimed) || size < sizeof(double)) {
+            continue;
+        }
+        packet p;
+        memcpy(&p.time_, data, sizeof(double));
+        p.outsBefore_ = out_.size();
+        p.data_.assign((unsigned char const *)data + sizeof(double),
+            (unsigned char const *)data + size);
+        if (lr.key == LogKeyUSBOutTimed) {
+            out_.push_back(p);
+        }
+        else if (!p.data_.empty()) {
+            //  empty transfers never make it out of the USBLink
+            in_.push_back(p);
+        }
+    }
+    logger_close_read();
+    if (out_.empty() && in_.empty()) {
+        throw std::runtime_error("No timed USB packets (from robot --recordusb) in " + logfile);
+    }
+    sentAt_.reserve(out_.size());
+    start_ = read_clock();
+}
+
+void USBReplay::raw_send(void const *data, unsigned char sz) {
+    size_t ix = sentAt_.size();
+    if (ix >= out_.size()) {
+        ++extra_;
+        return;
+    }
+    sentAt_.push_back(read_clock());
+    std::vector<unsigned char> const &want(out_[ix].data_);
+    if (want.size() == sz && !memcmp(&want[0], data, sz)) {
+        ++matched_;
+    }
+    else {
+        ++differed_;
+        if (firstDifference_ < 0) {
+            firstDifference_ = (long)ix;
+        }
+    }
+}
+
+unsigned char const *USBReplay::begin_receive(size_t &oSize) {
+    oSize = 0;
+    if (nextIn_ == in_.size()) {
+        return 0;
+    }
+    packet const &p(in_[nextIn_]);
+    if (p.outsBefore_ > sentAt_.size()) {
+        //  the board hasn't been asked for this yet
+        return 0;
+    }
+    if (realtime_) {
+        double due;
+        if (p.outsBefore_ == 0) {
+            due = start_ + (p.time_ - (out_.empty() ? in_[0].time_ :
+                std::min(in_[0].time_, out_[0].time_)));
+        }
+        else {
+            size_t k = p.outsBefore_ - 1;
+            due = sentAt_[k] + (p.time_ - out_[k].time_);
+        }
+        if (read_clock() < due) {
+            return 0;
+        }
+    }
+    oSize = p.data_.size();
+    return &p.data_[0];
+}
+
+void USBReplay::end_receive(size_t sz) {
+    if (sz && nextIn_ != in_.size()) {
+        ++nextIn_;
+    }
+}
+
+void USBReplay::step() {
+}
+
+size_t USBReplay::queue_depth() {
+    return 0;
+}
+
+size_t USBReplay::in_flight() {
+    return inFlight_;
+}
+
+bool USBReplay::done() const {
+    return nextIn_ == in_.size();
+}
+
+size_t USBReplay::in_count() const {
+    return in_.size();
+}
+
+size_t USBReplay::out_count() const {
+    return out_.size();
+}
+
+size_t USBReplay::received() const {
+    return nextIn_;
+}
+
+size_t USBReplay::matched() const {
+    return matched_;
+}
+
+size_t USBReplay::differed() const {
+    return differed_;
+}
+
+size_t USBReplay::extra() const {
+    return extra_;
+}
+
+long USBReplay::first_difference() const {
+    return firstDifference_;
+}
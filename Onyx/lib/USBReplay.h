@@ -0,0 +1,65 @@
+#if !defined(rl2_USBReplay_h)
+#define rl2_USBReplay_h
+
+#include "iusblink.h"
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+//  USBReplay plays back the USB traffic in a robot log recorded with
+//  --recordusb (LogKeyUSBOutTimed/LogKeyUSBInTimed), in place of the
+//  board. Each logged in packet is handed out once the out packets
+//  logged before it have been sent, and, when realtime, as long after
+//  the last of those as it was in the log (or after the start of the
+//  replay, for in packets that came before any out packet). Otherwise it
+//  comes as soon as it can. What's sent is compared to the logged out
+//  packets, in order.
+//  Not thread safe; use it from the thread that runs the ServoSet.
+class USBReplay : public IUSBLink, public boost::noncopyable {
+public:
+    //  throws if the log has no timed USB packets
+    USBReplay(std::string const &logfile, bool realtime, size_t inFlight = 4);
+
+    virtual void raw_send(void const *data, unsigned char sz);
+    virtual unsigned char const *begin_receive(size_t &oSize);
+    virtual void end_receive(size_t sz);
+    virtual void step();
+    virtual size_t queue_depth();
+    virtual size_t in_flight();
+
+    //  every logged in packet has been received
+    bool done() const;
+    size_t in_count() const;
+    size_t out_count() const;
+    size_t received() const;
+    //  sent packets that were the same as, or differed from, the logged
+    //  one at the same position; and ones past the end of the log
+    size_t matched() const;
+    size_t differed() const;
+    size_t extra() const;
+    //  index of the first sent packet that differed, or -1
+    long first_difference() const;
+
+private:
+    struct packet {
+        double time_;
+        //  out packets logged before this (in packets only)
+        size_t outsBefore_;
+        std::vector<unsigned char> data_;
+    };
+
+    std::vector<packet> out_;
+    std::vector<packet> in_;
+    //  when each out packet was actually sent
+    std::vector<double> sentAt_;
+    bool realtime_;
+    size_t inFlight_;
+    double start_;
+    size_t nextIn_;
+    size_t matched_;
+    size_t differed_;
+    size_t extra_;
+    long firstDifference_;
+};
+
+#endif  //  rl2_USBReplay_h
@@ -0,0 +1,558 @@
+#include "USBSim.h"
+#include "USBLink.h"
+#include "Settings.h"
+#include "PropertyImpl.h"
+#include "util.h"
+#include <string.h>
+#include <math.h>
+#include <stdexcept>
+#include <algorithm>
+
+
+//  what the OnyxWalker firmware allows
+#define MAX_SERVOS 24
+#define MAX_WRITE_SIZE 64
+#define MAX_READ_SIZE 64
+#define ID_BROADCAST 0xfe
+#define IN_PACKET_SIZE 64
+#define OUT_PACKET_SIZE 64
+
+//  the firmware holds the bus this long after each command it sends
+#define SEND_HOLD 5e-6
+//  and resets the receiver before a read
+#define READ_RESET 1e-6
+
+//  as in dispatch_out()
+static const unsigned char min_size[] = {
+    0x2,    //  set status
+    0x1,    //  get status
+    0x3,    //  write servo
+    0x3,    //  read servo
+    0x2,    //  text out
+    0x1,    //  raw write
+    0x1,    //  raw read
+    0x4,    //  sync write
+    0x3,    //  bulk read
+};
+
+struct SimModel {
+    char const *name;
+    unsigned short modelNumber;
+    //  position steps per turn, and the highest position
+    double stepsPerRev;
+    unsigned short maxPosition;
+    //  moving/present speed units, and the top speed
+    double rpmPerUnit;
+    double maxRpm;
+    bool current;
+};
+
+static const SimModel sim_models[] = {
+    { "mx", 310, 4096, 4095, 0.114, 63, true },         //  MX-64
+    { "ax", 12, 1024 * 360.0 / 300, 1023, 0.111, 114, false },  //  AX-12
+};
+
+
+SimParams::SimParams() :
+    servos(14),
+    model("mx"),
+    baud(1000000),
+    timeConstant(0.03),
+    usbLatency(0.001),
+    missingTimeout(0.005),
+    commandTime(10e-6),
+    powerWriteTime(0.0003),
+    volts(14.8),
+    inFlight(4) {
+}
+
+
+static SimModel const &find_model(std::string const &name) {
+    for (size_t i = 0; i != sizeof(sim_models) / sizeof(sim_models[0]); ++i) {
+        if (name == sim_models[i].name) {
+            return sim_models[i];
+        }
+    }
+    throw std::runtime_error("Unknown servo model '" + name + "' in USBSim.");
+}
+
+static unsigned short get_reg2(SimServo const &s, unsigned char reg) {
+    return s.regs_[reg] | (s.regs_[reg + 1] << 8);
+}
+
+static void set_reg2(SimServo &s, unsigned char reg, unsigned short val) {
+    s.regs_[reg] = val & 0xff;
+    s.regs_[reg + 1] = (val >> 8) & 0xff;
+}
+
+static void init_servo(SimServo &s, unsigned char id, SimModel const &m, double volts) {
+    memset(&s, 0, sizeof(s));
+    set_reg2(s, REG_MODEL_NUMBER, m.modelNumber);
+    s.regs_[REG_VERSION] = 36;
+    s.regs_[REG_ID] = id;
+    s.regs_[REG_BAUD_RATE] = 1;
+    //  factory settings, until ServoSet changes them
+    s.regs_[REG_RETURN_DELAY_TIME] = 250;
+    set_reg2(s, REG_CCW_ANGLE_LIMIT, m.maxPosition);
+    s.regs_[REG_HIGHEST_LIMIT_TEMPERATURE] = 80;
+    s.regs_[REG_LOWEST_LIMIT_VOLTAGE] = 60;
+    s.regs_[REG_HIGHEST_LIMIT_VOLTAGE] = 160;
+    set_reg2(s, REG_MAX_TORQUE, 1023);
+    s.regs_[REG_STATUS_RETURN_LEVEL] = 2;
+    s.regs_[REG_ALARM_LED] = 0x24;
+    s.regs_[REG_ALARM_SHUTDOWN] = 0x24;
+    s.regs_[REG_P_GAIN] = 32;
+    unsigned short center = (m.maxPosition + 1) / 2;
+    set_reg2(s, REG_GOAL_POSITION, center);
+    set_reg2(s, REG_TORQUE_LIMIT, 1023);
+    set_reg2(s, REG_PRESENT_POSITION, center);
+    s.regs_[REG_PRESENT_VOLTAGE] = (unsigned char)std::min(255.0, volts * 10);
+    s.regs_[REG_PRESENT_TEMPERATURE] = 40;
+    set_reg2(s, REG_PUNCH, 32);
+    if (m.current) {
+        set_reg2(s, REG_CURRENT, 2048);
+    }
+    s.pos_ = center;
+}
+
+
+boost::shared_ptr<Module> USBSim::open(boost::shared_ptr<Settings> const &set,
+    boost::shared_ptr<Logger> const &l) {
+    SimParams p;
+    boost::shared_ptr<Settings> sim;
+    if (!!set) {
+        sim = set->get_value("sim");
+    }
+    long servos = p.servos;
+    long inFlight = p.inFlight;
+    maybe_get(sim, "servos", servos);
+    maybe_get(sim, "model", p.model);
+    maybe_get(sim, "baud", p.baud);
+    maybe_get(sim, "time_constant", p.timeConstant);
+    maybe_get(sim, "usb_latency", p.usbLatency);
+    maybe_get(sim, "missing_timeout", p.missingTimeout);
+    maybe_get(sim, "volts", p.volts);
+    maybe_get(sim, "in_flight", inFlight);
+    if (servos < 0 || servos >= MAX_SERVOS) {
+        throw std::runtime_error("Bad servos setting in USBSim::open().");
+    }
+    if (inFlight < 1 || inFlight > 16) {
+        throw std::runtime_error("Bad in_flight setting in USBSim::open().");
+    }
+    p.servos = servos;
+    p.inFlight = inFlight;
+    return boost::shared_ptr<Module>(new USBSim(p, l));
+}
+
+static std::string str_in_packets("in_packets");
+static std::string str_out_packets("out_packets");
+static std::string str_queue_depth("queue_depth");
+static std::string str_bus_load("bus_load");
+
+USBSim::USBSim(SimParams const &params, boost::shared_ptr<Logger> const &l) :
+    params_(params),
+    logger_(l),
+    name_("sim:" + params.model),
+    powerStatus_(0),
+    busFree_(0),
+    busTime_(0),
+    inPackets_(0),
+    outPackets_(0),
+    inPacketsProperty_(new PropertyImpl<long>(str_in_packets)),
+    outPacketsProperty_(new PropertyImpl<long>(str_out_packets)),
+    queueDepthProperty_(new PropertyImpl<long>(str_queue_depth)),
+    busLoadProperty_(new PropertyImpl<double>(str_bus_load)),
+    lastLoad_(0),
+    lastBusTime_(0) {
+    if (params_.baud <= 0 || params_.servos >= MAX_SERVOS) {
+        throw std::runtime_error("Bad parameters for USBSim.");
+    }
+    SimModel const &m(find_model(params_.model));
+    double now = read_clock();
+    servos_.resize(params_.servos + 1);
+    for (unsigned char id = 1; id <= params_.servos; ++id) {
+        init_servo(servos_[id], id, m, params_.volts);
+        servos_[id].lastUpdate_ = now;
+    }
+    memset(servoStati_, 0, sizeof(servoStati_));
+    busFree_ = now;
+    lastLoad_ = now;
+}
+
+USBSim::~USBSim() {
+}
+
+void USBSim::step() {
+    inPacketsProperty_->set<long>(inPackets_);
+    outPacketsProperty_->set<long>(outPackets_);
+    queueDepthProperty_->set<long>(queue_depth());
+    double now = read_clock();
+    if (now - lastLoad_ >= 1.0) {
+        busLoadProperty_->set<double>((busTime_ - lastBusTime_) / (now - lastLoad_));
+        lastLoad_ = now;
+        lastBusTime_ = busTime_;
+    }
+}
+
+std::string const &USBSim::name() {
+    return name_;
+}
+
+size_t USBSim::num_properties() {
+    return 4;
+}
+
+boost::shared_ptr<Property> USBSim::get_property_at(size_t ix) {
+    switch (ix) {
+    case 0: return inPacketsProperty_;
+    case 1: return outPacketsProperty_;
+    case 2: return queueDepthProperty_;
+    case 3: return busLoadProperty_;
+    default:
+        throw std::runtime_error("index out of range in USBSim::get_property_at()");
+    }
+}
+
+//  The board handles one out packet at a time, each after the one
+//  before has let go of the bus, and sends what it has to say back in
+//  the next in packet.
+void USBSim::raw_send(void const *data, unsigned char sz) {
+    if (sz > OUT_PACKET_SIZE) {
+        throw std::runtime_error("Too large buffer in raw_send()");
+    }
+    if (sz == 0) {
+        return;
+    }
+    ++outPackets_;
+    if (!!logger_) {
+        logger_->log_data(LogUSBWrite, data, sz);
+    }
+    unsigned char const *pkt = (unsigned char const *)data;
+    double start = std::max(read_clock() + params_.usbLatency * 0.5, busFree_);
+    double t = start;
+    inpacket ip;
+    ip.data_.reserve(IN_PACKET_SIZE);
+    //  the response starts with the latest sequence number
+    ip.data_.push_back(pkt[0]);
+    dispatch(pkt, sz, ip.data_, t);
+    busTime_ += t - start;
+    busFree_ = t;
+    ip.due_ = t + params_.usbLatency * 0.5;
+    in_.push_back(ip);
+}
+
+unsigned char const *USBSim::begin_receive(size_t &oSize) {
+    if (in_.empty() || in_.front().due_ > read_clock()) {
+        oSize = 0;
+        return 0;
+    }
+    oSize = in_.front().data_.size();
+    return &in_.front().data_[0];
+}
+
+void USBSim::end_receive(size_t sz) {
+    if (sz && !in_.empty()) {
+        if (!!logger_) {
+            logger_->log_data(LogUSBRead, &in_.front().data_[0], in_.front().data_.size());
+        }
+        in_.pop_front();
+        ++inPackets_;
+    }
+}
+
+//  packets the board hasn't answered yet
+size_t USBSim::queue_depth() {
+    return in_.size();
+}
+
+size_t USBSim::in_flight() {
+    return params_.inFlight;
+}
+
+SimParams const &USBSim::params() const {
+    return params_;
+}
+
+SimServo const *USBSim::servo(unsigned char id) const {
+    if (id == 0 || id >= servos_.size()) {
+        return 0;
+    }
+    return &servos_[id];
+}
+
+SimServo *USBSim::find(unsigned char id) {
+    if (id == 0 || id >= servos_.size()) {
+        return 0;
+    }
+    return &servos_[id];
+}
+
+double USBSim::bus_time() const {
+    return busTime_;
+}
+
+size_t USBSim::in_packets() const {
+    return inPackets_;
+}
+
+size_t USBSim::out_packets() const {
+    return outPackets_;
+}
+
+void USBSim::update_servos() {
+    double now = read_clock();
+    for (auto ptr(servos_.begin() + 1), end(servos_.end()); ptr < end; ++ptr) {
+        update(*ptr, now);
+    }
+}
+
+double USBSim::bytes(size_t n) const {
+    return n * 10 / params_.baud;
+}
+
+void USBSim::dispatch(unsigned char const *pkt, size_t sz, std::vector<unsigned char> &resp,
+    double &t) {
+    size_t ptr = 1;
+    while (ptr < sz) {
+        unsigned char code = pkt[ptr];
+        ++ptr;
+        size_t n = code & 0xf;
+        if (n == 15) {
+            if (ptr == sz) {
+                throw std::runtime_error("USBSim: Too big recv");
+            }
+            n = pkt[ptr];
+            ++ptr;
+        }
+        if (ptr + n > sz) {
+            throw std::runtime_error("USBSim: Too big recv");
+        }
+        unsigned char code_ix = (code & 0xf0) >> 4;
+        if (code_ix >= sizeof(min_size)) {
+            throw std::runtime_error("USBSim: Unknown op");
+        }
+        if (n < min_size[code_ix]) {
+            throw std::runtime_error("USBSim: Too small data");
+        }
+        unsigned char const *base = &pkt[ptr];
+        switch (code & 0xf0) {
+        case OpSetStatus:
+            if (base[0] != TargetPower) {
+                throw std::runtime_error("USBSim: Invalid target");
+            }
+            if (n > 1) {
+                powerStatus_ = base[1];
+                t += params_.powerWriteTime;
+            }
+            break;
+        case OpGetStatus:
+            get_status(base[0], resp);
+            break;
+        case OpWriteServo:
+            write_servo(base[0], base[1], n - 2, base + 2, t);
+            break;
+        case OpReadServo:
+            read_servo(base[0], base[1], base[2], resp, t);
+            break;
+        case OpOutText:
+            break;
+        case OpRawWrite:
+            t += bytes(n) + SEND_HOLD;
+            break;
+        case OpRawRead:
+            //  nothing on the bus answers raw reads
+            if (base[0] > MAX_READ_SIZE) {
+                throw std::runtime_error("USBSim: RawReadSize");
+            }
+            t += params_.missingTimeout;
+            add_response(resp, OpRawRead, 0, 0);
+            break;
+        case OpSyncWrite:
+            sync_write(base[0], base[1], n - 2, base + 2, t);
+            break;
+        case OpBulkRead:
+            for (size_t ix = 2; ix != n; ++ix) {
+                if (IN_PACKET_SIZE - resp.size() < (size_t)base[1] + 4) {
+                    break;
+                }
+                read_servo(base[ix], base[0], base[1], resp, t);
+            }
+            break;
+        }
+        t += params_.commandTime;
+        ptr += n;
+    }
+}
+
+void USBSim::add_response(std::vector<unsigned char> &resp, unsigned char code,
+    unsigned char sz, unsigned char const *data) {
+    size_t adj = (sz >= 15) ? 2 : 1;
+    if (IN_PACKET_SIZE - resp.size() < sz + adj) {
+        throw std::runtime_error("USBSim: Too much response");
+    }
+    if (sz < 15) {
+        resp.push_back(code | sz);
+    }
+    else {
+        resp.push_back(code | 0xf);
+        resp.push_back(sz);
+    }
+    resp.insert(resp.end(), data, data + sz);
+}
+
+void USBSim::get_status(unsigned char target, std::vector<unsigned char> &resp) {
+    switch (target) {
+    case TargetPower: {
+            unsigned short cvolts = (unsigned short)(params_.volts * 100);
+            unsigned char d[5] = {
+                TargetPower,
+                (unsigned char)(cvolts & 0xff),
+                (unsigned char)((cvolts >> 8) & 0xff),
+                powerStatus_,
+                0
+            };
+            add_response(resp, OpGetStatus, 5, d);
+        }
+        break;
+    case TargetServos:
+        servoStati_[0] = TargetServos;
+        add_response(resp, OpGetStatus, MAX_SERVOS + 1, servoStati_);
+        break;
+    default:
+        throw std::runtime_error("USBSim: Invalid target");
+    }
+}
+
+void USBSim::write_servo(unsigned char id, unsigned char reg, unsigned char sz,
+    unsigned char const *data, double &t) {
+    if (sz > MAX_WRITE_SIZE) {
+        throw std::runtime_error("USBSim: Write Size");
+    }
+    if (id >= MAX_SERVOS && id != ID_BROADCAST) {
+        throw std::runtime_error("USBSim: Servo ID");
+    }
+    //  0xff 0xff id len WRITE reg data... checksum
+    t += bytes(7 + sz) + SEND_HOLD;
+    if (id == ID_BROADCAST) {
+        for (auto ptr(servos_.begin() + 1), end(servos_.end()); ptr < end; ++ptr) {
+            write_regs(*ptr, reg, sz, data, t);
+        }
+    }
+    else if (SimServo *s = find(id)) {
+        write_regs(*s, reg, sz, data, t);
+    }
+}
+
+void USBSim::sync_write(unsigned char reg, unsigned char len, unsigned char sz,
+    unsigned char const *data, double &t) {
+    if (len == 0 || len > MAX_WRITE_SIZE || sz % (len + 1)) {
+        throw std::runtime_error("USBSim: Sync Size");
+    }
+    for (unsigned char ix = 0; ix < sz; ix += len + 1) {
+        if (data[ix] >= MAX_SERVOS) {
+            throw std::runtime_error("USBSim: Servo ID");
+        }
+    }
+    //  0xff 0xff 0xfe len SYNC reg len { id data... }... checksum
+    t += bytes(8 + sz) + SEND_HOLD;
+    for (unsigned char ix = 0; ix < sz; ix += len + 1) {
+        if (SimServo *s = find(data[ix])) {
+            write_regs(*s, reg, len, data + ix + 1, t);
+        }
+    }
+}
+
+void USBSim::read_servo(unsigned char id, unsigned char reg, unsigned char sz,
+    std::vector<unsigned char> &resp, double &t) {
+    if (sz > MAX_READ_SIZE) {
+        throw std::runtime_error("USBSim: Read Size");
+    }
+    if (id >= MAX_SERVOS) {
+        throw std::runtime_error("USBSim: Servo ID");
+    }
+    //  0xff 0xff id 4 READ reg sz checksum
+    t += READ_RESET + bytes(8) + SEND_HOLD;
+    SimServo *s = find(id);
+    if (!s) {
+        t += params_.missingTimeout;
+        return;
+    }
+    t += s->regs_[REG_RETURN_DELAY_TIME] * 2e-6;
+    update(*s, t);
+    //  0xff 0xff id len error data... checksum
+    t += bytes(6 + sz);
+    ++s->reads_;
+    if (reg <= REG_PRESENT_POSITION && reg + sz > REG_PRESENT_POSITION_HI) {
+        ++s->positionReads_;
+    }
+    servoStati_[id] = 0;
+    //  id, reg, data
+    unsigned char buf[MAX_READ_SIZE + 2];
+    buf[0] = id;
+    buf[1] = reg;
+    for (unsigned char ix = 0; ix != sz; ++ix) {
+        buf[ix + 2] = (reg + ix < NUM_SERVO_REGS) ? s->regs_[reg + ix] : 0;
+    }
+    add_response(resp, OpReadServo, sz + 2, buf);
+}
+
+void USBSim::write_regs(SimServo &s, unsigned char reg, unsigned char sz,
+    unsigned char const *data, double t) {
+    //  a new goal counts from when it arrives
+    update(s, t);
+    ++s.writes_;
+    for (unsigned char ix = 0; ix != sz; ++ix) {
+        unsigned int r = reg + ix;
+        if (r >= NUM_SERVO_REGS) {
+            break;
+        }
+        //  read-only registers, and the EEPROM area once locked; the ID
+        //  stays what it is, too
+        if (r <= REG_ID || (r >= REG_PRESENT_POSITION && r <= REG_MOVING) ||
+            r == REG_CURRENT || r == REG_CURRENT_HI ||
+            (r < REG_TORQUE_ENABLE && s.regs_[REG_LOCK])) {
+            continue;
+        }
+        s.regs_[r] = data[ix];
+    }
+}
+
+//  First order approach to the goal position, no faster than the moving
+//  speed allows; load and current follow the remaining error.
+void USBSim::update(SimServo &s, double t) {
+    double dt = t - s.lastUpdate_;
+    if (dt <= 0) {
+        return;
+    }
+    s.lastUpdate_ = t;
+    SimModel const &m(find_model(params_.model));
+    double err = 0;
+    double step = 0;
+    if (s.regs_[REG_TORQUE_ENABLE]) {
+        double goal = std::min((double)m.maxPosition, (double)get_reg2(s, REG_GOAL_POSITION));
+        unsigned short speed = get_reg2(s, REG_MOVING_SPEED) & 0x3ff;
+        double rpm = (speed == 0) ? m.maxRpm : std::min(m.maxRpm, speed * m.rpmPerUnit);
+        double vmax = rpm * m.stepsPerRev / 60;
+        step = (goal - s.pos_) * (1 - exp(-dt / params_.timeConstant));
+        step = std::max(-vmax * dt, std::min(vmax * dt, step));
+        s.pos_ += step;
+        err = goal - s.pos_;
+    }
+    s.vel_ = step / dt;
+    set_reg2(s, REG_PRESENT_POSITION,
+        (unsigned short)std::max(0.0, std::min((double)m.maxPosition, floor(s.pos_ + 0.5))));
+    //  speed and load count up from 0 counterclockwise (increasing
+    //  position), and from 1024 clockwise
+    double rpm = fabs(s.vel_) * 60 / m.stepsPerRev;
+    unsigned short speed = (unsigned short)std::min(1023.0, rpm / m.rpmPerUnit);
+    set_reg2(s, REG_PRESENT_SPEED, speed | ((s.vel_ < 0) ? 1024 : 0));
+    double limit = get_reg2(s, REG_TORQUE_LIMIT) & 0x3ff;
+    unsigned short load = (unsigned short)std::min(limit, fabs(err) * 8);
+    set_reg2(s, REG_PRESENT_LOAD, load | ((err < 0) ? 1024 : 0));
+    if (m.current) {
+        //  4.5 mA per step from 2048; about 5 A at full load
+        int current = (int)(load * 1.1);
+        set_reg2(s, REG_CURRENT, (unsigned short)(2048 + ((err < 0) ? -current : current)));
+    }
+    s.regs_[REG_MOVING] = (fabs(step) >= 0.5) ? 1 : 0;
+}
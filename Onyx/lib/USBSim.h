@@ -0,0 +1,138 @@
+#if !defined(rl2_USBSim_h)
+#define rl2_USBSim_h
+
+#include "Module.h"
+#include "iusblink.h"
+#include "ServoSet.h"
+#include <deque>
+#include <vector>
+#include <string>
+
+class Settings;
+class Logger;
+class Property;
+
+//  What the simulated board and servos are like. Times are in seconds.
+struct SimParams {
+    SimParams();
+    //  servos 1 .. servos are on the bus
+    unsigned servos;
+    //  "mx" (4096 steps per turn, current sensing) or "ax" (1024 steps
+    //  over 300 degrees)
+    std::string model;
+    //  Dynamixel bus rate, in bits per second (10 bits per byte)
+    double baud;
+    //  the servos approach their goal with this time constant, no faster
+    //  than their moving speed (or top speed, for speed 0)
+    double timeConstant;
+    //  USB transfer time, out and back, on top of the bus time
+    double usbLatency;
+    //  how long the board waits for a servo that doesn't answer
+    double missingTimeout;
+    //  handling each command in the board
+    double commandTime;
+    //  the power board, over I2C
+    double powerWriteTime;
+    double volts;
+    //  transfers kept in flight, like USBLink's "in_flight"
+    size_t inFlight;
+};
+
+//  One simulated servo: its register file, and where it really is.
+struct SimServo {
+    unsigned char regs_[NUM_SERVO_REGS];
+    double pos_;
+    double vel_;
+    double lastUpdate_;
+    size_t reads_;
+    //  reads that included the present position
+    size_t positionReads_;
+    size_t writes_;
+};
+
+//  USBSim stands in for the USBLink and the OnyxWalker board behind it,
+//  running the board's protocol (as in dispatch_out() in OnyxWalker.c)
+//  against a model of a Dynamixel bus. Each out packet waits for the bus,
+//  takes as long on it as its commands would at the baud rate (return
+//  delays and missing servo timeouts included), and comes back as one in
+//  packet when it's done. Servo positions follow their goals over time.
+//  With "backend":"sim" in settings.ini, ServoSet opens one of these
+//  instead of a USBLink, set up from the "sim" object:
+//      "sim":{"servos":14,"model":"mx","baud":1000000,"time_constant":0.03,
+//          "usb_latency":0.001,"missing_timeout":0.005,"volts":14.8}
+//  Bad commands throw, where the board would stop with MY_Failure().
+//  Not thread safe; ServoSet calls it from one thread.
+class USBSim : public cast_as_impl<Module, USBSim>, public IUSBLink {
+public:
+    static boost::shared_ptr<Module> open(boost::shared_ptr<Settings> const &set,
+        boost::shared_ptr<Logger> const &l);
+    USBSim(SimParams const &params, boost::shared_ptr<Logger> const &l);
+    ~USBSim();
+
+    void step();
+    std::string const &name();
+    virtual size_t num_properties();
+    virtual boost::shared_ptr<Property> get_property_at(size_t ix);
+
+    void raw_send(void const *data, unsigned char sz);
+    unsigned char const *begin_receive(size_t &oSize);
+    void end_receive(size_t sz);
+    size_t queue_depth();
+    size_t in_flight();
+
+    SimParams const &params() const;
+    //  servo id, or 0 if it's not on the bus
+    SimServo const *servo(unsigned char id) const;
+    //  brings the simulated servos up to the current time
+    void update_servos();
+    //  seconds the bus has been busy so far
+    double bus_time() const;
+    size_t in_packets() const;
+    size_t out_packets() const;
+
+private:
+    struct inpacket {
+        double due_;
+        std::vector<unsigned char> data_;
+    };
+
+    void dispatch(unsigned char const *pkt, size_t sz, std::vector<unsigned char> &resp,
+        double &t);
+    void add_response(std::vector<unsigned char> &resp, unsigned char code,
+        unsigned char sz, unsigned char const *data);
+    void get_status(unsigned char target, std::vector<unsigned char> &resp);
+    void write_servo(unsigned char id, unsigned char reg, unsigned char sz,
+        unsigned char const *data, double &t);
+    void sync_write(unsigned char reg, unsigned char len, unsigned char sz,
+        unsigned char const *data, double &t);
+    void read_servo(unsigned char id, unsigned char reg, unsigned char sz,
+        std::vector<unsigned char> &resp, double &t);
+    void write_regs(SimServo &s, unsigned char reg, unsigned char sz,
+        unsigned char const *data, double t);
+    void update(SimServo &s, double t);
+    //  time on the bus for n bytes
+    double bytes(size_t n) const;
+    SimServo *find(unsigned char id);
+
+    SimParams params_;
+    boost::shared_ptr<Logger> logger_;
+    std::string name_;
+    //  indexed by id; servos_[0] is never on the bus
+    std::vector<SimServo> servos_;
+    unsigned char servoStati_[25];
+    unsigned char powerStatus_;
+    //  the bus is in use until then
+    double busFree_;
+    double busTime_;
+    std::deque<inpacket> in_;
+    size_t inPackets_;
+    size_t outPackets_;
+    boost::shared_ptr<Property> inPacketsProperty_;
+    boost::shared_ptr<Property> outPacketsProperty_;
+    boost::shared_ptr<Property> queueDepthProperty_;
+    boost::shared_ptr<Property> busLoadProperty_;
+    double lastLoad_;
+    double lastBusTime_;
+};
+
+#endif  //  rl2_USBSim_h
@@ -0,0 +1,152 @@
+
+#include "VideoRateController.h"
+
+
+#define MIN_FPS 2.0
+#define MAX_FPS 30.0
+#define START_FPS 4.0
+#define FPS_STEP 1.0
+//  more than this fraction of fragments lost means congestion
+#define MAX_LOSS 0.02
+//  update() periods at max rate before trying a bigger resolution
+#define STEP_UP_PERIODS 8
+
+//  The robot sends the camera image as-is for the first level,
+//  and a re-compressed quarter size thumbnail for the second.
+static struct {
+    unsigned short width;
+    unsigned short height;
+} const ladder[] = {
+    { 1280, 720 },
+    { 320, 180 },
+};
+static size_t const num_levels = sizeof(ladder) / sizeof(ladder[0]);
+
+//  The FEC to ask for at up to each fraction of fragments lost (or 
+//  recovered). Two parity fragments per group are interleaved, so they 
+//  also cover a burst of two.
+static struct {
+    double loss;
+    unsigned char data;
+    unsigned char parity;
+} const fecLadder[] = {
+    { 0.002, 0, 0 },
+    { 0.01, 16, 1 },
+    { 0.03, 8, 1 },
+    { 0.06, 8, 2 },
+    { 2.0, 4, 2 },
+};
+static size_t const num_fec_levels = sizeof(fecLadder) / sizeof(fecLadder[0]);
+
+
+VideoRateController::VideoRateController(double maxLatency) :
+    maxLatency_(maxLatency),
+    fps_(START_FPS),
+    rtt_(0),
+    lost_(0),
+    received_(0),
+    overflows_(0),
+    goodPeriods_(0),
+    level_(0),
+    fragsReceived_(0),
+    fragsLost_(0),
+    fecLoss_(0),
+    fecLevel_(0) {
+}
+
+void VideoRateController::on_loss(int lost, int received) {
+    lost_ += lost;
+    received_ += received;
+}
+
+void VideoRateController::on_overflow(int count) {
+    overflows_ += count;
+}
+
+void VideoRateController::on_rtt(double rtt) {
+    if (rtt_ == 0) {
+        rtt_ = rtt;
+    }
+    else {
+        rtt_ = rtt_ * 0.75 + rtt * 0.25;
+    }
+}
+
+void VideoRateController::on_fragments(int received, int lost, int recovered) {
+    fragsReceived_ += received;
+    fragsLost_ += lost + recovered;
+}
+
+void VideoRateController::update() {
+    if (fragsReceived_ + fragsLost_ > 0) {
+        double loss = (double)fragsLost_ / (fragsReceived_ + fragsLost_);
+        fecLoss_ = fecLoss_ * 0.75 + loss * 0.25;
+        fecLevel_ = 0;
+        while (fecLevel_ + 1 < num_fec_levels && fecLoss_ > fecLadder[fecLevel_].loss) {
+            ++fecLevel_;
+        }
+    }
+    fragsReceived_ = 0;
+    fragsLost_ = 0;
+
+    bool congested = overflows_ > 0 ||
+        (lost_ > 0 && (double)lost_ / (lost_ + received_) > MAX_LOSS) ||
+        rtt_ > maxLatency_;
+    lost_ = 0;
+    received_ = 0;
+    overflows_ = 0;
+
+    if (congested) {
+        goodPeriods_ = 0;
+        if (fps_ <= MIN_FPS && level_ + 1 < num_levels) {
+            //  a smaller picture is better than a slide show
+            ++level_;
+            fps_ = START_FPS;
+            return;
+        }
+        fps_ = fps_ * 0.5;
+        if (fps_ < MIN_FPS) {
+            fps_ = MIN_FPS;
+        }
+        return;
+    }
+
+    fps_ += FPS_STEP;
+    if (fps_ >= MAX_FPS) {
+        fps_ = MAX_FPS;
+        ++goodPeriods_;
+        if (goodPeriods_ >= STEP_UP_PERIODS && level_ > 0) {
+            --level_;
+            goodPeriods_ = 0;
+            fps_ = START_FPS;
+        }
+    }
+}
+
+double VideoRateController::interval() const {
+    return 1.0 / fps_;
+}
+
+unsigned short VideoRateController::width() const {
+    return ladder[level_].width;
+}
+
+unsigned short VideoRateController::height() const {
+    return ladder[level_].height;
+}
+
+double VideoRateController::rtt() const {
+    return rtt_;
+}
+
+double VideoRateController::max_latency() const {
+    return maxLatency_;
+}
+
+unsigned char VideoRateController::fec_data() const {
+    return fecLadder[fecLevel_].data;
+}
+
+unsigned char VideoRateController::fec_parity() const {
+    return fecLadder[fecLevel_].parity;
+}
@@ -0,0 +1,51 @@
+#if !defined(rl2_VideoRateController_h)
+#define rl2_VideoRateController_h
+
+#include <stddef.h>
+
+//  VideoRateController picks the video frame rate and resolution to
+//  request from the robot. It's fed loss, send overflows reported by the
+//  robot, and round-trip time, once per update() period. Frame rate goes
+//  up additively while things are good, and is halved when they're not
+//  (loss, overflow, or round-trip time over the latency bound). When the
+//  rate bottoms out, it steps down the resolution ladder; when it's been
+//  at the top for a while, it steps back up.
+//  It also picks how much FEC to ask for, from the fragment loss seen 
+//  before FEC repairs it.
+class VideoRateController {
+public:
+    VideoRateController(double maxLatency);
+
+    void on_loss(int lost, int received);
+    void on_overflow(int count);
+    void on_rtt(double rtt);
+    //  fragment counts from the network's per-peer stats
+    void on_fragments(int received, int lost, int recovered);
+    void update();
+
+    //  seconds between frames
+    double interval() const;
+    unsigned short width() const;
+    unsigned short height() const;
+    double rtt() const;
+    double max_latency() const;
+    //  FEC parity fragments per group of data fragments, or 0, 0
+    unsigned char fec_data() const;
+    unsigned char fec_parity() const;
+
+private:
+    double maxLatency_;
+    double fps_;
+    double rtt_;
+    int lost_;
+    int received_;
+    int overflows_;
+    int goodPeriods_;
+    size_t level_;
+    int fragsReceived_;
+    int fragsLost_;
+    double fecLoss_;
+    size_t fecLevel_;
+};
+
+#endif  //  rl2_VideoRateController_h
@@ -1,15 +1,25 @@
 
 #include "fakes.h"
+#include "Histogram.h"
+//  for the OnyxWalker opcodes
+#include "../LUFA/OnyxWalker/MyProto.h"
 #include <iostream>
 #include <stdexcept>
 
 
 Fakenet::Fakenet() {
     stepCnt_ = 0;
+    waitCnt_ = 0;
     wasLocked_ = false;
     wasUnlocked_ = false;
     locked_ = false;
     timeout_ = 0;
+    reliable_ = false;
+    sendRate_ = 0;
+    fecData_ = 0;
+    fecParity_ = 0;
+    memset(&group_, 0, sizeof(group_));
+    memset(&remote_, 0, sizeof(remote_));
 }
 
 void Fakenet::step() {
@@ -30,17 +40,17 @@ void Fakenet::broadcast(size_t size, void const *packet) {
     iovec iov[1];
     iov[0].iov_base = const_cast<void *>(packet);
     iov[0].iov_len = size;
-    vsend(false, 1, iov);
+    vsend(false, 1, iov, SendControl);
 }
 
 void Fakenet::respond(size_t size, void const *packet) {
     iovec iov[1];
     iov[0].iov_base = const_cast<void *>(packet);
     iov[0].iov_len = size;
-    vsend(true, 1, iov);
+    vsend(true, 1, iov, SendControl);
 }
 
-void Fakenet::vsend(bool response, size_t cnt, iovec const *vecs) {
+void Fakenet::vsend(bool response, size_t cnt, iovec const *vecs, SendClass cls) {
     std::vector<char> sent;
     while (cnt > 0) {
         sent.insert(sent.end(), (char const *)vecs->iov_base, (char const *)vecs->iov_base + vecs->iov_len);
@@ -48,6 +58,12 @@ void Fakenet::vsend(bool response, size_t cnt, iovec const *vecs) {
         --cnt;
     }
     wereSent_.push_back(std::pair<bool, std::vector<char>>(response, sent));
+    sentClasses_.push_back(cls);
+}
+
+void Fakenet::vsend_nocopy(bool response, size_t cnt, iovec const *vecs,
+    boost::shared_ptr<void const> const &hold, SendClass cls) {
+    vsend(response, cnt, vecs, cls);
 }
 
 void Fakenet::lock_address(double timeout) {
@@ -74,6 +90,59 @@ void Fakenet::check_clear_loss(int &lost, int &got) {
     got = 3;
 }
 
+void Fakenet::check_clear_loss(std::vector<PeerStats> &stats) {
+    stats.clear();
+}
+
+void Fakenet::set_reliable(bool reliable) {
+    reliable_ = reliable;
+}
+
+void Fakenet::pool_stats(size_t &inuse, size_t &highwater, size_t &heapallocs) {
+    inuse = 0;
+    highwater = 0;
+    heapallocs = 0;
+}
+
+void Fakenet::set_send_rate(double bytesPerSecond) {
+    sendRate_ = bytesPerSecond;
+}
+
+void Fakenet::set_fec(unsigned dataFrags, unsigned parityFrags) {
+    fecData_ = dataFrags;
+    fecParity_ = parityFrags;
+}
+
+void Fakenet::wait(double timeout) {
+    ++waitCnt_;
+}
+
+void Fakenet::dispatch_latency(LatencySummary &oSummary) {
+    memset(&oSummary, 0, sizeof(oSummary));
+}
+
+bool Fakenet::peer_clock(double &offset, double &rtt) {
+    offset = 0;
+    rtt = 0;
+    return false;
+}
+
+void Fakenet::rtt_latency(LatencySummary &oSummary) {
+    memset(&oSummary, 0, sizeof(oSummary));
+}
+
+void Fakenet::set_group(sockaddr_in const &group) {
+    group_ = group;
+}
+
+sockaddr_in Fakenet::remote() {
+    return remote_;
+}
+
+void Fakenet::set_remote(sockaddr_in const &addr) {
+    remote_ = addr;
+}
+
 
 
 void Fakestatus::message(std::string const &str) {
@@ -95,16 +164,17 @@ bool Fakestatus::get_message(Message &om) {
 
 int Fakesockets::recvfrom(void *buf, size_t sz, sockaddr_in &addr) {
     if (toReceive_.size() > 0) {
-        rec r = toReceive_.front();
-        toReceive_.pop_front();
-        if (r.ret < 0) {
-            return r.ret;
-        }
-        if (r.data.size() > 0) {
-            memcpy(buf, &r.data[0], std::min(sz, r.data.size()));
+        rec const &r = toReceive_.front();
+        int ret = r.ret;
+        if (ret >= 0) {
+            if (r.data.size() > 0) {
+                memcpy(buf, &r.data[0], std::min(sz, r.data.size()));
+            }
+            addr = r.addr;
+            ret = std::min(sz, r.data.size());
         }
-        r.addr = addr;
-        return std::min(sz, r.data.size());
+        toReceive_.pop_front();
+        return ret;
     }
     return -1;
 }
@@ -149,6 +219,15 @@ size_t Fakesocket::peek(void *buf, size_t maxSize) {
     return maxSize;
 }
 
+size_t Fakesocket::peek_spans(iovec oSpans[2]) {
+    if (!toRecv_.size() || toRecv_.front().empty()) {
+        return 0;
+    }
+    oSpans[0].iov_base = &toRecv_.front()[0];
+    oSpans[0].iov_len = toRecv_.front().size();
+    return 1;
+}
+
 void Fakesocket::recvd(size_t maxSize) {
     if (!toRecv_.size()) {
         if (maxSize > 0) {
@@ -167,6 +246,9 @@ void Fakesocket::recvd(size_t maxSize) {
     }
 }
 
+void Fakesocket::set_max_buffer(size_t size) {
+}
+
 size_t Fakesocket::send(void const *buf, size_t size) {
     sent_.push_back(std::vector<char>());
     sent_.back().resize(size);
@@ -195,3 +277,98 @@ void Faketime::sleep(double dt) {
 
 
 
+Fakeusb::Fakeusb() {
+    inFlight_ = 4;
+    bytesSent_ = 0;
+    memset(opsSent_, 0, sizeof(opsSent_));
+}
+
+void Fakeusb::respond(std::vector<unsigned char> &resp, unsigned char code,
+    unsigned char sz, unsigned char const *data) {
+    if (sz < 15) {
+        resp.push_back(code | sz);
+    }
+    else {
+        resp.push_back(code | 0xf);
+        resp.push_back(sz);
+    }
+    resp.insert(resp.end(), data, data + sz);
+}
+
+void Fakeusb::raw_send(void const *data, unsigned char sz) {
+    if (sz > 64 || sz < 1) {
+        throw std::runtime_error("Bad packet size in Fakeusb::raw_send()");
+    }
+    unsigned char const *ptr = (unsigned char const *)data;
+    wereSent_.push_back(std::vector<unsigned char>(ptr, ptr + sz));
+    bytesSent_ += sz;
+
+    std::vector<unsigned char> resp;
+    resp.push_back(ptr[0]);
+    unsigned char const *end = ptr + sz;
+    ++ptr;
+    unsigned char buf[64] = { 0 };
+    while (ptr < end) {
+        unsigned char code = *ptr & 0xf0;
+        unsigned char cnt = *ptr & 0xf;
+        ++ptr;
+        if (cnt == 15) {
+            cnt = *ptr;
+            ++ptr;
+        }
+        if (ptr + cnt > end) {
+            throw std::runtime_error("Bad command size in Fakeusb::raw_send()");
+        }
+        ++opsSent_[code >> 4];
+        switch (code) {
+        case OpGetStatus:
+            buf[0] = ptr[0];
+            //  power is volts, status, failure; servos is one byte per servo
+            respond(resp, OpGetStatus, ptr[0] == TargetPower ? 5 : 25, buf);
+            break;
+        case OpReadServo:
+            buf[0] = ptr[0];
+            buf[1] = ptr[1];
+            respond(resp, OpReadServo, 2 + ptr[2], buf);
+            break;
+        case OpBulkRead:
+            for (unsigned char i = 2; i < cnt; ++i) {
+                buf[0] = ptr[i];
+                buf[1] = ptr[0];
+                respond(resp, OpReadServo, 2 + ptr[1], buf);
+            }
+            break;
+        }
+        ptr += cnt;
+    }
+    if (resp.size() > 64) {
+        throw std::runtime_error("Too much response in Fakeusb::raw_send()");
+    }
+    toReceive_.push_back(resp);
+}
+
+unsigned char const *Fakeusb::begin_receive(size_t &oSize) {
+    if (toReceive_.empty()) {
+        oSize = 0;
+        return 0;
+    }
+    oSize = toReceive_.front().size();
+    return &toReceive_.front()[0];
+}
+
+void Fakeusb::end_receive(size_t sz) {
+    if (sz && !toReceive_.empty()) {
+        toReceive_.pop_front();
+    }
+}
+
+void Fakeusb::step() {
+}
+
+size_t Fakeusb::queue_depth() {
+    return 0;
+}
+
+size_t Fakeusb::in_flight() {
+    return inFlight_;
+}
@@ -4,6 +4,7 @@
 #include "inetwork.h"
 #include "istatus.h"
 #include "itime.h"
+#include "iusblink.h"
 #include <list>
 #include <vector>
 #include <string.h>
@@ -19,20 +20,42 @@ public:
     virtual bool receive(size_t &size, void const *&packet);
     virtual void broadcast(size_t size, void const *packet);
     virtual void respond(size_t size, void const *packet);
-    virtual void vsend(bool response, size_t cnt, iovec const *vecs);
+    virtual void vsend(bool response, size_t cnt, iovec const *vecs, SendClass cls);
+    virtual void vsend_nocopy(bool response, size_t cnt, iovec const *vecs,
+        boost::shared_ptr<void const> const &hold, SendClass cls);
     virtual void lock_address(double timeout);
     virtual void unlock_address();
     virtual bool is_locked();
     virtual bool check_clear_overflow();
     virtual void check_clear_loss(int &, int &);
+    virtual void check_clear_loss(std::vector<PeerStats> &);
+    virtual void set_reliable(bool reliable);
+    virtual void pool_stats(size_t &, size_t &, size_t &);
+    virtual void set_send_rate(double bytesPerSecond);
+    virtual void set_fec(unsigned dataFrags, unsigned parityFrags);
+    virtual void wait(double timeout);
+    virtual void dispatch_latency(LatencySummary &oSummary);
+    virtual bool peer_clock(double &offset, double &rtt);
+    virtual void rtt_latency(LatencySummary &oSummary);
+    virtual void set_group(sockaddr_in const &group);
+    virtual sockaddr_in remote();
+    virtual void set_remote(sockaddr_in const &addr);
 
     size_t stepCnt_;
+    size_t waitCnt_;
     std::list<std::pair<size_t, void const *>> toReceive_;
     std::list<std::pair<bool, std::vector<char>>> wereSent_;
     bool wasLocked_;
     bool wasUnlocked_;
     bool locked_;
     double timeout_;
+    bool reliable_;
+    double sendRate_;
+    unsigned fecData_;
+    unsigned fecParity_;
+    sockaddr_in group_;
+    sockaddr_in remote_;
+    std::list<SendClass> sentClasses_;
 };
 
 class Fakestatus : public IStatus {
@@ -50,9 +73,11 @@ class Fakesockets;
 class Fakesocket : public ISocket {
 public:
     virtual size_t peek(void *buf, size_t maxSize);
+    virtual size_t peek_spans(iovec oSpans[2]);
     virtual void recvd(size_t maxSize);
     virtual size_t send(void const *buf, size_t size);
     virtual bool step();
+    virtual void set_max_buffer(size_t size);
     ~Fakesocket();
 
     sockaddr_in addr_;
@@ -94,5 +119,30 @@ public:
     double dTime_;
 };
 
+//  Fakeusb answers each packet the way the OnyxWalker board would: the 
+//  sequence number, then a (zero filled) response for each read or 
+//  status request in it.
+class Fakeusb : public IUSBLink {
+public:
+    Fakeusb();
+    virtual void raw_send(void const *data, unsigned char sz);
+    virtual unsigned char const *begin_receive(size_t &oSize);
+    virtual void end_receive(size_t sz);
+    virtual void step();
+    virtual size_t queue_depth();
+    virtual size_t in_flight();
+
+    std::list<std::vector<unsigned char>> wereSent_;
+    std::list<std::vector<unsigned char>> toReceive_;
+    size_t inFlight_;
+    size_t bytesSent_;
+    //  counted by opcode >> 4
+    size_t opsSent_[16];
+
+private:
+    void respond(std::vector<unsigned char> &resp, unsigned char code,
+        unsigned char sz, unsigned char const *data);
+};
+
 #endif  //  fakes_h
 
@@ -3,8 +3,41 @@
 
 #include <stdlib.h>
 #include <sys/uio.h>
+#include <netinet/in.h>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 
+struct LatencySummary;
+
+//  Counters for one remote peer, since the last check_clear_loss().
+struct PeerStats {
+    sockaddr_in addr_;
+    int lost_;          //  fragments given up on
+    int received_;      //  good fragments received, including resent ones
+    int nacksSent_;     //  NACKs sent asking the peer to resend
+    int nacksReceived_; //  NACKs the peer sent to us
+    int retransmits_;   //  fragments resent to the peer because of NACKs
+    size_t goodput_;    //  bytes of complete messages received
+    int dropped_;       //  bulk messages dropped from the send queue
+    int recovered_;     //  fragments rebuilt from FEC parity instead of lost
+    //  what the peer reported (in FEEDBACK) of what it got from us 
+    //  directly and through the group
+    int peerReceived_;
+    int peerLost_;
+    int peerRecovered_;
+};
+
+//  Each peer's send queue has a lane per class. step() sends from them 
+//  in strict priority order, control first, at the pace set by 
+//  set_send_rate(). Only the bulk lane is bounded; when it gets too long, 
+//  its oldest messages are dropped to make room.
+enum SendClass {
+    SendControl,
+    SendTelemetry,
+    SendBulk,
+    NUM_SEND_CLASSES
+};
+
 class INetwork {
 public:
     virtual void step() = 0;
@@ -13,6 +46,7 @@ public:
     //  from. If address is locked, only messages from the locked address 
     //  are paid attention to.
     virtual bool receive(size_t &size, void const *&packet) = 0;
+    //  broadcast() and respond() send as SendControl.
     //  broadcast() sends to the locked address. If not locked, will broadcast, 
     //  if the network was created with "scan()" rather than "listen()." It is 
     //  an error to broadcast() without a locked address if network was created 
@@ -22,7 +56,13 @@ public:
     virtual void respond(size_t size, void const *packet) = 0;
     //  vsend() is more efficient if constructing a packet of many pieces.
     //  'response' is false if you want to broadcast.
-    virtual void vsend(bool response, size_t cnt, iovec const *vecs) = 0;
+    virtual void vsend(bool response, size_t cnt, iovec const *vecs, SendClass cls) = 0;
+    //  vsend_nocopy() is like vsend(), but large pieces of vecs are sent 
+    //  straight out of the caller's memory instead of being copied. 'hold' 
+    //  is kept alive until the last fragment referencing it has been sent, 
+    //  and the referenced data must not change until then.
+    virtual void vsend_nocopy(bool response, size_t cnt, iovec const *vecs,
+        boost::shared_ptr<void const> const &hold, SendClass cls) = 0;
     //  lock_address locks the send address to the peer that sent the packet 
     //  last returned by receive(), and filters out messages from others.
     //  If no messages are received within timeout time, address is automatically 
@@ -37,14 +77,63 @@ public:
     virtual bool check_clear_overflow() = 0;
     //  Have I seen receive loss?
     virtual void check_clear_loss(int &lost, int &received) = 0;
+    //  Per-peer counters. These are cleared independently of the totals above.
+    virtual void check_clear_loss(std::vector<PeerStats> &stats) = 0;
+    //  In reliable mode, the receiver of a message of more than one fragment 
+    //  NACKs fragments that go missing, and the sender keeps a window of 
+    //  recently sent fragments to resend from. Single-fragment messages 
+    //  (like C2R_SetInput) are never resent; a late copy is worse than none.
+    //  Both ends should be set the same way.
+    virtual void set_reliable(bool reliable) = 0;
+    //  How many fragment buffers are out, the most ever out, and how 
+    //  many times the pool had to go to the heap.
+    virtual void pool_stats(size_t &inuse, size_t &highwater, size_t &heapallocs) = 0;
+    //  Pace what's sent to each peer to this many bytes per second, with 
+    //  bursts of up to a few milliseconds' worth. Control traffic goes out 
+    //  regardless, but counts against the rate. 0 means no pacing.
+    virtual void set_send_rate(double bytesPerSecond) = 0;
+    //  Follow each group of dataFrags fragments of a message with 
+    //  parityFrags XOR parity fragments, each covering every parityFrags'th 
+    //  fragment of the group. The receiver rebuilds a fragment missing from 
+    //  such a stripe without waiting for a resend. Only for peers that take 
+    //  it, and messages of more than one fragment; 0, 0 turns it off.
+    virtual void set_fec(unsigned dataFrags, unsigned parityFrags) = 0;
+    //  wait() blocks until there may be something to receive(), or 
+    //  timeout seconds have passed. Use it instead of sleeping.
+    virtual void wait(double timeout) = 0;
+    //  Latency from reading the last fragment of a message off the socket 
+    //  to receive() handing it out, since the previous call.
+    virtual void dispatch_latency(LatencySummary &oSummary) = 0;
+    //  The peer last received from's clock, as pings estimate it: offset 
+    //  is its clock minus mine, good to about half of rtt (the smoothed 
+    //  round trip time, in seconds). False until a ping has come back.
+    virtual bool peer_clock(double &offset, double &rtt) = 0;
+    //  Ping round trip times to all peers, since the previous call.
+    virtual void rtt_latency(LatencySummary &oSummary) = 0;
+    //  Send bulk responses once to this multicast group (port 0 means 
+    //  mine), instead of to the peer, so any number of subscribers can 
+    //  watch. Only peers that join_group() get them; they report back 
+    //  what they got every second, in check_clear_loss(). An address of 
+    //  0 turns it off.
+    virtual void set_group(sockaddr_in const &group) = 0;
+    //  The peer that sent what receive() last returned, which is where 
+    //  responses go. set_remote() aims responses at another peer, such 
+    //  as the sender of a message that was set aside for later.
+    virtual sockaddr_in remote() = 0;
+    virtual void set_remote(sockaddr_in const &addr) = 0;
+    virtual ~INetwork() {}
 };
 
 class ITime;
 class IStatus;
 class ISockets;
 
-INetwork *listen(ISockets *socks, ITime *time, IStatus *status);
-INetwork *scan(ISockets *socks, ITime *time, IStatus *status);
+//  A threaded network does its socket I/O on a thread of its own, which 
+//  sleeps in epoll until there's something to do, and hands complete 
+//  messages to receive() through a lock-free queue. Everything else 
+//  (sending, locking, stats) is still called from the one user thread.
+INetwork *listen(ISockets *socks, ITime *time, IStatus *status, bool threaded = false);
+INetwork *scan(ISockets *socks, ITime *time, IStatus *status, bool threaded = false);
 
 //  IPacketizer sits on top of INetwork and provides sub-chunking of network's payload
 class IPacketizer {
@@ -54,31 +143,88 @@ public:
     virtual void broadcast(unsigned char code, size_t size, void const *data) = 0;
     virtual void respond(unsigned char code, size_t size, void const *data) = 0;
     virtual void vrespond(unsigned char code, size_t cnt, iovec const *vecs) = 0;
+    //  see INetwork::vsend_nocopy()
+    virtual void vrespond_nocopy(unsigned char code, size_t cnt, iovec const *vecs,
+        boost::shared_ptr<void const> const &hold) = 0;
+    //  Messages with the given code are sent as cls (default SendControl).
+    //  Small messages sent together go out as the most urgent among them.
+    virtual void set_send_class(unsigned char code, SendClass cls) = 0;
+    //  Messages with the given code carry state, where only the newest 
+    //  value matters. receive() hands out just the last one that arrived, 
+    //  after the other messages, once the network has no more; and of 
+    //  those broadcast() or responded between step()s, only the last goes 
+    //  out. vrespond_nocopy() is not affected.
+    virtual void set_state_channel(unsigned char code) = 0;
+    //  State channel values replaced by newer ones before they were 
+    //  received or sent, since the last call.
+    virtual void check_clear_drops(unsigned &received, unsigned &sent) = 0;
 };
 
 IPacketizer *packetize(INetwork *net, IStatus *status);
 
 struct sockaddr_in;
 
+//  A stream connection. send() queues what fits, and step() moves data
+//  both ways without blocking. Received data stays buffered until recvd().
 class ISocket {
 public:
     virtual size_t peek(void *buf, size_t maxSize) = 0;
+    //  Like peek(), but points at the buffered data where it is, in up 
+    //  to two spans; returns how many.
+    virtual size_t peek_spans(iovec oSpans[2]) = 0;
     virtual void recvd(size_t maxSize) = 0;
     virtual size_t send(void const *buf, size_t size) = 0;
     virtual bool step() = 0;
+    //  Buffer at most this many bytes each way (the default is 4 MB).
+    virtual void set_max_buffer(size_t size) = 0;
     virtual ~ISocket() {}
 };
 
+//  One datagram in a recv_many() / send_many() batch.
+//  buf_/size_ are the buffer and its capacity (receive) or the 
+//  payload (send). result_ is what recvfrom()/sendto() would return.
+//  When sending, iov_/iovcnt_ can gather the payload instead of buf_;
+//  size_ is then the total length.
+struct datagram {
+    void *buf_;
+    size_t size_;
+    int result_;
+    sockaddr_in addr_;
+    iovec const *iov_;
+    size_t iovcnt_;
+};
+
 class ISockets {
 public:
     virtual int recvfrom(void *buf, size_t sz, sockaddr_in &addr) = 0;
     virtual int sendto(void const *buf, size_t sz, sockaddr_in const &addr) = 0;
     virtual boost::shared_ptr<ISocket> connect(sockaddr_in const &addr) = 0;
+    //  sendmsg() sends one datagram gathered from cnt pieces. The default 
+    //  implementation copies them together and calls sendto().
+    virtual int sendmsg(iovec const *vecs, size_t cnt, sockaddr_in const &addr);
+    //  recv_many() receives up to cnt datagrams, and returns how many 
+    //  it got, or -1 (with errno) if none were available.
+    //  send_many() sends up to cnt datagrams in order, and returns how 
+    //  many went out, or -1 (with errno) if not even the first one did.
+    //  It may return less than cnt without an error; call again for the 
+    //  rest. The default implementations loop over recvfrom()/sendto().
+    virtual int recv_many(datagram *dgs, int cnt);
+    virtual int send_many(datagram *dgs, int cnt);
+    //  The descriptor that turns readable when datagrams arrive, or -1.
+    virtual int fd() { return -1; }
+    //  Also receive what's sent to a multicast group. False if that 
+    //  can't be done.
+    virtual bool join_group(sockaddr_in const &group) { return false; }
     virtual ~ISockets() {}
 };
 
-ISockets *mksocks(unsigned short port, IStatus *status);
+//  When batched is true, recv_many()/send_many() use recvmmsg()/sendmmsg() 
+//  and move a whole train of fragments in one system call.
+ISockets *mksocks(unsigned short port, IStatus *status, bool batched = true);
 std::string ipaddr(sockaddr_in const &sin);
+//  A multicast group address (with port 0) from x.x.x.x; throws if 
+//  it isn't one.
+sockaddr_in group_address(std::string const &str);
 
 #endif  //  network_h
 
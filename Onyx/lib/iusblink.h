@@ -0,0 +1,22 @@
+#if !defined(iusblink_h)
+#define iusblink_h
+
+#include <stddef.h>
+
+//  IUSBLink is what ServoSet needs from the link to the OnyxWalker 
+//  board: one packet (up to 64 bytes, first byte a sequence number) 
+//  out, and one packet in, at a time.
+class IUSBLink {
+public:
+    virtual void raw_send(void const *data, unsigned char sz) = 0;
+    //  returns 0 when there's nothing to receive
+    virtual unsigned char const *begin_receive(size_t &oSize) = 0;
+    virtual void end_receive(size_t sz) = 0;
+    virtual void step() = 0;
+    virtual size_t queue_depth() = 0;
+    //  how many packets may usefully be outstanding
+    virtual size_t in_flight() = 0;
+    virtual ~IUSBLink() {}
+};
+
+#endif  //  iusblink_h
@@ -12,6 +12,13 @@ enum LogKey {
     LogKeyUSBIn = 4,
     LogKeyTemperature = 5,
     LogKeyCurrent = 6,
+    LogKeyUSBOutLatency = 7,
+    LogKeyUSBInLatency = 8,
+    LogKeyUSBSubmitLatency = 9,
+    //  every USB packet, for replay: read_clock() as a double, then 
+    //  the packet
+    LogKeyUSBOutTimed = 10,
+    LogKeyUSBInTimed = 11,
     NumLogKeys
 };
 
@@ -2,6 +2,8 @@
 #include "istatus.h"
 #include "itime.h"
 #include "util.h"
+#include "PacketRing.h"
+#include "Histogram.h"
 
 #include <unordered_map>
 #include <list>
@@ -10,7 +12,17 @@
 #include <string>
 #include <stdexcept>
 #include <boost/shared_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/bind.hpp>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -21,23 +33,127 @@ enum {
     //  This is almost pessimal on old Ethernet with ~1480 bytes UDP payload.
     //  This is almost optimal on WiFi with ~2200 bytes UDP payload.
     //  This is suboptimal but not bad on new Ethernet with ~9k bytes UDP payload.
-    MAX_FRAGMENT_SIZE = 2048
+    MAX_FRAGMENT_SIZE = 2048,
+    //  2 MB worth of fragments, which matches the socket receive buffer,
+    //  and holds several queued 1080p frames on the send side.
+    FRAGMENT_POOL_SIZE = 1024,
+    //  Reassembled messages are bigger than a fragment. Keep a few of
+    //  those buffers around, rounded up to LARGE_FRAGMENT_ROUND bytes.
+    LARGE_FRAGMENT_CACHE = 8,
+    LARGE_FRAGMENT_ROUND = 65536,
+    //  How many fragments to hand to the socket per recv_many()/send_many().
+    RECV_BATCH = 32,
+    SEND_BATCH = 64,
+    //  vsend_nocopy() copies pieces smaller than this into the fragment 
+    //  rather than pointing at them; it's cheaper than another iovec.
+    NOCOPY_MIN_SIZE = 256,
+    //  header, up to 6 referenced or copied pieces, trailer
+    MAX_FRAGMENT_IOVECS = 8,
+    //  A fragment count of CONTROL_FRAGMENT marks a protocol control
+    //  fragment, and the segment index is then the control type. No
+    //  message has zero fragments, so peers that predate control
+    //  fragments throw them away as out of range.
+    CONTROL_FRAGMENT = 0,
+    //  Otherwise, this bit in the fragment count says the trailer is a 
+    //  CRC32C rather than an FNV hash. It's only used towards peers that 
+    //  have said they understand it; control fragments always use FNV.
+    CRC_FRAGMENT_FLAG = 0x8000,
+    //  And this bit says the message carries forward error correction. 
+    //  Its data fragments carry FEC_FRAGMENT_PAYLOAD bytes, and each group 
+    //  of them is followed by XOR parity fragments, numbered on from the 
+    //  fragment count (see enqueue()). Also only for peers that said so.
+    FEC_FRAGMENT_FLAG = 0x4000,
+    //  what's left of the count is the number of data fragments
+    FRAGMENT_COUNT_FLAGS = CRC_FRAGMENT_FLAG | FEC_FRAGMENT_FLAG,
+    //  NACK payload is a list of (seq, cnt, bitmap of missing segments).
+    CONTROL_NACK = 1,
+    //  CAPS payload is a byte of CAPS_ flags for what the sender understands.
+    //  It goes to each new peer, and then every second to the peers that 
+    //  sent one back.
+    CONTROL_CAPS = 2,
+    CAPS_CRC32C = 0x01,
+    CAPS_FEC = 0x02,
+    CAPS_TIME = 0x04,
+    //  PING payload is the sender's clock. PONG payload is that, then 
+    //  the responder's clock when the PING came in and when the PONG went 
+    //  out. Peers that take them are pinged every ping_interval.
+    CONTROL_PING = 3,
+    CONTROL_PONG = 4,
+    //  Subscribers to a group send its source the fragments they got, 
+    //  lost and recovered from it, as three 32 bit counts, every second.
+    //  The source takes them even when locked to another peer.
+    CONTROL_FEEDBACK = 5,
+    CAPS_GROUP = 0x08,
+    //  Estimate a peer's clock from the best of this many round trips.
+    CLOCK_SAMPLES = 8,
+    //  set_fec() limits
+    MAX_FEC_DATA = 64,
+    MAX_FEC_PARITY = 8,
+    //  Fragments of reliable messages the sender keeps around for resend, 
+    //  at most (see retransmit_age).
+    RETRANSMIT_WINDOW = 256,
+    //  NACK an incomplete message at most this many times.
+    MAX_NACKS = 4,
+    //  Drop the oldest queued bulk messages to a peer to keep its bulk 
+    //  lane within this many fragments (a few 1080p frames.)
+    BULK_QUEUE_FRAGMENTS = 384,
+    //  The pacer allows bursts of at least this many fragments.
+    PACE_MIN_BURST = 8,
+    //  Complete messages the I/O thread of a threaded network can have 
+    //  waiting for receive(). Power of two.
+    DELIVER_RING = 256,
+    //  Reassemble up to this many messages per peer at once, in slots 
+    //  picked by sequence number. A completed slot remembers its sequence 
+    //  number until reused, to drop resent duplicates. Power of two.
+    REASSEMBLY_SLOTS = 64,
+    //  Every fragment but the last of a message carries exactly this much.
+    MAX_FRAGMENT_PAYLOAD = MAX_FRAGMENT_SIZE - 10,
+    //  A parity fragment starts with the group size, the number of parity 
+    //  fragments per group, and the size of the message's last data 
+    //  fragment (two bytes), and the parity takes the rest.
+    FEC_HEADER = 4,
+    FEC_FRAGMENT_PAYLOAD = MAX_FRAGMENT_PAYLOAD - FEC_HEADER
 };
 
 //  When a receiver or packet doesn't have activity for 
 //  this amount of time, time it out.
 static const double packet_timeout = 2.5;
+//  When an incomplete message hasn't seen a fragment (or its last NACK 
+//  hasn't been answered) for this long, NACK what's missing.
+static const double nack_delay = 0.03;
+//  A sent fragment leaves the retransmit window after this long, which 
+//  gives back its pool buffer and the Image a vsend_nocopy() fragment 
+//  points into; the camera wants its frames back within a few frame 
+//  times. That's still time for a couple of NACKs.
+static const double retransmit_age = 0.1;
+//  The pacer allows bursts of this many seconds' worth of the send rate.
+static const double pace_burst = 0.005;
+//  The I/O thread wakes up at least this often for NACKs and timeouts, 
+//  and more often while there's paced or blocked data to send.
+static const double io_idle_timeout = 0.01;
+static const double io_busy_timeout = 0.001;
+static const double ping_interval = 0.25;
 
+class fragment_pool;
+
+//  Fragments are handed out by fragment_pool and reference counted 
+//  through boost::intrusive_ptr, so the steady state of sending and 
+//  receiving doesn't touch the allocator at all.
 struct fragment {
-    explicit fragment(size_t sz = 0) {
-        //  todo: re-use buffers rather than thrashing the allocator
-        physSize_ = sz < MAX_FRAGMENT_SIZE ? MAX_FRAGMENT_SIZE : sz;
-        buf_ = new unsigned char[physSize_];
-        usedSize_ = 0;
-        offset_ = 0;
-    }
-    ~fragment() {
-        delete[] buf_;
+    fragment() :
+        buf_(0),
+        usedSize_(0),
+        offset_(0),
+        physSize_(0),
+        next_(0),
+        refs_(0),
+        queued_(false),
+        sendClass_(SendControl),
+        recvTime_(0),
+        sentTime_(0),
+        pool_(0),
+        iovcnt_(0) {
+        memset(&from_, 0, sizeof(from_));
     }
     //  received data starts at buf_ and extends to usedSize_.
     unsigned char *buf_;
@@ -47,56 +163,441 @@ struct fragment {
     size_t offset_;
     //  the actual allocated buffer extends to physSize_
     size_t physSize_;
-protected:
-    explicit fragment(fragment &frag) {
-        buf_ = frag.buf_;
-        frag.buf_ = 0;
-        usedSize_ = frag.usedSize_;
-        frag.usedSize_ = 0;
-        offset_ = frag.offset_;
-        frag.offset_ = 0;
-        physSize_ = frag.physSize_;
-        frag.physSize_ = 0;
-    }
+    //  the peer a completed message came from
+    sockaddr_in from_;
+    //  link for fragment_queue
+    fragment *next_;
+    int refs_;
+    bool queued_;
+    //  which lane of the send queue it goes in
+    SendClass sendClass_;
+    //  when a completed message's last fragment was read
+    double recvTime_;
+    //  when a fragment last went out
+    double sentTime_;
+    fragment_pool *pool_;
+    //  When iovcnt_ is not 0, the fragment to send is gathered from iov_ 
+    //  (usedSize_ bytes total), and hold_ keeps referenced data alive.
+    iovec iov_[MAX_FRAGMENT_IOVECS];
+    size_t iovcnt_;
+    boost::shared_ptr<void const> hold_;
 private:
     fragment(fragment const &);
     fragment &operator=(fragment const &);
 };
 
-struct fragment_collection {
-    fragment_collection(unsigned short seq, double time, boost::shared_ptr<fragment> const &f) :
-        seq_(seq),
-        lastTime_(time) {
-        fragments_.push_back(f);
+void intrusive_ptr_add_ref(fragment *f);
+void intrusive_ptr_release(fragment *f);
+
+typedef boost::intrusive_ptr<fragment> fragptr;
+
+//  fragment_pool carves FRAGMENT_POOL_SIZE fragments out of a single 
+//  arena up front. Only oversize (reassembled) buffers, or running out 
+//  of the arena, goes to the heap, and those are counted.
+class fragment_pool {
+public:
+    fragment_pool(size_t count) :
+        count_(count),
+        inUse_(0),
+        highWater_(0),
+        heapAllocs_(0) {
+        arena_ = new unsigned char[count * MAX_FRAGMENT_SIZE];
+        headers_ = new fragment[count];
+        free_ = 0;
+        for (size_t i = count; i > 0; --i) {
+            fragment *f = &headers_[i - 1];
+            f->buf_ = arena_ + (i - 1) * MAX_FRAGMENT_SIZE;
+            f->physSize_ = MAX_FRAGMENT_SIZE;
+            f->pool_ = this;
+            f->next_ = free_;
+            free_ = f;
+        }
+        large_.reserve(LARGE_FRAGMENT_CACHE);
+    }
+    ~fragment_pool() {
+        for (auto ptr(large_.begin()), end(large_.end()); ptr != end; ++ptr) {
+            delete[] (*ptr)->buf_;
+            delete *ptr;
+        }
+        delete[] headers_;
+        delete[] arena_;
+    }
+
+    fragptr alloc(size_t sz) {
+        fragment *f = 0;
+        if (sz <= MAX_FRAGMENT_SIZE && free_) {
+            f = free_;
+            free_ = f->next_;
+        }
+        else if (sz > MAX_FRAGMENT_SIZE) {
+            for (auto ptr(large_.begin()), end(large_.end()); ptr != end; ++ptr) {
+                if ((*ptr)->physSize_ >= sz) {
+                    f = *ptr;
+                    large_.erase(ptr);
+                    break;
+                }
+            }
+        }
+        if (!f) {
+            f = new fragment();
+            f->physSize_ = MAX_FRAGMENT_SIZE;
+            if (sz > MAX_FRAGMENT_SIZE) {
+                f->physSize_ = (sz + LARGE_FRAGMENT_ROUND - 1) & ~(size_t)(LARGE_FRAGMENT_ROUND - 1);
+            }
+            f->buf_ = new unsigned char[f->physSize_];
+            f->pool_ = this;
+            ++heapAllocs_;
+        }
+        f->next_ = 0;
+        f->usedSize_ = 0;
+        f->offset_ = 0;
+        f->queued_ = false;
+        ++inUse_;
+        if (inUse_ > highWater_) {
+            highWater_ = inUse_;
+        }
+        return fragptr(f);
+    }
+
+    void release(fragment *f) {
+        --inUse_;
+        f->hold_.reset();
+        f->iovcnt_ = 0;
+        if (f >= headers_ && f < headers_ + count_) {
+            f->next_ = free_;
+            free_ = f;
+            return;
+        }
+        if (f->physSize_ > MAX_FRAGMENT_SIZE) {
+            if (large_.size() < LARGE_FRAGMENT_CACHE) {
+                large_.push_back(f);
+                return;
+            }
+            //  evict the smallest, as it's the least likely to fit
+            auto smallest(large_.begin());
+            for (auto ptr(large_.begin()), end(large_.end()); ptr != end; ++ptr) {
+                if ((*ptr)->physSize_ < (*smallest)->physSize_) {
+                    smallest = ptr;
+                }
+            }
+            if ((*smallest)->physSize_ < f->physSize_) {
+                std::swap(f, *smallest);
+            }
+        }
+        delete[] f->buf_;
+        delete f;
+    }
+
+    size_t count_;
+    size_t inUse_;
+    size_t highWater_;
+    size_t heapAllocs_;
+private:
+    unsigned char *arena_;
+    fragment *headers_;
+    fragment *free_;
+    std::vector<fragment *> large_;
+};
+
+void intrusive_ptr_add_ref(fragment *f) {
+    ++f->refs_;
+}
+
+void intrusive_ptr_release(fragment *f) {
+    if (--f->refs_ == 0) {
+        f->pool_->release(f);
+    }
+}
+
+//  A FIFO of fragments that links through the fragments themselves, 
+//  so queueing never allocates. A fragment can be in one queue at a time.
+class fragment_queue {
+public:
+    fragment_queue() : head_(0), tail_(0), size_(0) {}
+    ~fragment_queue() {
+        clear();
+    }
+    bool empty() const {
+        return head_ == 0;
+    }
+    size_t size() const {
+        return size_;
+    }
+    fragment &front() {
+        return *head_;
+    }
+    void push_back(fragptr const &f) {
+        assert(!f->queued_);
+        intrusive_ptr_add_ref(f.get());
+        f->queued_ = true;
+        f->next_ = 0;
+        if (tail_) {
+            tail_->next_ = f.get();
+        }
+        else {
+            head_ = f.get();
+        }
+        tail_ = f.get();
+        ++size_;
+    }
+    fragptr pop_front() {
+        fragment *f = head_;
+        head_ = f->next_;
+        if (!head_) {
+            tail_ = 0;
+        }
+        f->next_ = 0;
+        f->queued_ = false;
+        --size_;
+        //  hand over the queue's reference
+        return fragptr(f, false);
+    }
+    void clear() {
+        while (head_) {
+            pop_front();
+        }
+    }
+    void swap(fragment_queue &o) {
+        std::swap(head_, o.head_);
+        std::swap(tail_, o.tail_);
+        std::swap(size_, o.size_);
+    }
+private:
+    fragment *head_;
+    fragment *tail_;
+    size_t size_;
+    fragment_queue(fragment_queue const &);
+    fragment_queue &operator=(fragment_queue const &);
+};
+
+//  One message being reassembled. Fragments are copied straight to 
+//  their final offset in msg_ as they arrive, which is possible because 
+//  all fragments but the last carry MAX_FRAGMENT_PAYLOAD bytes. bits_ 
+//  has a bit set per segment received, and received_ counts them, so 
+//  neither duplicates nor completion need a scan.
+//  For a message with FEC, parity fragments are kept in parity_ until 
+//  their stripe is either complete, or missing one fragment, which is 
+//  then rebuilt in place.
+struct reassembly {
+    reassembly() :
+        seq_(0),
+        cnt_(0),
+        received_(0),
+        stride_(MAX_FRAGMENT_PAYLOAD),
+        fecData_(0),
+        fecParity_(0),
+        lastSize_(0),
+        size_(0),
+        lastTime_(0),
+        nackTime_(0),
+        nacks_(0),
+        active_(false),
+        done_(false) {
+    }
+    bool has(unsigned short seg) const {
+        return (bits_[seg >> 6] & ((uint64_t)1 << (seg & 63))) != 0;
     }
     unsigned short seq_;
+    unsigned short cnt_;
+    unsigned short received_;
+    //  bytes per fragment but the last
+    size_t stride_;
+    //  group size and parity fragments per group, once a parity 
+    //  fragment has told
+    size_t fecData_;
+    size_t fecParity_;
+    //  size of the last fragment, according to the parity fragments
+    size_t lastSize_;
+    //  known once the last segment is in
+    size_t size_;
     double lastTime_;
-    std::vector<boost::shared_ptr<fragment>> fragments_;
+    double nackTime_;
+    int nacks_;
+    //  waiting for more fragments
+    bool active_;
+    //  seq_ was completed and delivered
+    bool done_;
+    std::vector<uint64_t> bits_;
+    fragptr msg_;
+    //  indexed by group * fecParity_ + stripe
+    std::vector<fragptr> parity_;
+};
+
+//  NTP style estimate of a peer's clock. Each ping round trip gives 
+//  the offset of the remote clock from the local one, off by at most half 
+//  the round trip time (if all of it was spent in one direction), so the 
+//  sample with the shortest round trip of the last few is the one to use.
+struct clock_estimate {
+    clock_estimate() : n_(0), next_(0), rtt_(0) {}
+    void add(double offset, double rtt) {
+        offsets_[next_] = offset;
+        rtts_[next_] = rtt;
+        next_ = (next_ + 1) % CLOCK_SAMPLES;
+        if (n_ < CLOCK_SAMPLES) {
+            ++n_;
+        }
+        rtt_ = (rtt_ == 0) ? rtt : rtt_ * 0.875 + rtt * 0.125;
+    }
+    double offset() const {
+        size_t best = 0;
+        for (size_t i = 1; i < n_; ++i) {
+            if (rtts_[i] < rtts_[best]) {
+                best = i;
+            }
+        }
+        return offsets_[best];
+    }
+    double offsets_[CLOCK_SAMPLES];
+    double rtts_[CLOCK_SAMPLES];
+    size_t n_;
+    size_t next_;
+    //  smoothed round trip time
+    double rtt_;
 };
 
 struct receive_info {
-    receive_info(sockaddr_in const &sin) : addr_(sin), lastTime_(0) {}
+    receive_info(sockaddr_in const &sin) : addr_(sin), lastTime_(0), crc_(false), fec_(false),
+        time_(false), group_(false), fbReceived_(0), fbLost_(0), fbRecovered_(0), active_(0) {}
     sockaddr_in addr_;
-    std::list<fragment_collection> fragments_;
     double lastTime_;
+    //  the peer checks CRC32C fragments
+    bool crc_;
+    //  the peer takes FEC messages
+    bool fec_;
+    //  the peer answers pings
+    bool time_;
+    //  the peer sends to a group, and wants FEEDBACK
+    bool group_;
+    //  fragments received, lost and recovered since the last FEEDBACK
+    int fbReceived_;
+    int fbLost_;
+    int fbRecovered_;
+    clock_estimate clock_;
+    //  indexed by seq & (REASSEMBLY_SLOTS - 1)
+    reassembly slots_[REASSEMBLY_SLOTS];
+    //  number of active slots
+    size_t active_;
+
+    reassembly &slot(unsigned short seq) {
+        return slots_[seq & (REASSEMBLY_SLOTS - 1)];
+    }
+    //  Give up on an active slot, and return how many segments it missed.
+    int drop(reassembly &ra) {
+        assert(ra.active_);
+        ra.active_ = false;
+        ra.msg_.reset();
+        ra.parity_.clear();
+        --active_;
+        return ra.cnt_ - ra.received_;
+    }
+};
+
+//  The fragment trailer checksum: FNV for peers that may be old, and 
+//  the much cheaper CRC32C for peers that have said they take it.
+class frag_sum {
+public:
+    frag_sum(bool crc) : crc_(crc), state_(crc ? crc32c_begin() : fnv2_begin()) {}
+    void update(void const *src, size_t sz) {
+        if (crc_) {
+            state_ = crc32c_update((uint32_t)state_, src, sz);
+        }
+        else {
+            state_ = fnv2_update(state_, src, sz);
+        }
+    }
+    uint32_t end() const {
+        return crc_ ? crc32c_end((uint32_t)state_) : fnv2_end(state_);
+    }
+    static uint32_t of(bool crc, void const *src, size_t sz) {
+        return crc ? crc32c(src, sz) : fnv2_hash(src, sz);
+    }
+private:
+    bool crc_;
+    uint64_t state_;
 };
 
 struct send_info {
-    send_info(sockaddr_in const &sin) : addr_(sin), lastTime_(0), nextSeq_(0) {}
+    send_info(sockaddr_in const &sin) :
+        addr_(sin),
+        lastTime_(0),
+        tokens_(0),
+        fillTime_(0),
+        windowPos_(0),
+        windowCount_(0) {
+        for (int i = 0; i != NUM_SEND_CLASSES; ++i) {
+            sending_[i] = -1;
+        }
+    }
+    //  whether a message has had fragments sent from lane cls; messages 
+    //  are numbered in the order they're queued, so any older one has too
+    bool started(int cls, unsigned short seq) const {
+        return sending_[cls] >= 0 && (short)(seq - (unsigned short)sending_[cls]) <= 0;
+    }
     sockaddr_in addr_;
-    std::list<boost::shared_ptr<fragment>> fragments_;
+    //  one lane per SendClass, sent in strict priority order
+    fragment_queue lanes_[NUM_SEND_CLASSES];
+    //  the seq of the newest message sent from each lane, or -1
+    int sending_[NUM_SEND_CLASSES];
     double lastTime_;
-    unsigned short nextSeq_;
+    //  the pacer's token bucket, in bytes
+    double tokens_;
+    double fillTime_;
+    //  ring of recently sent fragments of reliable messages
+    std::vector<fragptr> window_;
+    size_t windowPos_;
+    //  how many of the entries before windowPos_ are live
+    size_t windowCount_;
 };
 
-struct deliver_fragment : public fragment {
-    deliver_fragment(sockaddr_in const &from, fragment &frag) :
-        fragment(frag),
-        from_(from) {
+
+//  The I/O thread of a threaded network can't talk to the user's IStatus, 
+//  which isn't thread safe. Messages are queued here instead (under the 
+//  network's lock), and step() passes them on.
+class queued_status : public IStatus {
+public:
+    virtual void message(std::string const &str) {
+        messages_.push_back(Message(0, false, str));
     }
-    sockaddr_in from_;
+    virtual void error(std::string const &str) {
+        messages_.push_back(Message(0, true, str));
+    }
+    virtual size_t n_messages() {
+        return messages_.size();
+    }
+    virtual bool get_message(Message &oMessage) {
+        if (messages_.empty()) {
+            return false;
+        }
+        oMessage = messages_.front();
+        messages_.pop_front();
+        return true;
+    }
+private:
+    std::list<Message> messages_;
 };
 
+static void poke(int fd) {
+    uint64_t one = 1;
+    ssize_t w = ::write(fd, &one, sizeof(one));
+    (void)w;
+}
+
+static void drain(int fd) {
+    uint64_t n;
+    ssize_t r = ::read(fd, &n, sizeof(n));
+    (void)r;
+}
+
+static void wait_readable(int fd, double timeout) {
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    timespec ts;
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+    ppoll(&pfd, 1, &ts, 0);
+}
 
 std::string ipaddr(sockaddr_in const &sin) {
     unsigned char const * sa = (unsigned char const *)&sin.sin_addr;
@@ -105,6 +606,16 @@ std::string ipaddr(sockaddr_in const &sin) {
     return ss.str();
 }
 
+sockaddr_in group_address(std::string const &str) {
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    if (!inet_aton(str.c_str(), &sin.sin_addr) || !IN_MULTICAST(ntohl(sin.sin_addr.s_addr))) {
+        throw std::runtime_error("Not a multicast group address: " + str);
+    }
+    return sin;
+}
+
 namespace std {
     template<> class hash<sockaddr_in> {
     public:
@@ -128,36 +639,89 @@ public:
     virtual bool receive(size_t &size, void const *&packet);
     virtual void broadcast(size_t size, void const *packet);
     virtual void respond(size_t size, void const *packet);
-    virtual void vsend(bool response, size_t count, iovec const *vecs);
+    virtual void vsend(bool response, size_t count, iovec const *vecs, SendClass cls);
+    virtual void vsend_nocopy(bool response, size_t count, iovec const *vecs,
+        boost::shared_ptr<void const> const &hold, SendClass cls);
     virtual void lock_address(double timeout);
     virtual void unlock_address();
     virtual bool is_locked();
     virtual bool check_clear_overflow();
     virtual void check_clear_loss(int &lost, int &gotten);
+    virtual void check_clear_loss(std::vector<PeerStats> &stats);
+    virtual void set_reliable(bool reliable);
+    virtual void pool_stats(size_t &inuse, size_t &highwater, size_t &heapallocs);
+    virtual void set_send_rate(double bytesPerSecond);
+    virtual void set_fec(unsigned dataFrags, unsigned parityFrags);
+    virtual void wait(double timeout);
+    virtual void dispatch_latency(LatencySummary &oSummary);
+    virtual bool peer_clock(double &offset, double &rtt);
+    virtual void rtt_latency(LatencySummary &oSummary);
+    virtual void set_group(sockaddr_in const &group);
+    virtual sockaddr_in remote();
+    virtual void set_remote(sockaddr_in const &addr);
 
-    Network(ISockets *socks, ITime *time, IStatus *status, bool useB);
+    Network(ISockets *socks, ITime *time, IStatus *status, bool useB, bool threaded);
     ~Network();
 
 private:
+    typedef boost::unique_lock<boost::recursive_mutex> guard;
+
+    void io_step();
+    void start_thread();
+    void io_thread_fn();
+    bool publish();
+    bool sends_pending();
+    void give_back(fragment *f);
 
-    void incoming_fragment(sockaddr_in const &from, boost::shared_ptr<fragment> &frag, double atTime);
+    void incoming_fragment(sockaddr_in const &from, fragptr &frag, double atTime);
+    bool incoming_parity(sockaddr_in const &from, reassembly &ra, size_t index,
+        fragptr const &frag);
+    void recover(sockaddr_in const &from, reassembly &ra, size_t group);
     void check_senders(double now);
+    void send_to(send_info &si, double now);
     void check_receivers(double now);
     void check_packets(double now);
-    void complete_fragment(sockaddr_in const &from, boost::shared_ptr<fragment> &frag);
-    void complete_fragment(sockaddr_in const &from, fragment_collection const &fc);
-    void enqueue(sockaddr_in const &from, size_t count, iovec const *vecs);
+    void check_nacks(double now);
+    void incoming_control(sockaddr_in const &from, unsigned short type,
+        unsigned char const *data, size_t size, double atTime);
+    void incoming_nack(sockaddr_in const &from, unsigned char const *data, size_t size);
+    void resend(send_info &si, PeerStats &ps, unsigned char const *data, size_t size);
+    void incoming_feedback(sockaddr_in const &from, unsigned char const *data, size_t size);
+    void send_feedback(sockaddr_in const &to, receive_info &ri);
+    void incoming_caps(sockaddr_in const &from, unsigned char const *data, size_t size);
+    void send_caps(sockaddr_in const &to);
+    void send_pings(double now);
+    void incoming_ping(sockaddr_in const &from, unsigned char const *data, size_t size,
+        double atTime);
+    void incoming_pong(sockaddr_in const &from, unsigned char const *data, size_t size,
+        double atTime);
+    receive_info &receiver(sockaddr_in const &from);
+    bool crc_ok(sockaddr_in const &to);
+    bool fec_ok(sockaddr_in const &to);
+    void send_control(sockaddr_in const &to, unsigned short type,
+        unsigned char const *data, size_t size);
+    send_info &sender(sockaddr_in const &to);
+    PeerStats &peer_stats(sockaddr_in const &addr);
+    void complete_fragment(sockaddr_in const &from, fragptr const &frag, double atTime);
+    sockaddr_in send_address(bool response, SendClass cls);
+    void enqueue(sockaddr_in const &from, size_t count, iovec const *vecs,
+        SendClass cls, boost::shared_ptr<void const> const *hold = 0);
 
+    //  must be destroyed after everything that holds fragments
+    fragment_pool pool_;
     typedef std::unordered_map<sockaddr_in, boost::shared_ptr<receive_info>> recv_map;
     recv_map receivers_;
     ITime *time_;
     IStatus *status_;
     ISockets *socks_;
     double lastCheckTime_;
+    double lastPingTime_;
+    //  a PONG is waiting to go out
+    bool ponged_;
     //  to deliver to user
-    std::list<boost::shared_ptr<deliver_fragment>> inqueue_;
+    fragment_queue inqueue_;
     std::list<send_info> outqueue_;
-    boost::shared_ptr<deliver_fragment> curFrag_;
+    fragptr curFrag_;
     sockaddr_in remoteAddr_;
     bool locked_;
     bool broadcastOk_;
@@ -166,14 +730,64 @@ private:
     double lastLockReceiveTime_;
     int lostFrags_;
     int receivedFrags_;
+    bool reliable_;
+    double sendRate_;
+    //  parity fragments per group of data fragments; 0 for no FEC
+    unsigned fecData_;
+    unsigned fecParity_;
+    //  one sequence space for everything sent, so a peer can tell apart 
+    //  what it gets from me directly, by broadcast and through the group
+    unsigned short nextSeq_;
+    //  bulk responses go once to this multicast group, if grouped_
+    sockaddr_in group_;
+    bool grouped_;
+    std::unordered_map<sockaddr_in, PeerStats> peerStats_;
+    //  the address locked to, as seen by the I/O side
+    sockaddr_in lockAddr_;
+    LatencyHistogram dispatchLatency_;
+    HistogramCounts dispatchPrev_;
+    LatencyHistogram rttLatency_;
+    HistogramCounts rttPrev_;
+
+    //  Everything above belongs to whoever holds guard_. The user thread 
+    //  takes it in each call; the I/O thread, around each io_step().
+    boost::recursive_mutex guard_;
+    bool threaded_;
+    IStatus *userStatus_;
+    queued_status queuedStatus_;
+    //  something was queued to send since the last step()
+    bool kick_;
+    boost::shared_ptr<boost::thread> thread_;
+    std::atomic<bool> running_;
+    int epfd_;
+    //  eventfds to wake the I/O thread and the user thread
+    int ioWake_;
+    int userWake_;
+    //  complete messages to the user, and the user's spent ones back, 
+    //  each holding a reference
+    PacketRing<DELIVER_RING, fragment *> delivered_;
+    PacketRing<DELIVER_RING, fragment *> returned_;
+    //  the message last handed out by receive(), in threaded mode
+    fragment *held_;
 };
 
 
-Network::Network(ISockets *socks, ITime *time, IStatus *status, bool canB) {
+Network::Network(ISockets *socks, ITime *time, IStatus *status, bool canB, bool threaded) :
+    pool_(FRAGMENT_POOL_SIZE),
+    threaded_(threaded),
+    userStatus_(status),
+    kick_(false),
+    running_(false),
+    epfd_(-1),
+    ioWake_(-1),
+    userWake_(-1),
+    held_(0) {
     socks_ = socks;
     time_ = time;
-    status_ = status;
+    status_ = threaded ? &queuedStatus_ : status;
     lastCheckTime_ = 0;
+    lastPingTime_ = 0;
+    ponged_ = false;
     memset(&remoteAddr_, 0, sizeof(remoteAddr_));
     locked_ = false;
     broadcastOk_ = canB;
@@ -182,75 +796,380 @@ Network::Network(ISockets *socks, ITime *time, IStatus *status, bool canB) {
     lastLockReceiveTime_ = 0;
     lostFrags_ = 0;
     receivedFrags_ = 0;
+    reliable_ = false;
+    sendRate_ = 0;
+    fecData_ = 0;
+    fecParity_ = 0;
+    nextSeq_ = 0;
+    memset(&group_, 0, sizeof(group_));
+    grouped_ = false;
+    memset(&lockAddr_, 0, sizeof(lockAddr_));
 
     status->message("network opened OK");
+    if (threaded) {
+        start_thread();
+    }
 }
 
 Network::~Network() {
+    if (!!thread_) {
+        running_ = false;
+        poke(ioWake_);
+        thread_->join();
+    }
+    if (held_) {
+        intrusive_ptr_release(held_);
+    }
+    while (fragment **f = delivered_.begin_read()) {
+        intrusive_ptr_release(*f);
+        delivered_.end_read();
+    }
+    while (fragment **f = returned_.begin_read()) {
+        intrusive_ptr_release(*f);
+        returned_.end_read();
+    }
+    if (epfd_ >= 0) {
+        ::close(epfd_);
+    }
+    if (ioWake_ >= 0) {
+        ::close(ioWake_);
+    }
+    if (userWake_ >= 0) {
+        ::close(userWake_);
+    }
 }
 
-void Network::step() {
-    double now = time_->now();
+void Network::start_thread() {
+    int fd = socks_->fd();
+    if (fd < 0) {
+        throw std::runtime_error("A threaded network needs sockets with a descriptor.");
+    }
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    ioWake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    userWake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ < 0 || ioWake_ < 0 || userWake_ < 0) {
+        throw std::runtime_error("Could not set up the network I/O thread: " +
+            std::string(strerror(errno)));
+    }
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        throw std::runtime_error("Could not watch the network socket: " +
+            std::string(strerror(errno)));
+    }
+    ev.data.fd = ioWake_;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, ioWake_, &ev) < 0) {
+        throw std::runtime_error("Could not watch the network eventfd: " +
+            std::string(strerror(errno)));
+    }
+    running_ = true;
+    thread_ = boost::shared_ptr<boost::thread>(new boost::thread(
+        boost::bind(&Network::io_thread_fn, this)));
+}
+
+void Network::io_thread_fn() {
+    bool busy = false;
+    while (running_) {
+        epoll_event evs[4];
+        int n = epoll_wait(epfd_, evs, 4,
+            (int)((busy ? io_busy_timeout : io_idle_timeout) * 1000));
+        for (int i = 0; i < n; ++i) {
+            if (evs[i].data.fd == ioWake_) {
+                drain(ioWake_);
+            }
+        }
+        bool delivered = false;
+        {
+            guard g(guard_);
+            while (fragment **f = returned_.begin_read()) {
+                intrusive_ptr_release(*f);
+                returned_.end_read();
+            }
+            io_step();
+            delivered = publish();
+            busy = sends_pending();
+        }
+        if (delivered) {
+            poke(userWake_);
+        }
+    }
+}
 
+//  Move complete messages from inqueue_ to the user, as far as there's room.
+bool Network::publish() {
+    bool any = false;
+    while (!inqueue_.empty()) {
+        fragment **slot = delivered_.begin_write();
+        if (!slot) {
+            break;
+        }
+        fragptr f(inqueue_.pop_front());
+        //  the ring holds on to it now
+        intrusive_ptr_add_ref(f.get());
+        *slot = f.get();
+        delivered_.end_write();
+        any = true;
+    }
+    return any;
+}
+
+bool Network::sends_pending() {
     for (auto ptr(outqueue_.begin()), end(outqueue_.end()); ptr != end; ++ptr) {
-        send_info &si(*ptr);
-        bool error = false;
-        std::string errmsg;
-        while (!si.fragments_.empty()) {
-            fragment &f(*si.fragments_.front());
-            int s = socks_->sendto(f.buf_ + f.offset_, f.usedSize_ - f.offset_, si.addr_);
-            if ((size_t)s != f.usedSize_ - f.offset_) {
-                error = true;
-                if (s < 0) {
-                    int eno = errno;
-                    errmsg = std::string(strerror(eno)) + std::string(": ") +
-                        boost::lexical_cast<std::string>(eno);
-                    if (eno == EBUSY || eno == EAGAIN) {
-                        overflow_ = true;
-                    }
-                }
-                else {
-                    errmsg = std::string("short write: ") +
-                        boost::lexical_cast<std::string>(s);
-                }
-                //  no use sending more to this guy
-                si.fragments_.clear();
-                break;
+        for (int i = 0; i != NUM_SEND_CLASSES; ++i) {
+            if (!(*ptr).lanes_[i].empty()) {
+                return true;
             }
-            si.fragments_.pop_front();
         }
-        if (error) {
-            status_->error("send error to " + ipaddr(si.addr_) +
-                std::string(": ") + errmsg);
+    }
+    return false;
+}
+
+void Network::give_back(fragment *f) {
+    fragment **slot = returned_.begin_write();
+    if (slot) {
+        *slot = f;
+        returned_.end_write();
+        return;
+    }
+    //  The I/O thread is behind; release it here.
+    guard g(guard_);
+    intrusive_ptr_release(f);
+}
+
+void Network::step() {
+    guard g(guard_);
+    if (!threaded_) {
+        io_step();
+        return;
+    }
+    //  pass on what the I/O thread had to say
+    Message m;
+    while (queuedStatus_.get_message(m)) {
+        if (m.isError) {
+            userStatus_->error(m.message);
+        }
+        else {
+            userStatus_->message(m.message);
+        }
+    }
+    if (kick_) {
+        kick_ = false;
+        poke(ioWake_);
+    }
+}
+
+void Network::wait(double timeout) {
+    if (threaded_) {
+        if (delivered_.size() > 0) {
+            return;
         }
+        wait_readable(userWake_, timeout);
+        drain(userWake_);
+        return;
+    }
+    {
+        guard g(guard_);
+        if (!inqueue_.empty()) {
+            return;
+        }
+    }
+    int fd = socks_->fd();
+    if (fd < 0) {
+        time_->sleep(timeout);
+        return;
+    }
+    wait_readable(fd, timeout);
+}
+
+void Network::dispatch_latency(LatencySummary &oSummary) {
+    HistogramCounts cur;
+    dispatchLatency_.collect(cur);
+    LatencyHistogram::summarize(cur, dispatchPrev_, oSummary);
+    dispatchPrev_ = cur;
+}
+
+bool Network::peer_clock(double &offset, double &rtt) {
+    guard g(guard_);
+    auto ptr(receivers_.find(remoteAddr_));
+    if (ptr == receivers_.end() || !(*ptr).second || !(*ptr).second->clock_.n_) {
+        offset = 0;
+        rtt = 0;
+        return false;
+    }
+    offset = (*ptr).second->clock_.offset();
+    rtt = (*ptr).second->clock_.rtt_;
+    return true;
+}
+
+void Network::rtt_latency(LatencySummary &oSummary) {
+    HistogramCounts cur;
+    rttLatency_.collect(cur);
+    LatencyHistogram::summarize(cur, rttPrev_, oSummary);
+    rttPrev_ = cur;
+}
+
+void Network::io_step() {
+    double now = time_->now();
+
+    for (auto ptr(outqueue_.begin()), end(outqueue_.end()); ptr != end; ++ptr) {
+        send_to(*ptr, now);
     }
 
     //  Drain the socket receive queue, but don't spin forever.
     //  The max buffer is 2048 kB as requested above (although Linux 
     //  will double that value "for book-keeping.")
-    for (int i = 0; i < 1000; ++i) {
-        sockaddr_in sin;
-        memset(&sin, 0, sizeof(sin));
-        boost::shared_ptr<fragment> frag(new fragment());
-        int r = socks_->recvfrom(frag->buf_, frag->physSize_, sin);
-        if (r < 0) {
+    fragptr frags[RECV_BATCH];
+    datagram dgs[RECV_BATCH];
+    for (int i = 0; i < 1000;) {
+        for (int j = 0; j != RECV_BATCH; ++j) {
+            if (!frags[j]) {
+                frags[j] = pool_.alloc(MAX_FRAGMENT_SIZE);
+            }
+            dgs[j].buf_ = frags[j]->buf_;
+            dgs[j].size_ = frags[j]->physSize_;
+            dgs[j].result_ = -1;
+            memset(&dgs[j].addr_, 0, sizeof(dgs[j].addr_));
+            dgs[j].iov_ = 0;
+            dgs[j].iovcnt_ = 0;
+        }
+        int r = socks_->recv_many(dgs, RECV_BATCH);
+        if (r <= 0) {
             break;
         }
-        if (r > 0) {
-            frag->usedSize_ = r;
-            incoming_fragment(sin, frag, now);
-            //  frag is now potentially gone!
+        for (int j = 0; j != r; ++j) {
+            if (dgs[j].result_ > 0) {
+                frags[j]->usedSize_ = dgs[j].result_;
+                incoming_fragment(dgs[j].addr_, frags[j], now);
+                //  frag is now potentially gone!
+                frags[j].reset();
+            }
+        }
+        i += r;
+        if (r < RECV_BATCH) {
+            break;
         }
     }
 
+    if (reliable_) {
+        check_nacks(now);
+    }
+
+    //  Don't let PONGs sit until the next step; the time they wait counts 
+    //  against the peer's round trip.
+    if (ponged_) {
+        ponged_ = false;
+        for (auto ptr(outqueue_.begin()), end(outqueue_.end()); ptr != end; ++ptr) {
+            send_to(*ptr, now);
+        }
+    }
+
+    if ((lastPingTime_ == 0) || (now - lastPingTime_ >= ping_interval)) {
+        lastPingTime_ = now;
+        send_pings(now);
+    }
+
     //  time out old receivers and old packets
     if ((lastCheckTime_ == 0) || (now - lastCheckTime_ >= 1)) {
+        lastCheckTime_ = now;
         check_receivers(now);
         check_packets(now);
         check_senders(now);
     }
 }
 
+//  Forget the oldest fragments in the retransmit window once they've 
+//  been out for retransmit_age. One that's (re)queued hasn't been.
+static void expire_window(send_info &si, double now) {
+    auto &window(si.window_);
+    while (si.windowCount_ > 0) {
+        size_t ix = (si.windowPos_ + RETRANSMIT_WINDOW - si.windowCount_) % RETRANSMIT_WINDOW;
+        fragment *f = window[ix].get();
+        if (f && (f->queued_ || now - f->sentTime_ < retransmit_age)) {
+            break;
+        }
+        window[ix].reset();
+        --si.windowCount_;
+    }
+}
+
+void Network::send_to(send_info &si, double now) {
+    expire_window(si, now);
+    double burst = 0;
+    if (sendRate_ > 0) {
+        burst = std::max(sendRate_ * pace_burst, (double)PACE_MIN_BURST * MAX_FRAGMENT_SIZE);
+        si.tokens_ = std::min(burst, si.tokens_ + (now - si.fillTime_) * sendRate_);
+    }
+    si.fillTime_ = now;
+    std::string errmsg;
+    for (int cls = 0; cls != NUM_SEND_CLASSES; ++cls) {
+        fragment_queue &lane(si.lanes_[cls]);
+        while (!lane.empty()) {
+            //  control traffic isn't held back, but still uses up tokens
+            bool paced = sendRate_ > 0 && cls != SendControl;
+            if (paced && si.tokens_ <= 0) {
+                return;
+            }
+            datagram dgs[SEND_BATCH];
+            int n = 0;
+            double budget = si.tokens_;
+            for (fragment *f(&lane.front()); f && n != SEND_BATCH; f = f->next_) {
+                dgs[n].buf_ = f->buf_ + f->offset_;
+                dgs[n].size_ = f->usedSize_ - f->offset_;
+                dgs[n].result_ = -1;
+                dgs[n].addr_ = si.addr_;
+                dgs[n].iov_ = f->iovcnt_ ? f->iov_ : 0;
+                dgs[n].iovcnt_ = f->iovcnt_;
+                ++n;
+                budget -= dgs[n - 1].size_;
+                if (paced && budget <= 0) {
+                    break;
+                }
+            }
+            int s = socks_->send_many(dgs, n);
+            int ok = 0;
+            while (ok < s && (size_t)dgs[ok].result_ == dgs[ok].size_) {
+                fragptr sent(lane.pop_front());
+                sent->sentTime_ = now;
+                unsigned short seq = sent->buf_[0] + (sent->buf_[1] << 8);
+                if (!si.started(cls, seq)) {
+                    si.sending_[cls] = seq;
+                }
+                if (sendRate_ > 0) {
+                    si.tokens_ -= dgs[ok].size_;
+                }
+                ++ok;
+            }
+            if (ok == s && s > 0) {
+                continue;
+            }
+            if (s == 0 || (s < 0 && (errno == EBUSY || errno == EAGAIN))) {
+                //  Out of socket buffer; leave it all queued for the next 
+                //  step. enqueue() keeps the bulk lane from growing forever.
+                overflow_ = true;
+                return;
+            }
+            if (s < 0) {
+                int eno = errno;
+                errmsg = std::string(strerror(eno)) + std::string(": ") +
+                    boost::lexical_cast<std::string>(eno);
+            }
+            else {
+                errmsg = std::string("short write: ") +
+                    boost::lexical_cast<std::string>(dgs[ok].result_);
+            }
+            //  no use sending more to this guy
+            for (int i = 0; i != NUM_SEND_CLASSES; ++i) {
+                si.lanes_[i].clear();
+            }
+            status_->error("send error to " + ipaddr(si.addr_) +
+                std::string(": ") + errmsg);
+            return;
+        }
+    }
+}
+
 void Network::check_receivers(double now) {
     auto ptr(receivers_.begin()), end(receivers_.end()), copy(end);
     while (ptr != end) {
@@ -260,6 +1179,19 @@ void Network::check_receivers(double now) {
             status_->message("Timing out receipt for peer " + ipaddr((*copy).first));
             receivers_.erase(copy);
         }
+        else {
+            if ((*copy).second->crc_ || (*copy).second->fec_) {
+                //  keep the peer's idea of me fresh, in case it timed me out
+                send_caps((*copy).first);
+            }
+            if ((*copy).second->group_) {
+                send_feedback((*copy).first, *(*copy).second);
+            }
+        }
+    }
+    if (grouped_) {
+        //  so subscribers know to send FEEDBACK
+        send_caps(group_);
     }
 }
 
@@ -279,42 +1211,334 @@ void Network::check_senders(double now) {
 void Network::check_packets(double now) {
     //  time out packets that have not received fragments for X seconds
     for (auto ptr(receivers_.begin()), end(receivers_.end()); ptr != end; ++ptr) {
-        auto &fcs((*ptr).second->fragments_);
-        auto x(fcs.begin()), y(fcs.end()), d(y);
-        while (x != y) {
-            d = x;
-            ++x;
-            if (now - (*d).lastTime_ > packet_timeout) {
-                status_->message("Timeout waiting for fragments from " + ipaddr((*ptr).first) +
-                    " seq " + boost::lexical_cast<std::string>((int)(*d).seq_));
-                int nmissed = 0;
-                for (auto fp((*d).fragments_.begin()), fe((*d).fragments_.end()); 
-                    fp != fe; ++fp) {
-                    if (!*fp) {
-                        ++nmissed;
-                    }
+        receive_info &ri(*(*ptr).second);
+        for (size_t i = 0; i != REASSEMBLY_SLOTS && ri.active_ > 0; ++i) {
+            reassembly &ra(ri.slots_[i]);
+            if (!ra.active_ || now - ra.lastTime_ <= packet_timeout) {
+                continue;
+            }
+            status_->message("Timeout waiting for fragments from " + ipaddr((*ptr).first) +
+                " seq " + boost::lexical_cast<std::string>((int)ra.seq_));
+            double lastTime = ra.lastTime_;
+            int nmissed = ri.drop(ra);
+            lostFrags_ += nmissed;
+            peer_stats((*ptr).first).lost_ += nmissed;
+            ri.fbLost_ += nmissed;
+            status_->message(std::string("missed ") +
+                boost::lexical_cast<std::string>(nmissed) + " of " +
+                boost::lexical_cast<std::string>(ra.cnt_) + "; now=" +
+                boost::lexical_cast<std::string>(now) + ", lastTime=" +
+                boost::lexical_cast<std::string>(lastTime) + ", packet_timeout=" +
+                boost::lexical_cast<std::string>(packet_timeout));
+        }
+    }
+}
+
+void Network::check_nacks(double now) {
+    unsigned char nack[MAX_FRAGMENT_SIZE - 10];
+    for (auto ptr(receivers_.begin()), end(receivers_.end()); ptr != end; ++ptr) {
+        size_t nsz = 0;
+        receive_info &ri(*(*ptr).second);
+        for (size_t n = 0; n != REASSEMBLY_SLOTS && ri.active_ > 0; ++n) {
+            reassembly &fc(ri.slots_[n]);
+            if (!fc.active_ || fc.nacks_ >= MAX_NACKS ||
+                now - std::max(fc.lastTime_, fc.nackTime_) < nack_delay) {
+                continue;
+            }
+            size_t cnt = fc.cnt_;
+            size_t nbytes = (cnt + 7) / 8;
+            if (nsz + 4 + nbytes > sizeof(nack)) {
+                break;
+            }
+            unsigned char *out = &nack[nsz];
+            out[0] = fc.seq_ & 0xff;
+            out[1] = (fc.seq_ >> 8) & 0xff;
+            out[2] = cnt & 0xff;
+            out[3] = (cnt >> 8) & 0xff;
+            memset(out + 4, 0, nbytes);
+            for (size_t i = 0; i != cnt; ++i) {
+                if (!fc.has(i)) {
+                    out[4 + (i >> 3)] |= (1 << (i & 7));
                 }
-                lostFrags_ += nmissed;
-                status_->message(std::string("missed ") +
-                    boost::lexical_cast<std::string>(nmissed) + " of " +
-                    boost::lexical_cast<std::string>((*d).fragments_.size()) + "; now=" +
-                    boost::lexical_cast<std::string>(now) + ", lastTime=" +
-                    boost::lexical_cast<std::string>((*d).lastTime_) + ", packet_timeout=" +
-                    boost::lexical_cast<std::string>(packet_timeout));
-                fcs.erase(d);
             }
+            nsz += 4 + nbytes;
+            fc.nackTime_ = now;
+            fc.nacks_ += 1;
+        }
+        if (nsz > 0) {
+            send_control((*ptr).first, CONTROL_NACK, nack, nsz);
+            peer_stats((*ptr).first).nacksSent_ += 1;
         }
     }
 }
 
-void Network::incoming_fragment(sockaddr_in const &from, boost::shared_ptr<fragment> &frag, double atTime) {
+void Network::incoming_control(sockaddr_in const &from, unsigned short type,
+    unsigned char const *data, size_t size, double atTime) {
+    switch (type) {
+        case CONTROL_NACK:
+            incoming_nack(from, data, size);
+            break;
+        case CONTROL_CAPS:
+            incoming_caps(from, data, size);
+            break;
+        case CONTROL_PING:
+            incoming_ping(from, data, size, atTime);
+            break;
+        case CONTROL_PONG:
+            incoming_pong(from, data, size, atTime);
+            break;
+        case CONTROL_FEEDBACK:
+            incoming_feedback(from, data, size);
+            break;
+        default:
+            status_->message("Remote peer " + ipaddr(from) + " sent unknown control type " +
+                hexnum(type) + ".");
+            break;
+    }
+}
+
+void Network::incoming_nack(sockaddr_in const &from, unsigned char const *data, size_t size) {
+    PeerStats &ps(peer_stats(from));
+    ps.nacksReceived_ += 1;
+    //  The NACKed messages were either sent to the peer, or broadcast, 
+    //  or sent to the group. (Sending the peer only control fragments 
+    //  keeps an empty window.) Sequence numbers don't overlap between 
+    //  them, so look in the group's window as well.
+    send_info *peer = 0, *bcast = 0, *group = 0;
+    for (auto si(outqueue_.begin()), end(outqueue_.end()); si != end; ++si) {
+        if ((*si).window_.empty()) {
+            continue;
+        }
+        if ((*si).addr_ == from) {
+            peer = &*si;
+        }
+        else if (grouped_ && (*si).addr_ == group_) {
+            group = &*si;
+        }
+        else if ((*si).addr_.sin_port == 0) {
+            bcast = &*si;
+        }
+    }
+    if (!peer) {
+        peer = bcast;
+    }
+    if (peer) {
+        resend(*peer, ps, data, size);
+    }
+    if (group) {
+        resend(*group, ps, data, size);
+    }
+}
+
+void Network::resend(send_info &si, PeerStats &ps, unsigned char const *data, size_t size) {
+    auto &window(si.window_);
+    while (size >= 4) {
+        unsigned short seq = data[0] + (data[1] << 8);
+        unsigned short cnt = data[2] + (data[3] << 8);
+        size_t nbytes = (cnt + 7) / 8;
+        if (size < 4 + nbytes) {
+            break;
+        }
+        unsigned char const *bits = data + 4;
+        for (auto ptr(window.begin()), wend(window.end()); ptr != wend; ++ptr) {
+            fragment *f = (*ptr).get();
+            if (!f) {
+                continue;
+            }
+            unsigned char const *hdr = f->buf_;
+            unsigned short fseq = hdr[0] + (hdr[1] << 8);
+            unsigned short fseg = hdr[2] + (hdr[3] << 8);
+            //  the NACK has the count the receiver saw, without the flags
+            unsigned short fcnt = (hdr[4] + (hdr[5] << 8)) & ~FRAGMENT_COUNT_FLAGS;
+            if (fseq != seq || fcnt != cnt || fseg >= cnt || !(bits[fseg >> 3] & (1 << (fseg & 7)))) {
+                continue;
+            }
+            if (!f->queued_) {
+                si.lanes_[f->sendClass_].push_back(*ptr);
+                ps.retransmits_ += 1;
+            }
+        }
+        data += 4 + nbytes;
+        size -= 4 + nbytes;
+    }
+}
+
+void Network::incoming_caps(sockaddr_in const &from, unsigned char const *data, size_t size) {
+    if (size < 1) {
+        return;
+    }
+    receive_info &ri(receiver(from));
+    ri.lastTime_ = time_->now();
+    ri.crc_ = (data[0] & CAPS_CRC32C) != 0;
+    ri.fec_ = (data[0] & CAPS_FEC) != 0;
+    ri.time_ = (data[0] & CAPS_TIME) != 0;
+    ri.group_ = (data[0] & CAPS_GROUP) != 0;
+}
+
+void Network::send_caps(sockaddr_in const &to) {
+    unsigned char caps = CAPS_CRC32C | CAPS_FEC | CAPS_TIME | (grouped_ ? CAPS_GROUP : 0);
+    send_control(to, CONTROL_CAPS, &caps, 1);
+}
+
+void Network::incoming_feedback(sockaddr_in const &from, unsigned char const *data, size_t size) {
+    if (size != 12) {
+        return;
+    }
+    int counts[3];
+    for (int i = 0; i != 3; ++i) {
+        counts[i] = (int)((uint32_t)data[0] + ((uint32_t)data[1] << 8) +
+            ((uint32_t)data[2] << 16) + ((uint32_t)data[3] << 24));
+        data += 4;
+    }
+    PeerStats &ps(peer_stats(from));
+    ps.peerReceived_ += counts[0];
+    ps.peerLost_ += counts[1];
+    ps.peerRecovered_ += counts[2];
+}
+
+void Network::send_feedback(sockaddr_in const &to, receive_info &ri) {
+    int counts[3] = { ri.fbReceived_, ri.fbLost_, ri.fbRecovered_ };
+    if (!counts[0] && !counts[1] && !counts[2]) {
+        return;
+    }
+    unsigned char buf[12];
+    for (int i = 0; i != 3; ++i) {
+        buf[i * 4] = counts[i] & 0xff;
+        buf[i * 4 + 1] = (counts[i] >> 8) & 0xff;
+        buf[i * 4 + 2] = (counts[i] >> 16) & 0xff;
+        buf[i * 4 + 3] = (counts[i] >> 24) & 0xff;
+    }
+    send_control(to, CONTROL_FEEDBACK, buf, sizeof(buf));
+    ri.fbReceived_ = 0;
+    ri.fbLost_ = 0;
+    ri.fbRecovered_ = 0;
+}
+
+void Network::send_pings(double now) {
+    for (auto ptr(receivers_.begin()), end(receivers_.end()); ptr != end; ++ptr) {
+        if ((*ptr).second && (*ptr).second->time_) {
+            send_control((*ptr).first, CONTROL_PING, (unsigned char const *)&now, sizeof(now));
+        }
+    }
+}
+
+void Network::incoming_ping(sockaddr_in const &from, unsigned char const *data, size_t size,
+    double atTime) {
+    if (size != sizeof(double)) {
+        return;
+    }
+    double times[3];
+    memcpy(&times[0], data, sizeof(double));
+    times[1] = atTime;
+    times[2] = time_->now();
+    send_control(from, CONTROL_PONG, (unsigned char const *)times, sizeof(times));
+    ponged_ = true;
+}
+
+void Network::incoming_pong(sockaddr_in const &from, unsigned char const *data, size_t size,
+    double atTime) {
+    if (size != 3 * sizeof(double)) {
+        return;
+    }
+    auto ptr(receivers_.find(from));
+    if (ptr == receivers_.end() || !(*ptr).second) {
+        return;
+    }
+    double times[3];
+    memcpy(times, data, sizeof(times));
+    //  what the round trip took, less what the peer sat on it
+    double rtt = (atTime - times[0]) - (times[2] - times[1]);
+    if (rtt < 0 || atTime < times[0]) {
+        return;
+    }
+    //  remote clock minus local clock
+    double offset = ((times[1] - times[0]) + (times[2] - atTime)) * 0.5;
+    (*ptr).second->clock_.add(offset, rtt);
+    rttLatency_.record(rtt);
+}
+
+receive_info &Network::receiver(sockaddr_in const &from) {
+    auto ptr(receivers_.find(from));
+    if (ptr == receivers_.end()) {
+        //  a new IP sent a seemingly good packet
+        status_->message("New remote peer " + ipaddr(from) + ".");
+        ptr = receivers_.insert(recv_map::value_type(from,
+            boost::shared_ptr<receive_info>(new receive_info(from)))).first;
+        //  tell it what I can take
+        send_caps(from);
+    }
+    return *(*ptr).second;
+}
+
+//  Subscribers to the group have to take CRC32C and FEC.
+bool Network::crc_ok(sockaddr_in const &to) {
+    if (grouped_ && to == group_) {
+        return true;
+    }
+    auto ptr(receivers_.find(to));
+    return ptr != receivers_.end() && (*ptr).second && (*ptr).second->crc_;
+}
+
+bool Network::fec_ok(sockaddr_in const &to) {
+    if (grouped_ && to == group_) {
+        return true;
+    }
+    auto ptr(receivers_.find(to));
+    return ptr != receivers_.end() && (*ptr).second && (*ptr).second->fec_;
+}
+
+void Network::send_control(sockaddr_in const &to, unsigned short type,
+    unsigned char const *data, size_t size) {
+    assert(size <= MAX_FRAGMENT_SIZE - 10);
+    send_info &si(sender(to));
+    si.lastTime_ = time_->now();
+    fragptr frag(pool_.alloc(MAX_FRAGMENT_SIZE));
+    unsigned char *buf = frag->buf_;
+    buf[0] = 0;
+    buf[1] = 0;
+    buf[2] = type & 0xff;
+    buf[3] = (type >> 8) & 0xff;
+    buf[4] = CONTROL_FRAGMENT & 0xff;
+    buf[5] = (CONTROL_FRAGMENT >> 8) & 0xff;
+    memcpy(buf + 6, data, size);
+    uint32_t cs = fnv2_hash(buf, size + 6);
+    buf += size + 6;
+    buf[0] = cs & 0xff;
+    buf[1] = (cs >> 8) & 0xff;
+    buf[2] = (cs >> 16) & 0xff;
+    buf[3] = (cs >> 24) & 0xff;
+    frag->usedSize_ = size + 10;
+    frag->sendClass_ = SendControl;
+    si.lanes_[SendControl].push_back(frag);
+}
+
+PeerStats &Network::peer_stats(sockaddr_in const &addr) {
+    auto ptr(peerStats_.find(addr));
+    if (ptr == peerStats_.end()) {
+        PeerStats ps;
+        memset(&ps, 0, sizeof(ps));
+        ps.addr_ = addr;
+        ptr = peerStats_.insert(std::pair<sockaddr_in, PeerStats>(addr, ps)).first;
+    }
+    return (*ptr).second;
+}
+
+void Network::incoming_fragment(sockaddr_in const &from, fragptr &frag, double atTime) {
 
     if (locked_) {
-        if (from != remoteAddr_) {
-            //  ignore packets from non-locked sources
-            return;
+        if (from != lockAddr_) {
+            //  ignore packets from non-locked sources, except for 
+            //  subscribers' FEEDBACK
+            unsigned char const *hdr = frag->buf_ + frag->offset_;
+            if (frag->usedSize_ - frag->offset_ < 10 ||
+                hdr[2] + (hdr[3] << 8) != CONTROL_FEEDBACK ||
+                hdr[4] + (hdr[5] << 8) != CONTROL_FRAGMENT) {
+                return;
+            }
+        }
+        else {
+            lastLockReceiveTime_ = atTime;
         }
-        lastLockReceiveTime_ = atTime;
     }
 
     if (frag->usedSize_ - frag->offset_ < 10) {
@@ -328,7 +1552,16 @@ void Network::incoming_fragment(sockaddr_in const &from, boost::shared_ptr<fragm
     unsigned short seq = buf[0] + (buf[1] << 8);
     unsigned short seg = buf[2] + (buf[3] << 8);
     unsigned short cnt = buf[4] + (buf[5] << 8);
-    if (seg >= cnt) {
+    bool control = cnt == CONTROL_FRAGMENT;
+    bool crc = false;
+    bool fec = false;
+    if (!control) {
+        crc = (cnt & CRC_FRAGMENT_FLAG) != 0;
+        fec = (cnt & FEC_FRAGMENT_FLAG) != 0;
+        cnt &= ~FRAGMENT_COUNT_FLAGS;
+    }
+    //  there's never more parity than data
+    if (!control && seg >= (fec ? 2 * cnt : cnt)) {
         status_->message("Remote peer " + ipaddr(from) + " sent fragment index " + hexnum(seg)
             + " out of range " + hexnum(cnt) + ".");
         ++lostFrags_;
@@ -336,10 +1569,10 @@ void Network::incoming_fragment(sockaddr_in const &from, boost::shared_ptr<fragm
     }
 
     unsigned char const *bufEnd = buf + frag->usedSize_ - frag->offset_;
-    uint32_t fnv2 = fnv2_hash(frag->buf_ + frag->offset_, frag->usedSize_ - frag->offset_ - 4);
+    uint32_t sum = frag_sum::of(crc, frag->buf_ + frag->offset_, frag->usedSize_ - frag->offset_ - 4);
     uint32_t packetChecksum = (uint32_t)bufEnd[-4] + ((uint32_t)bufEnd[-3] << 8) +
         ((uint32_t)bufEnd[-2] << 16) + ((uint32_t)bufEnd[-1] << 24);
-    if (fnv2 != packetChecksum) {
+    if (sum != packetChecksum) {
         status_->message("Remote peer " + ipaddr(from) + " sent packet with bad checksum.");
         ++lostFrags_;
         return;
@@ -348,54 +1581,183 @@ void Network::incoming_fragment(sockaddr_in const &from, boost::shared_ptr<fragm
     frag->offset_ += 6;     //  header
     frag->usedSize_ -= 4;   //  checksum
 
-    auto ptr(receivers_.find(from));
-    if (ptr == receivers_.end()) {
-        //  a new IP sent a seemingly good packet
-        status_->message("New remote peer " + ipaddr(from) + ".");
-        ptr = receivers_.insert(recv_map::value_type(from,
-            boost::shared_ptr<receive_info>(new receive_info(from)))).first;
+    if (control) {
+        incoming_control(from, seg, frag->buf_ + frag->offset_, frag->usedSize_ - frag->offset_,
+            atTime);
+        return;
     }
-    (*ptr).second->lastTime_ = atTime;
+    peer_stats(from).received_ += 1;
+
+    receive_info &ri(receiver(from));
+    ri.lastTime_ = atTime;
+    ri.fbReceived_ += 1;
 
     if (cnt == 1 && seg == 0) {
         //  packets of a single fragment don't need to go through assembly
-        complete_fragment(from, frag);
+        complete_fragment(from, frag, atTime);
         return;
     }
-    receive_info &ri(*(*ptr).second);
-    auto &rfc(ri.fragments_);
-    for (auto ptr(rfc.begin()), end(rfc.end()); ptr != end; ++ptr) {
-        if ((*ptr).seq_ == seq) {
-            auto &pf((*ptr).fragments_);
-            if (pf.size() != cnt) {
-                status_->message("Remote peer " + ipaddr(from) + " sent bad fragment count.");
+    size_t payload = frag->usedSize_ - frag->offset_;
+    size_t stride = fec ? FEC_FRAGMENT_PAYLOAD : MAX_FRAGMENT_PAYLOAD;
+    bool parity = seg >= cnt;
+    if (parity ? (payload <= FEC_HEADER || payload > MAX_FRAGMENT_PAYLOAD) :
+        (seg + 1 == cnt) ? (payload > stride) : (payload != stride)) {
+        status_->message("Remote peer " + ipaddr(from) + " sent bad fragment size " +
+            boost::lexical_cast<std::string>(payload) + ".");
+        ++lostFrags_;
+        return;
+    }
+    reassembly &ra(ri.slot(seq));
+    if (ra.seq_ == seq && ra.done_) {
+        //  a resent duplicate of something I already have
+        return;
+    }
+    if (ra.seq_ != seq || !ra.active_) {
+        if (ra.active_) {
+            if ((short)(seq - ra.seq_) < 0) {
+                //  a straggler from before the message in this slot
                 return;
             }
-            (*ptr).lastTime_ = atTime;
-            pf[seg] = frag;
-            for (auto x(pf.begin()), y(pf.end()); x != y; ++x) {
-                if (!*x) {
-                    //  not yet complete
-                    return;
-                }
-            }
-            //  complete
-            complete_fragment(from, *ptr);
-            rfc.erase(ptr);
+            //  the peer has moved on REASSEMBLY_SLOTS messages since
+            int nmissed = ri.drop(ra);
+            lostFrags_ += nmissed;
+            peer_stats(from).lost_ += nmissed;
+            ri.fbLost_ += nmissed;
+        }
+        ra.seq_ = seq;
+        ra.cnt_ = cnt;
+        ra.received_ = 0;
+        ra.stride_ = stride;
+        ra.fecData_ = 0;
+        ra.fecParity_ = 0;
+        ra.lastSize_ = 0;
+        ra.size_ = 0;
+        ra.nackTime_ = 0;
+        ra.nacks_ = 0;
+        ra.active_ = true;
+        ra.done_ = false;
+        ra.bits_.assign((cnt + 63) / 64, 0);
+        ra.msg_ = pool_.alloc((size_t)cnt * stride);
+        ++ri.active_;
+    }
+    else if (ra.cnt_ != cnt || ra.stride_ != stride) {
+        status_->message("Remote peer " + ipaddr(from) + " sent bad fragment count.");
+        return;
+    }
+    ra.lastTime_ = atTime;
+    if (parity) {
+        if (!incoming_parity(from, ra, seg - cnt, frag)) {
+            return;
+        }
+    }
+    else {
+        if (ra.has(seg)) {
             return;
         }
+        ra.bits_[seg >> 6] |= (uint64_t)1 << (seg & 63);
+        memcpy(ra.msg_->buf_ + (size_t)seg * stride, frag->buf_ + frag->offset_, payload);
+        if (seg + 1 == cnt) {
+            ra.size_ = (size_t)seg * stride + payload;
+        }
+        ++ra.received_;
+        if (ra.fecData_ && ra.received_ != cnt) {
+            recover(from, ra, seg / ra.fecData_);
+        }
+    }
+    if (ra.received_ == cnt) {
+        //  complete
+        ra.msg_->usedSize_ = ra.size_;
+        complete_fragment(from, ra.msg_, atTime);
+        ri.drop(ra);
+        ra.done_ = true;
+    }
+}
+
+//  Keep a parity fragment, and use it if it's the last piece of its 
+//  stripe. Returns false for a bad one.
+bool Network::incoming_parity(sockaddr_in const &from, reassembly &ra, size_t index,
+    fragptr const &frag) {
+    unsigned char const *data = frag->buf_ + frag->offset_;
+    size_t ndata = data[0];
+    size_t nparity = data[1];
+    size_t last = data[2] + (data[3] << 8);
+    size_t ngroups = ndata ? (ra.cnt_ + ndata - 1) / ndata : 0;
+    if (ndata == 0 || nparity == 0 || nparity > ndata || last == 0 || last > ra.stride_ ||
+        index >= ngroups * nparity ||
+        (ra.fecData_ && (ra.fecData_ != ndata || ra.fecParity_ != nparity || ra.lastSize_ != last))) {
+        status_->message("Remote peer " + ipaddr(from) + " sent a bad parity fragment.");
+        ++lostFrags_;
+        return false;
+    }
+    if (!ra.fecData_) {
+        ra.fecData_ = ndata;
+        ra.fecParity_ = nparity;
+        ra.lastSize_ = last;
+        ra.parity_.resize(ngroups * nparity);
+    }
+    ra.parity_[index] = frag;
+    recover(from, ra, index / nparity);
+    return true;
+}
+
+//  Stripe j of a group is data fragments j, j + fecParity_, ... of it, 
+//  and its parity fragment is their XOR, each padded with zeros to the 
+//  stride. With one fragment missing, XOR the rest into the parity.
+void Network::recover(sockaddr_in const &from, reassembly &ra, size_t group) {
+    size_t stride = ra.stride_;
+    size_t first = group * ra.fecData_;
+    size_t end = std::min(first + ra.fecData_, (size_t)ra.cnt_);
+    unsigned char *msg = ra.msg_->buf_;
+    for (size_t j = 0; j != ra.fecParity_; ++j) {
+        fragptr &par(ra.parity_[group * ra.fecParity_ + j]);
+        if (!par) {
+            continue;
+        }
+        size_t missing = end;
+        size_t nmissing = 0;
+        for (size_t seg = first + j; seg < end; seg += ra.fecParity_) {
+            if (!ra.has(seg)) {
+                missing = seg;
+                ++nmissing;
+            }
+        }
+        if (nmissing != 1) {
+            if (nmissing == 0) {
+                par.reset();
+            }
+            continue;
+        }
+        unsigned char *dst = msg + missing * stride;
+        size_t plen = par->usedSize_ - par->offset_ - FEC_HEADER;
+        memcpy(dst, par->buf_ + par->offset_ + FEC_HEADER, plen);
+        memset(dst + plen, 0, stride - plen);
+        for (size_t seg = first + j; seg < end; seg += ra.fecParity_) {
+            if (seg != missing) {
+                //  what's past the end of a short last fragment isn't zeros
+                xor_bytes(dst, msg + seg * stride,
+                    (seg + 1 == ra.cnt_) ? ra.size_ - seg * stride : stride);
+            }
+        }
+        par.reset();
+        ra.bits_[missing >> 6] |= (uint64_t)1 << (missing & 63);
+        if (missing + 1 == ra.cnt_) {
+            ra.size_ = missing * stride + ra.lastSize_;
+        }
+        ++ra.received_;
+        peer_stats(from).recovered_ += 1;
+        receiver(from).fbRecovered_ += 1;
     }
-    rfc.push_front(fragment_collection(seq, atTime, frag));
-    rfc.front().fragments_.resize(cnt);
 }
 
 void Network::lock_address(double timeout) {
+    guard g(guard_);
     lockTimeout_ = timeout;
     if (locked_) {
         return;
     }
     status_->message("Locking connection to peer " + ipaddr(remoteAddr_) + ".");
     locked_ = true;
+    lockAddr_ = remoteAddr_;
 
     //  keep only the data about the locked address
     boost::shared_ptr<receive_info> kept = receivers_[remoteAddr_];
@@ -403,12 +1765,10 @@ void Network::lock_address(double timeout) {
     receivers_[remoteAddr_] = kept;
 
     //  keep only packets from the locked address
-    auto ptr(inqueue_.begin()), end(inqueue_.end()), copy(end);
-    while (ptr != end) {
-        copy = ptr;
-        ++ptr;
-        if ((*copy)->from_ != remoteAddr_) {
-            inqueue_.erase(copy);
+    for (size_t n = inqueue_.size(); n > 0; --n) {
+        fragptr f(inqueue_.pop_front());
+        if (f->from_ == remoteAddr_) {
+            inqueue_.push_back(f);
         }
     }
 
@@ -416,6 +1776,7 @@ void Network::lock_address(double timeout) {
 }
 
 void Network::unlock_address() {
+    guard g(guard_);
     if (!locked_) {
         return;
     }
@@ -424,65 +1785,139 @@ void Network::unlock_address() {
 }
 
 bool Network::is_locked() {
+    guard g(guard_);
     return locked_;
 }
 
 bool Network::check_clear_overflow() {
+    guard g(guard_);
     bool ret = overflow_;
     overflow_ = false;
     return ret;
 }
 
 void Network::check_clear_loss(int &lost, int &received) {
+    guard g(guard_);
     lost = lostFrags_;
     lostFrags_ = 0;
     received = receivedFrags_;
     receivedFrags_ = 0;
 }
 
-void Network::complete_fragment(sockaddr_in const &from, boost::shared_ptr<fragment> &frag) {
-    receivedFrags_++;
-    inqueue_.push_back(boost::shared_ptr<deliver_fragment>(new deliver_fragment(from, *frag)));
+void Network::check_clear_loss(std::vector<PeerStats> &stats) {
+    guard g(guard_);
+    stats.clear();
+    for (auto ptr(peerStats_.begin()), end(peerStats_.end()); ptr != end; ++ptr) {
+        stats.push_back((*ptr).second);
+    }
+    peerStats_.clear();
 }
 
-void Network::complete_fragment(sockaddr_in const &from, fragment_collection const &fc) {
-    size_t sz = 0;
-    for (auto ptr(fc.fragments_.begin()), end(fc.fragments_.end()); ptr != end; ++ptr) {
-        sz += (*ptr)->usedSize_ - (*ptr)->offset_;
-    }
-    boost::shared_ptr<fragment> frag(new fragment(sz));
-    frag->offset_ = 0;
-    frag->usedSize_ = sz;
-    sz = 0;
-    for (auto ptr(fc.fragments_.begin()), end(fc.fragments_.end()); ptr != end; ++ptr) {
-        memcpy(frag->buf_ + sz, (*ptr)->buf_ + (*ptr)->offset_, (*ptr)->usedSize_ - (*ptr)->offset_);
-        sz += (*ptr)->usedSize_ - (*ptr)->offset_;
+void Network::set_reliable(bool reliable) {
+    guard g(guard_);
+    reliable_ = reliable;
+}
+
+void Network::set_send_rate(double bytesPerSecond) {
+    guard g(guard_);
+    sendRate_ = bytesPerSecond;
+}
+
+void Network::set_fec(unsigned dataFrags, unsigned parityFrags) {
+    guard g(guard_);
+    if (dataFrags > MAX_FEC_DATA || parityFrags > MAX_FEC_PARITY || parityFrags > dataFrags ||
+        (dataFrags > 0) != (parityFrags > 0)) {
+        throw std::runtime_error("Bad FEC parameters " + boost::lexical_cast<std::string>(dataFrags) +
+            "/" + boost::lexical_cast<std::string>(parityFrags) + ".");
     }
-    complete_fragment(from, frag);
+    fecData_ = dataFrags;
+    fecParity_ = parityFrags;
+}
+
+void Network::set_group(sockaddr_in const &group) {
+    guard g(guard_);
+    group_ = group;
+    grouped_ = group.sin_addr.s_addr != 0;
+}
+
+sockaddr_in Network::remote() {
+    guard g(guard_);
+    return remoteAddr_;
+}
+
+void Network::set_remote(sockaddr_in const &addr) {
+    guard g(guard_);
+    remoteAddr_ = addr;
+}
+
+void Network::pool_stats(size_t &inuse, size_t &highwater, size_t &heapallocs) {
+    guard g(guard_);
+    inuse = pool_.inUse_;
+    highwater = pool_.highWater_;
+    heapallocs = pool_.heapAllocs_;
+}
+
+void Network::complete_fragment(sockaddr_in const &from, fragptr const &frag, double atTime) {
+    receivedFrags_++;
+    frag->recvTime_ = atTime;
+    peer_stats(from).goodput_ += frag->usedSize_ - frag->offset_;
+    frag->from_ = from;
+    inqueue_.push_back(frag);
 }
 
 bool Network::receive(size_t &size, void const *&packet) {
-    if (inqueue_.empty()) {
-        size = 0;
-        packet = 0;
-        return false;
+    size = 0;
+    packet = 0;
+    fragment *f = 0;
+    if (threaded_) {
+        //  This side of the rings is only touched by the user thread, and 
+        //  so are remoteAddr_ and locked_ outside of io_step().
+        if (held_) {
+            give_back(held_);
+            held_ = 0;
+        }
+        while (fragment **slot = delivered_.begin_read()) {
+            f = *slot;
+            delivered_.end_read();
+            if (!locked_ || f->from_ == lockAddr_) {
+                break;
+            }
+            //  from before lock_address()
+            give_back(f);
+            f = 0;
+        }
+        if (!f) {
+            return false;
+        }
+        held_ = f;
+    }
+    else {
+        guard g(guard_);
+        if (inqueue_.empty()) {
+            return false;
+        }
+        curFrag_ = inqueue_.pop_front();
+        f = curFrag_.get();
     }
-    curFrag_ = inqueue_.front();
-    remoteAddr_ = curFrag_->from_;
-    size = curFrag_->usedSize_ - curFrag_->offset_;
-    packet = curFrag_->buf_ + curFrag_->offset_;
-    inqueue_.pop_front();
+    dispatchLatency_.record(time_->now() - f->recvTime_);
+    remoteAddr_ = f->from_;
+    size = f->usedSize_ - f->offset_;
+    packet = f->buf_ + f->offset_;
     return true;
 }
 
 void Network::broadcast(size_t size, void const *packet) {
+    guard g(guard_);
     iovec iov[1];
     iov[0].iov_base = const_cast<void *>(packet);
     iov[0].iov_len = size;
-    vsend(false, 1, iov);
+    vsend(false, 1, iov, SendControl);
 }
 
-void Network::vsend(bool response, size_t count, iovec const *vecs) {
+sockaddr_in Network::send_address(bool response, SendClass cls) {
+    if (response && cls == SendBulk && grouped_) {
+        return group_;
+    }
     sockaddr_in dest = remoteAddr_;
     if (!response && !locked_) {
         if (!broadcastOk_) {
@@ -491,7 +1926,18 @@ void Network::vsend(bool response, size_t count, iovec const *vecs) {
         memset(&dest.sin_addr, 0xff, sizeof(dest.sin_addr));
         dest.sin_port = 0;
     }
-    enqueue(dest, count, vecs);
+    return dest;
+}
+
+void Network::vsend(bool response, size_t count, iovec const *vecs, SendClass cls) {
+    guard g(guard_);
+    enqueue(send_address(response, cls), count, vecs, cls);
+}
+
+void Network::vsend_nocopy(bool response, size_t count, iovec const *vecs,
+    boost::shared_ptr<void const> const &hold, SendClass cls) {
+    guard g(guard_);
+    enqueue(send_address(response, cls), count, vecs, cls, &hold);
 }
 
 static void vec_cpy(unsigned char *dst, size_t cnt, iovec &cur, iovec const *&next) {
@@ -515,39 +1961,202 @@ static void vec_cpy(unsigned char *dst, size_t cnt, iovec &cur, iovec const *&ne
     }
 }
 
-void Network::enqueue(sockaddr_in const &dest, size_t count, iovec const *vecs) {
+//  vec_ref() is vec_cpy() for vsend_nocopy(). It builds the fragment 
+//  payload as a list of pieces pointing into the caller's buffers, except 
+//  that small pieces are copied into the fragment after the header, and 
+//  so is everything once the iovec list is about to run out. The checksum 
+//  is calculated over the pieces in place and written after the copied 
+//  bytes, to go out last.
+static void vec_ref(fragment &frag, size_t cnt, iovec &cur, iovec const *&next, bool crc) {
+    unsigned char *cpy = frag.buf_ + 6;
+    frag.iov_[0].iov_base = frag.buf_;
+    frag.iov_[0].iov_len = 6;
+    size_t n = 1;
+    frag_sum sum(crc);
+    sum.update(frag.buf_, 6);
+    frag.usedSize_ = cnt + 10;
+    while (cnt > 0) {
+        while (cur.iov_len == 0) {
+            cur = *next;
+            ++next;
+        }
+        size_t toget = cnt;
+        if (toget > cur.iov_len) {
+            toget = cur.iov_len;
+        }
+        sum.update(cur.iov_base, toget);
+        iovec *last = &frag.iov_[n - 1];
+        if (toget < NOCOPY_MIN_SIZE || n >= MAX_FRAGMENT_IOVECS - 2) {
+            memcpy(cpy, cur.iov_base, toget);
+            if ((unsigned char *)last->iov_base + last->iov_len != cpy) {
+                last = &frag.iov_[n++];
+                last->iov_base = cpy;
+                last->iov_len = 0;
+            }
+            last->iov_len += toget;
+            cpy += toget;
+        }
+        else {
+            last = &frag.iov_[n++];
+            last->iov_base = cur.iov_base;
+            last->iov_len = toget;
+        }
+        cur.iov_base = (char *)cur.iov_base + toget;
+        cur.iov_len -= toget;
+        cnt -= toget;
+    }
+    uint32_t cs = sum.end();
+    cpy[0] = cs & 0xff;
+    cpy[1] = (cs >> 8) & 0xff;
+    cpy[2] = (cs >> 16) & 0xff;
+    cpy[3] = (cs >> 24) & 0xff;
+    iovec *last = &frag.iov_[n - 1];
+    if ((unsigned char *)last->iov_base + last->iov_len != cpy) {
+        last = &frag.iov_[n++];
+        last->iov_base = cpy;
+        last->iov_len = 0;
+    }
+    last->iov_len += 4;
+    frag.iovcnt_ = n;
+}
+
+//  XOR the payload of a fragment into a parity buffer, from wherever 
+//  vec_cpy() or vec_ref() put it.
+static void fec_add(unsigned char *dst, fragment const &frag, size_t payload) {
+    if (!frag.iovcnt_) {
+        xor_bytes(dst, frag.buf_ + 6, payload);
+        return;
+    }
+    size_t skip = 6;    //  header
+    for (size_t i = 0; i != frag.iovcnt_ && payload > 0; ++i) {
+        unsigned char const *src = (unsigned char const *)frag.iov_[i].iov_base;
+        size_t n = frag.iov_[i].iov_len;
+        size_t s = std::min(skip, n);
+        src += s;
+        n -= s;
+        skip -= s;
+        n = std::min(n, payload);
+        xor_bytes(dst, src, n);
+        dst += n;
+        payload -= n;
+    }
+}
+
+static void put_checksum(unsigned char *dst, uint32_t cs) {
+    dst[0] = cs & 0xff;
+    dst[1] = (cs >> 8) & 0xff;
+    dst[2] = (cs >> 16) & 0xff;
+    dst[3] = (cs >> 24) & 0xff;
+}
+
+send_info &Network::sender(sockaddr_in const &dest) {
     auto ptr(outqueue_.begin()), end(outqueue_.end());
     while (ptr != end) {
         if ((*ptr).addr_ == dest) {
-            break;
+            return *ptr;
         }
         ++ptr;
     }
-    if (ptr == end) {
-        outqueue_.push_back(send_info(dest));
-        ptr = outqueue_.end();
-        --ptr;
-    }
+    outqueue_.emplace_back(dest);
+    return outqueue_.back();
+}
+
+void Network::enqueue(sockaddr_in const &dest, size_t count, iovec const *vecs,
+    SendClass cls, boost::shared_ptr<void const> const *hold) {
+    send_info *ptr = &sender(dest);
     (*ptr).lastTime_ = time_->now();
+    kick_ = true;
     size_t size = 0;
     for (size_t iv = 0; iv != count; ++iv) {
         size += vecs[iv].iov_len;
     }
+    //  Messages of more than one fragment get FEC, if turned on and the 
+    //  peer takes it. Their data fragments are a little shorter, to make 
+    //  room for the FEC header in the parity fragments.
+    bool fec = fecData_ > 0 && size > MAX_FRAGMENT_PAYLOAD && fec_ok(dest);
+    size_t stride = fec ? FEC_FRAGMENT_PAYLOAD : MAX_FRAGMENT_PAYLOAD;
     size_t nfrag = 0;
     if (size > 0) {
-        nfrag = (size - 1) / (MAX_FRAGMENT_SIZE - 10) + 1;
+        nfrag = (size - 1) / stride + 1;
     }
-    if (nfrag > 65535) {    //  save 0xffff for special signal to use later
-        //  with 2048 frag size, that's almost 128 megabytes...
+    if (nfrag >= FEC_FRAGMENT_FLAG) {   //  the top bits are flags
+        //  with 2048 frag size, that's over 32 megabytes...
         throw std::runtime_error("Attempt to send too big a packet.");
     }
+    //  Each group of fecData_ data fragments is followed by fecParity_ 
+    //  parity fragments, or fewer when the last group is smaller.
+    size_t nparity = 0;
+    size_t lastSize = 0;
+    if (fec) {
+        lastSize = size - (nfrag - 1) * stride;
+        size_t ngroups = (nfrag + fecData_ - 1) / fecData_;
+        nparity = (ngroups - 1) * fecParity_ +
+            std::min((size_t)fecParity_, nfrag - (ngroups - 1) * fecData_);
+    }
+    fragment_queue &lane((*ptr).lanes_[cls]);
+    if (cls == SendBulk && lane.size() + nfrag + nparity > BULK_QUEUE_FRAGMENTS) {
+        //  Drop the oldest whole messages to make room for this one. A 
+        //  message that has started going out (or is being resent) stays; 
+        //  the receiver already has its first fragments, and without the 
+        //  rest it would only NACK it.
+        size_t excess = lane.size() + nfrag + nparity - BULK_QUEUE_FRAGMENTS;
+        int dropped = 0;
+        bool dropping = false;
+        unsigned short dseq = 0;
+        fragment_queue keep;
+        while (!lane.empty()) {
+            fragptr f(lane.pop_front());
+            unsigned short fseq = f->buf_[0] + (f->buf_[1] << 8);
+            if (dropping && fseq == dseq) {
+                //  the rest of a dropped message may be more than enough
+                if (excess > 0) {
+                    --excess;
+                }
+                continue;
+            }
+            dropping = false;
+            if (excess > 0 && !(*ptr).started(cls, fseq)) {
+                dropping = true;
+                dseq = fseq;
+                ++dropped;
+                --excess;
+                continue;
+            }
+            keep.push_back(f);
+        }
+        lane.swap(keep);
+        if (dropped) {
+            peer_stats(dest).dropped_ += dropped;
+            overflow_ = true;
+        }
+    }
     iovec avec = { 0, 0 };
     unsigned short seg = 0;
     unsigned short nseg = (unsigned short)nfrag;
-    unsigned short seq = (*ptr).nextSeq_;
-    (*ptr).nextSeq_++;
+    unsigned short seq = nextSeq_++;
+    bool crc = crc_ok(dest);
+    if (crc) {
+        nseg |= CRC_FRAGMENT_FLAG;
+    }
+    if (fec) {
+        nseg |= FEC_FRAGMENT_FLAG;
+    }
+    fragptr parity[MAX_FEC_PARITY];
+    size_t parityLen[MAX_FEC_PARITY];
+    size_t groupFirst = 0;
+    size_t groupEnd = 0;
     while (size > 0) {
-        boost::shared_ptr<fragment> frag(new fragment(MAX_FRAGMENT_SIZE));
+        if (fec && seg == groupEnd) {
+            //  start a group
+            groupFirst = seg;
+            groupEnd = std::min(groupFirst + fecData_, nfrag);
+            for (size_t j = 0; j != fecParity_ && groupFirst + j < groupEnd; ++j) {
+                parity[j] = pool_.alloc(MAX_FRAGMENT_SIZE);
+                memset(parity[j]->buf_ + 6 + FEC_HEADER, 0, FEC_FRAGMENT_PAYLOAD);
+                parityLen[j] = 0;
+            }
+        }
+        fragptr frag(pool_.alloc(MAX_FRAGMENT_SIZE));
         unsigned char *buf = frag->buf_;
         buf[0] = seq & 0xff;
         buf[1] = (seq >> 8) & 0xff;
@@ -556,36 +2165,79 @@ void Network::enqueue(sockaddr_in const &dest, size_t count, iovec const *vecs)
         buf[4] = nseg & 0xff;
         buf[5] = (nseg >> 8) & 0xff;
         size_t tocopy = size;
-        if (tocopy > MAX_FRAGMENT_SIZE - 10) {
-            tocopy = MAX_FRAGMENT_SIZE - 10;
+        if (tocopy > stride) {
+            tocopy = stride;
         }
-        vec_cpy(buf + 6, tocopy, avec, vecs);
         size -= tocopy;
-        uint32_t cs = fnv2_hash(buf, tocopy + 6);
-        buf += tocopy + 6;
-        buf[0] = cs & 0xff;
-        buf[1] = (cs >> 8) & 0xff;
-        buf[2] = (cs >> 16) & 0xff;
-        buf[3] = (cs >> 24) & 0xff;
-        frag->usedSize_ = tocopy + 10;
-        (*ptr).fragments_.push_back(frag);
+        if (hold) {
+            vec_ref(*frag, tocopy, avec, vecs, crc);
+            frag->hold_ = *hold;
+        }
+        else {
+            vec_cpy(buf + 6, tocopy, avec, vecs);
+            put_checksum(buf + tocopy + 6, frag_sum::of(crc, buf, tocopy + 6));
+            frag->usedSize_ = tocopy + 10;
+        }
+        frag->sendClass_ = cls;
+        lane.push_back(frag);
+        if (reliable_ && nfrag > 1) {
+            //  remember it in case the receiver NACKs it
+            auto &window((*ptr).window_);
+            if (window.empty()) {
+                window.resize(RETRANSMIT_WINDOW);
+            }
+            window[(*ptr).windowPos_] = frag;
+            (*ptr).windowPos_ = ((*ptr).windowPos_ + 1) % RETRANSMIT_WINDOW;
+            if ((*ptr).windowCount_ < RETRANSMIT_WINDOW) {
+                ++(*ptr).windowCount_;
+            }
+        }
+        if (fec) {
+            size_t j = (seg - groupFirst) % fecParity_;
+            fec_add(parity[j]->buf_ + 6 + FEC_HEADER, *frag, tocopy);
+            parityLen[j] = std::max(parityLen[j], tocopy);
+        }
         seg += 1;
+        if (fec && seg == groupEnd) {
+            //  the group is done; send its parity
+            for (size_t j = 0; j != fecParity_ && groupFirst + j < groupEnd; ++j) {
+                unsigned short pseg = (unsigned short)(nfrag + groupFirst / fecData_ * fecParity_ + j);
+                unsigned char *pbuf = parity[j]->buf_;
+                pbuf[0] = seq & 0xff;
+                pbuf[1] = (seq >> 8) & 0xff;
+                pbuf[2] = pseg & 0xff;
+                pbuf[3] = (pseg >> 8) & 0xff;
+                pbuf[4] = nseg & 0xff;
+                pbuf[5] = (nseg >> 8) & 0xff;
+                pbuf[6] = (unsigned char)fecData_;
+                pbuf[7] = (unsigned char)fecParity_;
+                pbuf[8] = lastSize & 0xff;
+                pbuf[9] = (lastSize >> 8) & 0xff;
+                size_t len = 6 + FEC_HEADER + parityLen[j];
+                put_checksum(pbuf + len, frag_sum::of(crc, pbuf, len));
+                parity[j]->usedSize_ = len + 4;
+                parity[j]->sendClass_ = cls;
+                lane.push_back(parity[j]);
+                parity[j].reset();
+            }
+        }
     }
 }
 
 void Network::respond(size_t size, void const *packet) {
+    guard g(guard_);
     iovec iov[1];
     iov[0].iov_base = const_cast<void *>(packet);
     iov[0].iov_len = size;
-    enqueue(remoteAddr_, 1, iov);
+    enqueue(remoteAddr_, 1, iov, SendControl);
 }
 
 
-INetwork *listen(ISockets *socks, ITime *itime, IStatus *istatus) {
-    return new Network(socks, itime, istatus, false);
+INetwork *listen(ISockets *socks, ITime *itime, IStatus *istatus, bool threaded) {
+    return new Network(socks, itime, istatus, false, threaded);
 }
 
-INetwork *scan(ISockets *socks, ITime *itime, IStatus *istatus) {
-    return new Network(socks, itime, istatus, true);
+INetwork *scan(ISockets *socks, ITime *itime, IStatus *istatus, bool threaded) {
+    return new Network(socks, itime, istatus, true, threaded);
 }
 
@@ -3,12 +3,61 @@
 #include "istatus.h"
 #include <string.h>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
 
 
 enum {
     MAX_PACKET_BUFFER = 8192
 };
 
+//  Latest-value-wins storage for state channel messages: a slot per 
+//  code, and the codes with a value waiting, in the order they got one.
+//  A put() over a waiting value drops that value. The buffers keep their 
+//  capacity, so this doesn't allocate once warmed up.
+struct state_slots {
+    state_slots() : next_(0), dropped_(0) {
+        memset(waiting_, 0, sizeof(waiting_));
+        memset(from_, 0, sizeof(from_));
+    }
+    void put(unsigned char code, size_t count, iovec const *vecs) {
+        if (waiting_[code]) {
+            ++dropped_;
+        }
+        else {
+            waiting_[code] = true;
+            order_.push_back(code);
+        }
+        std::vector<unsigned char> &d(data_[code]);
+        d.clear();
+        for (size_t i = 0; i != count; ++i) {
+            d.insert(d.end(), (unsigned char const *)vecs[i].iov_base,
+                (unsigned char const *)vecs[i].iov_base + vecs[i].iov_len);
+        }
+    }
+    bool take(unsigned char &code, size_t &size, void const *&data) {
+        while (next_ != order_.size()) {
+            code = order_[next_++];
+            if (waiting_[code]) {
+                waiting_[code] = false;
+                size = data_[code].size();
+                data = size ? &data_[code][0] : 0;
+                return true;
+            }
+        }
+        order_.clear();
+        next_ = 0;
+        return false;
+    }
+    std::vector<unsigned char> data_[256];
+    //  who sent each received value; responses to it go there
+    sockaddr_in from_[256];
+    bool waiting_[256];
+    std::vector<unsigned char> order_;
+    size_t next_;
+    unsigned dropped_;
+};
+
 class Packetizer : public IPacketizer {
 public:
     Packetizer(INetwork *network, IStatus *status);
@@ -17,7 +66,15 @@ public:
     virtual void broadcast(unsigned char code, size_t size, void const *data);
     virtual void respond(unsigned char code, size_t size, void const *data);
     virtual void vrespond(unsigned char code, size_t count, iovec const *vecs);
+    virtual void vrespond_nocopy(unsigned char code, size_t count, iovec const *vecs,
+        boost::shared_ptr<void const> const &hold);
+    virtual void set_send_class(unsigned char code, SendClass cls);
+    virtual void set_state_channel(unsigned char code);
+    virtual void check_clear_drops(unsigned &received, unsigned &sent);
     
+    void send_b(unsigned char code, size_t size, void const *data);
+    void send_r(unsigned char code, size_t count, iovec const *vecs);
+    void flush_states();
     void flush_bbuf();
     void flush_rbuf();
     size_t read_sz();
@@ -31,6 +88,16 @@ public:
     unsigned char *b_outPtr_;
     unsigned char r_buffer_[MAX_PACKET_BUFFER];
     unsigned char *r_outPtr_;
+    //  the most urgent class of what's in each buffer
+    SendClass b_class_;
+    SendClass r_class_;
+    SendClass classes_[256];
+    bool state_[256];
+    //  newest state received since the network last ran dry
+    state_slots inState_;
+    //  newest state broadcast or responded since the last step()
+    state_slots bState_;
+    state_slots rState_;
 };
 
 
@@ -40,59 +107,124 @@ Packetizer::Packetizer(INetwork *network, IStatus *status) :
     inPtr_(0),
     inEnd_(0),
     b_outPtr_(b_buffer_),
-    r_outPtr_(r_buffer_) {
+    r_outPtr_(r_buffer_),
+    b_class_(SendBulk),
+    r_class_(SendBulk) {
     memset(b_buffer_, 0xfc, sizeof(b_buffer_));
     memset(r_buffer_, 0xfc, sizeof(r_buffer_));
+    for (size_t i = 0; i != 256; ++i) {
+        classes_[i] = SendControl;
+        state_[i] = false;
+    }
+}
+
+void Packetizer::set_send_class(unsigned char code, SendClass cls) {
+    classes_[code] = cls;
+}
+
+void Packetizer::set_state_channel(unsigned char code) {
+    state_[code] = true;
+}
+
+void Packetizer::check_clear_drops(unsigned &received, unsigned &sent) {
+    received = inState_.dropped_;
+    sent = bState_.dropped_ + rState_.dropped_;
+    inState_.dropped_ = 0;
+    bState_.dropped_ = 0;
+    rState_.dropped_ = 0;
 }
 
 void Packetizer::step() {
+    flush_states();
     flush_bbuf();
     flush_rbuf();
     inet_->step();
 }
 
+void Packetizer::flush_states() {
+    unsigned char code;
+    size_t size;
+    void const *data;
+    while (bState_.take(code, size, data)) {
+        send_b(code, size, data);
+    }
+    while (rState_.take(code, size, data)) {
+        iovec iov;
+        iov.iov_base = const_cast<void *>(data);
+        iov.iov_len = size;
+        send_r(code, 1, &iov);
+    }
+}
+
 void Packetizer::flush_bbuf() {
     if (b_outPtr_ != b_buffer_) {
-        inet_->broadcast(b_outPtr_ - b_buffer_, b_buffer_);
+        iovec iov;
+        iov.iov_base = b_buffer_;
+        iov.iov_len = b_outPtr_ - b_buffer_;
+        inet_->vsend(false, 1, &iov, b_class_);
         b_outPtr_ = b_buffer_;
+        b_class_ = SendBulk;
     }
 }
 
 void Packetizer::flush_rbuf() {
     if (r_outPtr_ != r_buffer_) {
-        inet_->respond(r_outPtr_ - r_buffer_, r_buffer_);
+        iovec iov;
+        iov.iov_base = r_buffer_;
+        iov.iov_len = r_outPtr_ - r_buffer_;
+        inet_->vsend(true, 1, &iov, r_class_);
         r_outPtr_ = r_buffer_;
+        r_class_ = SendBulk;
     }
 }
 
+//  Messages on state channels are set aside (the newest one of each 
+//  code) rather than returned, and handed out once the network has no 
+//  more to give, after everything else, with responses going back to 
+//  whoever sent each one.
 bool Packetizer::receive(unsigned char &code, size_t &size, void const *&data) {
     code = 0;
     size = 0;
     data = 0;
-    if (inPtr_ == inEnd_) {
-read_a_packet:
-        size_t s = 0;
-        void const *d = 0;
-        if (!inet_->receive(s, d)) {
-            return false;
+    while (true) {
+        if (inPtr_ == inEnd_) {
+            size_t s = 0;
+            void const *d = 0;
+            if (!inet_->receive(s, d)) {
+                if (!inState_.take(code, size, data)) {
+                    return false;
+                }
+                //  by now, the network's last sender is someone else
+                inet_->set_remote(inState_.from_[code]);
+                return true;
+            }
+            inPtr_ = reinterpret_cast<unsigned char const *>(d);
+            inEnd_ = inPtr_ + s;
         }
-        inPtr_ = reinterpret_cast<unsigned char const *>(d);
-        inEnd_ = inPtr_ + s;
-    }
-    if (inEnd_ - inPtr_ < 2) {
-        istatus_->error("Network message with junk byte at end.");
-        goto read_a_packet;
-    }
-    code = *inPtr_;
-    ++inPtr_;
-    size = read_sz();
-    if (inEnd_ - inPtr_ < (ssize_t)size) {
-        istatus_->error("Network message truncated at end.");
-        goto read_a_packet;
+        if (inEnd_ - inPtr_ < 2) {
+            istatus_->error("Network message with junk byte at end.");
+            inPtr_ = inEnd_;
+            continue;
+        }
+        code = *inPtr_;
+        ++inPtr_;
+        size = read_sz();
+        if (inEnd_ - inPtr_ < (ssize_t)size) {
+            istatus_->error("Network message truncated at end.");
+            inPtr_ = inEnd_;
+            continue;
+        }
+        data = inPtr_;
+        inPtr_ += size;
+        if (!state_[code]) {
+            return true;
+        }
+        iovec iov;
+        iov.iov_base = const_cast<void *>(data);
+        iov.iov_len = size;
+        inState_.put(code, 1, &iov);
+        inState_.from_[code] = inet_->remote();
     }
-    data = inPtr_;
-    inPtr_ += size;
-    return true;
 }
 
 //  read a vari-length encoded unsigned integer
@@ -128,6 +260,18 @@ size_t Packetizer::write_sz(size_t size, unsigned char *buf) {
 
 
 void Packetizer::broadcast(unsigned char code, size_t size, void const *data) {
+    if (state_[code]) {
+        //  sent at step(), if nothing newer comes along first
+        iovec iov;
+        iov.iov_base = const_cast<void *>(data);
+        iov.iov_len = size;
+        bState_.put(code, 1, &iov);
+        return;
+    }
+    send_b(code, size, data);
+}
+
+void Packetizer::send_b(unsigned char code, size_t size, void const *data) {
     unsigned char hdr[10];
     hdr[0] = code;
     size_t hsz = 1 + write_sz(size, &hdr[1]);
@@ -142,13 +286,14 @@ void Packetizer::broadcast(unsigned char code, size_t size, void const *data) {
         iov[0].iov_len = hsz;
         iov[1].iov_base = const_cast<void *>(data);
         iov[1].iov_len = size;
-        inet_->vsend(false, 2, iov);
+        inet_->vsend(false, 2, iov, classes_[code]);
     }
     else {
         //  accumulate data into the outgoing buffer.
         memcpy(b_outPtr_, hdr, hsz);
         memcpy(b_outPtr_ + hsz, data, size);
         b_outPtr_ += hsz + size;
+        b_class_ = std::min(b_class_, classes_[code]);
     }
 }
 
@@ -164,6 +309,15 @@ void Packetizer::vrespond(unsigned char code, size_t count, iovec const *vecs) {
     if (count > 9) {
         throw std::runtime_error("Too many iovecs in operation");
     }
+    if (state_[code]) {
+        //  sent at step(), if nothing newer comes along first
+        rState_.put(code, count, vecs);
+        return;
+    }
+    send_r(code, count, vecs);
+}
+
+void Packetizer::send_r(unsigned char code, size_t count, iovec const *vecs) {
     iovec iov[10];
     size_t size = 0;
     for (size_t i = 0; i < count; ++i) {
@@ -181,7 +335,7 @@ void Packetizer::vrespond(unsigned char code, size_t count, iovec const *vecs) {
     }
     if (hsz + size > (size_t)(sizeof(r_buffer_) - (r_outPtr_ - r_buffer_))) {
         //  If I still cannot fit it into the buffer, send it as its own packet.
-        inet_->vsend(true, 1 + count, iov);
+        inet_->vsend(true, 1 + count, iov, classes_[code]);
     }
     else {
         //  accumulate data into the outgoing buffer.
@@ -189,7 +343,29 @@ void Packetizer::vrespond(unsigned char code, size_t count, iovec const *vecs) {
             memcpy(r_outPtr_, iov[i].iov_base, iov[i].iov_len);
             r_outPtr_ += iov[i].iov_len;
         }
+        r_class_ = std::min(r_class_, classes_[code]);
+    }
+}
+
+void Packetizer::vrespond_nocopy(unsigned char code, size_t count, iovec const *vecs,
+    boost::shared_ptr<void const> const &hold) {
+    if (count > 9) {
+        throw std::runtime_error("Too many iovecs in operation");
     }
+    iovec iov[10];
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        iov[i + 1] = vecs[i];
+        size += vecs[i].iov_len;
+    }
+    unsigned char hdr[10];
+    hdr[0] = code;
+    size_t hsz = 1 + write_sz(size, &hdr[1]);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = hsz;
+    //  keep ordering with whatever was accumulated before
+    flush_rbuf();
+    inet_->vsend_nocopy(true, 1 + count, iov, hold, classes_[code]);
 }
 
 IPacketizer *packetize(INetwork *net, IStatus *status) {
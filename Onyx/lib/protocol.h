@@ -40,7 +40,16 @@ struct P_SetInput {
 struct P_RequestVideo {
     unsigned short width;
     unsigned short height;
+    //  keep sending for this long
     unsigned short millis;
+    //  at most one frame per this many milliseconds
+    unsigned short interval;
+    //  requester's clock in milliseconds, echoed in P_VideoFrame
+    unsigned short stamp;
+    //  FEC parity fragments per group of data fragments (see 
+    //  INetwork::set_fec()), or 0 for none
+    unsigned char fecData;
+    unsigned char fecParity;
 };
 
 enum R2C {
@@ -65,6 +74,15 @@ struct P_VideoFrame {
     unsigned short serial;
     unsigned short width;
     unsigned short height;
+    //  stamp of the last P_RequestVideo, and milliseconds since it was 
+    //  received, so the requester can tell the round-trip time
+    unsigned short stamp;
+    unsigned short delay;
+    //  number of send overflows since the last frame
+    unsigned short overflows;
+    //  when the robot's camera captured the frame, in robot clock seconds 
+    //  (INetwork::peer_clock() relates that to the receiver's clock)
+    double capture;
     //  MJPEG data
 };
 
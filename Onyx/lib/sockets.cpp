@@ -1,16 +1,64 @@
 
 #include "inetwork.h"
 #include "istatus.h"
+#include "ByteRing.h"
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sstream>
+#include <vector>
 #include <stdexcept>
 
 
+int ISockets::recv_many(datagram *dgs, int cnt) {
+    int n = 0;
+    while (n < cnt) {
+        int r = recvfrom(dgs[n].buf_, dgs[n].size_, dgs[n].addr_);
+        if (r < 0) {
+            break;
+        }
+        dgs[n].result_ = r;
+        ++n;
+    }
+    return n > 0 ? n : -1;
+}
+
+int ISockets::sendmsg(iovec const *vecs, size_t cnt, sockaddr_in const &addr) {
+    std::vector<char> buf;
+    for (size_t i = 0; i != cnt; ++i) {
+        buf.insert(buf.end(), (char const *)vecs[i].iov_base,
+            (char const *)vecs[i].iov_base + vecs[i].iov_len);
+    }
+    return sendto(buf.empty() ? 0 : &buf[0], buf.size(), addr);
+}
+
+int ISockets::send_many(datagram *dgs, int cnt) {
+    int n = 0;
+    while (n < cnt) {
+        int s = dgs[n].iov_ ?
+            sendmsg(dgs[n].iov_, dgs[n].iovcnt_, dgs[n].addr_) :
+            sendto(dgs[n].buf_, dgs[n].size_, dgs[n].addr_);
+        if (s < 0) {
+            return n > 0 ? n : -1;
+        }
+        dgs[n].result_ = s;
+        ++n;
+        if ((size_t)s != dgs[n-1].size_) {
+            break;
+        }
+    }
+    return n;
+}
+
+
+//  default cap on each TCPSocket buffer, and how much room to offer 
+//  each readv()
+#define TCP_MAX_BUFFER (4 * 1024 * 1024)
+#define RECV_CHUNK (64 * 1024)
 
 class TCPSocket : public ISocket {
 public:
@@ -18,10 +66,8 @@ public:
         addr_(sin),
         status_(status),
         fd_(-1),
-        sndpos_(0),
-        sndend_(0),
-        rcvpos_(0),
-        rcvend_(0) {
+        snd_(TCP_MAX_BUFFER),
+        rcv_(TCP_MAX_BUFFER) {
         fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
         if (fd_ < 0) {
             status->error("could not open socket()");
@@ -78,90 +124,83 @@ public:
         if (fd_ == -1) {
             return 0;
         }
-        if (rcvend_ > rcvpos_) {
-            if (maxSize > rcvend_ - rcvpos_) {
-                maxSize = rcvend_ - rcvpos_;
-            }
-        }
-        else {
-            maxSize = 0;
-        }
-        if (maxSize > 0) {
-            memcpy(buf, &rcvbuf_[rcvpos_], maxSize);
+        return rcv_.peek(buf, maxSize);
+    }
+
+    virtual size_t peek_spans(iovec oSpans[2]) {
+        if (fd_ == -1) {
+            return 0;
         }
-        return maxSize;
+        return rcv_.read_spans(oSpans);
     }
 
-    //  recv just receives from the big outgoing buffer
     virtual void recvd(size_t maxSize) {
-        rcvpos_ += maxSize;
-        if (rcvpos_ > rcvend_) {
+        if (maxSize > rcv_.size()) {
             status_->error("bad call to recvd(): past end of buffer");
             throw std::runtime_error("bad recvd() call");
         }
+        rcv_.consumed(maxSize);
     }
 
-    //  send just copies into the big outgoing buffer
+    //  send just copies into the outgoing buffer
     virtual size_t send(void const *buf, size_t size) {
         if (fd_ == -1) {
             return 0;
         }
-        if (sizeof(sndbuf_) - sndend_ < size) {
-            if (sndpos_ > 0) {
-                memmove(&sndbuf_[0], &sndbuf_[sndpos_], sndend_ - sndpos_);
-                sndend_ -= sndpos_;
-                sndpos_ = 0;
-            }
-            if (sizeof(sndbuf_) - sndend_ < size) {
-                size = sizeof(sndbuf_) - sndend_;
-            }
-        }
-        if (size > 0) {
-            memmove(&sndbuf_[sndend_], buf, size);
-            sndend_ += size;
-        }
-        return size;
+        return snd_.write(buf, size);
+    }
+
+    virtual void set_max_buffer(size_t size) {
+        snd_.set_max_size(size);
+        rcv_.set_max_size(size);
     }
 
     virtual bool step() {
+        iovec spans[2];
         int err;
         if (fd_ != -1) {
-            if (sndend_ > sndpos_) {
-                err = ::send(fd_, &sndbuf_[sndpos_], sndend_ - sndpos_, 0);
+            size_t n = snd_.read_spans(spans);
+            if (n > 0) {
+                err = ::writev(fd_, spans, n);
                 if (err < 0) {
-                    status_->error("socket full timeout: " + ipaddr(addr_));
-                    ::close(fd_);
-                    fd_ = -1;
+                    if (errno != EAGAIN) {
+                        int en = errno;
+                        status_->error("socket send error: " + ipaddr(addr_) + ": " + strerror(en));
+                        ::close(fd_);
+                        fd_ = -1;
+                    }
                 }
                 else {
-                    sndpos_ += err;
+                    snd_.consumed(err);
                 }
             }
         }
         if (fd_ != -1) {
-            if (rcvend_ == sizeof(rcvbuf_)) {
-                if (rcvpos_ > 0) {
-                    memmove(&rcvbuf_[0], &rcvbuf_[rcvpos_], rcvend_ - rcvpos_);
-                    rcvend_ -= rcvpos_;
-                    rcvpos_ = 0;
+            //  keep reading while the kernel fills all we offer
+            while (true) {
+                rcv_.reserve(RECV_CHUNK);
+                size_t n = rcv_.write_spans(spans);
+                if (n == 0) {
+                    break;
                 }
-            }
-            if (rcvend_ < sizeof(rcvbuf_)) {
-                err = ::recv(fd_, &rcvbuf_[rcvend_], sizeof(rcvbuf_)-rcvend_, 0);
+                err = ::readv(fd_, spans, n);
                 if (err < 0) {
                     if (errno != EAGAIN) {
                         status_->error("socket error: " + ipaddr(addr_));
                         ::close(fd_);
                         fd_ = -1;
                     }
+                    break;
                 }
-                else if (err == 0) {
+                if (err == 0) {
                     status_->error("socket closed: " + ipaddr(addr_));
                     ::close(fd_);
                     fd_ = -1;
+                    break;
                 }
-                else {
-                    rcvend_ += err;
+                rcv_.wrote(err);
+                if ((size_t)err < spans[0].iov_len + (n > 1 ? spans[1].iov_len : 0)) {
+                    break;
                 }
             }
         }
@@ -171,12 +210,10 @@ public:
     sockaddr_in addr_;
     IStatus *status_;
     int fd_;
-    size_t sndpos_;
-    size_t sndend_;
-    char sndbuf_[1024*1024*4];
-    size_t rcvpos_;
-    size_t rcvend_;
-    char rcvbuf_[1024*1024*4];
+    //  Both grow from a few kB as needed, so a chatty line protocol 
+    //  costs little, while a bulk stream gets a deep buffer.
+    ByteRing snd_;
+    ByteRing rcv_;
 };
 
 class Sockets : public ISockets {
@@ -250,6 +287,23 @@ public:
         return fd_ >= 0;
     }
 
+    virtual int fd() {
+        return fd_;
+    }
+
+    virtual bool join_group(sockaddr_in const &group) {
+        ip_mreq mr;
+        memset(&mr, 0, sizeof(mr));
+        mr.imr_multiaddr = group.sin_addr;
+        mr.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+            int en = errno;
+            status_->error("join multicast group " + ipaddr(group) + " failed: " + strerror(en));
+            return false;
+        }
+        return true;
+    }
+
     virtual int recvfrom(void *buf, size_t sz, sockaddr_in &addr) {
         socklen_t slen = sizeof(addr);
         return ::recvfrom(fd_, buf, sz, 0, (sockaddr *)&addr, &slen);
@@ -264,14 +318,100 @@ public:
         return s;
     }
 
+    virtual int sendmsg(iovec const *vecs, size_t cnt, sockaddr_in const &addr) {
+        sockaddr_in sin(addr);
+        if (sin.sin_port == 0) {
+            sin.sin_port = htons(port_);
+        }
+        msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_name = &sin;
+        mh.msg_namelen = sizeof(sin);
+        mh.msg_iov = const_cast<iovec *>(vecs);
+        mh.msg_iovlen = cnt;
+        return ::sendmsg(fd_, &mh, 0);
+    }
+
     virtual boost::shared_ptr<ISocket> connect(sockaddr_in const &addr) {
         return boost::shared_ptr<TCPSocket>(new TCPSocket(addr, status_));
     }
 };
 
+//  BatchSockets moves up to MAX_BATCH datagrams per system call.
+//  The first one that fails ends the batch, and the kernel reports 
+//  its errno on the next call.
+class BatchSockets : public Sockets {
+public:
+    enum {
+        MAX_BATCH = 64
+    };
+
+    BatchSockets(unsigned short port, IStatus *status) :
+        Sockets(port, status) {
+        memset(msgs_, 0, sizeof(msgs_));
+    }
+
+    virtual int recv_many(datagram *dgs, int cnt) {
+        if (cnt > MAX_BATCH) {
+            cnt = MAX_BATCH;
+        }
+        for (int i = 0; i != cnt; ++i) {
+            iov_[i].iov_base = dgs[i].buf_;
+            iov_[i].iov_len = dgs[i].size_;
+            msghdr &mh(msgs_[i].msg_hdr);
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_name = &dgs[i].addr_;
+            mh.msg_namelen = sizeof(dgs[i].addr_);
+            mh.msg_iov = &iov_[i];
+            mh.msg_iovlen = 1;
+        }
+        int r = ::recvmmsg(fd_, msgs_, cnt, MSG_DONTWAIT, 0);
+        for (int i = 0; i < r; ++i) {
+            dgs[i].result_ = msgs_[i].msg_len;
+        }
+        return r;
+    }
+
+    virtual int send_many(datagram *dgs, int cnt) {
+        if (cnt > MAX_BATCH) {
+            cnt = MAX_BATCH;
+        }
+        for (int i = 0; i != cnt; ++i) {
+            addrs_[i] = dgs[i].addr_;
+            if (addrs_[i].sin_port == 0) {
+                addrs_[i].sin_port = htons(port_);
+            }
+            iov_[i].iov_base = dgs[i].buf_;
+            iov_[i].iov_len = dgs[i].size_;
+            msghdr &mh(msgs_[i].msg_hdr);
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_name = &addrs_[i];
+            mh.msg_namelen = sizeof(addrs_[i]);
+            if (dgs[i].iov_) {
+                mh.msg_iov = const_cast<iovec *>(dgs[i].iov_);
+                mh.msg_iovlen = dgs[i].iovcnt_;
+            }
+            else {
+                mh.msg_iov = &iov_[i];
+                mh.msg_iovlen = 1;
+            }
+        }
+        int s = ::sendmmsg(fd_, msgs_, cnt, MSG_DONTWAIT);
+        for (int i = 0; i < s; ++i) {
+            dgs[i].result_ = msgs_[i].msg_len;
+        }
+        return s;
+    }
+
+private:
+    mmsghdr msgs_[MAX_BATCH];
+    iovec iov_[MAX_BATCH];
+    sockaddr_in addrs_[MAX_BATCH];
+};
+
 
-ISockets *mksocks(unsigned short port, IStatus *status) {
-    Sockets *socks = new Sockets(port, status);
+ISockets *mksocks(unsigned short port, IStatus *status, bool batched) {
+    Sockets *socks = batched ? new BatchSockets(port, status) : new Sockets(port, status);
     if (!socks->ok()) {
         delete socks;
         return 0;
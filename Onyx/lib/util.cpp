@@ -1,6 +1,22 @@
 
 #include "util.h"
 #include <string.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW_X86 1
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#include <arm_acle.h>
+#define CRC32C_HW_ARM 1
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 unsigned char cksum(unsigned char const *a, size_t l) {
     unsigned char ck = 0;
@@ -41,16 +57,190 @@ double read_clock() {
 }
 
 unsigned int fnv2_hash(void const *src, size_t sz) {
-    uint64_t hash = 14695981039346656037ULL; //  will cause truncation for 32-bit ints
+    return fnv2_end(fnv2_update(fnv2_begin(), src, sz));
+}
+
+uint64_t fnv2_begin() {
+    return 14695981039346656037ULL; //  will cause truncation for 32-bit ints
+}
+
+uint64_t fnv2_update(uint64_t hash, void const *src, size_t sz) {
     while (sz > 0) {
         hash = hash ^ *(unsigned char const *)src;
         hash = hash * 1099511628211ULL + 1001ULL;   //  avoid sticky-0 by adding a prime
         sz -= 1;
         src = (unsigned char const *)src + 1;
     }
+    return hash;
+}
+
+unsigned int fnv2_end(uint64_t hash) {
     return (unsigned int)(hash ^ (hash >> 32)); //  avoid last-bit-stickiness
 }
 
+//  reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+//  table_[0] is the usual byte-at-a-time table; table_[k][i] is the CRC 
+//  of byte i followed by k zero bytes, so 8 lookups consume 8 bytes.
+static struct crc32c_tables {
+    crc32c_tables() {
+        for (unsigned int i = 0; i != 256; ++i) {
+            uint32_t crc = i;
+            for (int j = 0; j != 8; ++j) {
+                crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+            }
+            table_[0][i] = crc;
+        }
+        for (unsigned int i = 0; i != 256; ++i) {
+            for (int k = 1; k != 8; ++k) {
+                uint32_t prev = table_[k - 1][i];
+                table_[k][i] = (prev >> 8) ^ table_[0][prev & 0xff];
+            }
+        }
+    }
+    uint32_t table_[8][256];
+} crcTables;
+
+uint32_t crc32c(void const *src, size_t sz) {
+    return crc32c_end(crc32c_update(crc32c_begin(), src, sz));
+}
+
+uint32_t crc32c_begin() {
+    return 0xffffffff;
+}
+
+uint32_t crc32c_end(uint32_t crc) {
+    return ~crc;
+}
+
+uint32_t crc32c_update_sw(uint32_t crc, void const *src, size_t sz) {
+    uint32_t const (&t)[8][256] = crcTables.table_;
+    unsigned char const *p = (unsigned char const *)src;
+    //  this assumes a little-endian CPU, as do the wire formats
+    while (sz >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+            t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+            t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        sz -= 8;
+    }
+    while (sz > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+        ++p;
+        --sz;
+    }
+    return crc;
+}
+
+#if CRC32C_HW_X86 || CRC32C_HW_ARM
+uint32_t crc32c_update(uint32_t crc, void const *src, size_t sz) {
+    unsigned char const *p = (unsigned char const *)src;
+    uint64_t c = crc;
+    while (sz >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+#if CRC32C_HW_X86
+        c = _mm_crc32_u64(c, v);
+#else
+        c = __crc32cd((uint32_t)c, v);
+#endif
+        p += 8;
+        sz -= 8;
+    }
+    while (sz > 0) {
+#if CRC32C_HW_X86
+        c = _mm_crc32_u8((uint32_t)c, *p);
+#else
+        c = __crc32cb((uint32_t)c, *p);
+#endif
+        ++p;
+        --sz;
+    }
+    return (uint32_t)c;
+}
+
+bool crc32c_hardware() {
+    return true;
+}
+#else
+uint32_t crc32c_update(uint32_t crc, void const *src, size_t sz) {
+    return crc32c_update_sw(crc, src, sz);
+}
+
+bool crc32c_hardware() {
+    return false;
+}
+#endif
+
+void xor_bytes_sw(void *dst, void const *src, size_t sz) {
+    unsigned char *d = (unsigned char *)dst;
+    unsigned char const *s = (unsigned char const *)src;
+    while (sz >= 8) {
+        uint64_t a, b;
+        memcpy(&a, d, 8);
+        memcpy(&b, s, 8);
+        a ^= b;
+        memcpy(d, &a, 8);
+        d += 8;
+        s += 8;
+        sz -= 8;
+    }
+    while (sz > 0) {
+        *d++ ^= *s++;
+        --sz;
+    }
+}
+
+void xor_bytes(void *dst, void const *src, size_t sz) {
+    unsigned char *d = (unsigned char *)dst;
+    unsigned char const *s = (unsigned char const *)src;
+#if defined(__AVX2__)
+    while (sz >= 32) {
+        __m256i a = _mm256_loadu_si256((__m256i const *)d);
+        __m256i b = _mm256_loadu_si256((__m256i const *)s);
+        _mm256_storeu_si256((__m256i *)d, _mm256_xor_si256(a, b));
+        d += 32;
+        s += 32;
+        sz -= 32;
+    }
+#elif defined(__SSE2__)
+    while (sz >= 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)d);
+        __m128i b = _mm_loadu_si128((__m128i const *)s);
+        _mm_storeu_si128((__m128i *)d, _mm_xor_si128(a, b));
+        d += 16;
+        s += 16;
+        sz -= 16;
+    }
+#elif defined(__ARM_NEON)
+    while (sz >= 16) {
+        vst1q_u8(d, veorq_u8(vld1q_u8(d), vld1q_u8(s)));
+        d += 16;
+        s += 16;
+        sz -= 16;
+    }
+#endif
+    xor_bytes_sw(d, s, sz);
+}
+
+char const *xor_bytes_kernel() {
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
 char const *next(char *&ptr, char const *end, char delim) {
     if (ptr == end) {
         return 0;
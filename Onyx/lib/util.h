@@ -4,6 +4,7 @@
 
 #include <string>
 #include <string.h>
+#include <stdint.h>
 
 std::string hexnum(unsigned char const &ch);
 std::string hexnum(unsigned short const &ch);
@@ -11,6 +12,28 @@ std::string hexnum(int ch);
 unsigned char cksum(unsigned char const *a, size_t l);
 double read_clock();
 unsigned int fnv2_hash(void const *src, size_t sz);
+//  fnv2_hash() over data that isn't contiguous:
+//  fnv2_end(fnv2_update(fnv2_update(fnv2_begin(), a, na), b, nb))
+uint64_t fnv2_begin();
+uint64_t fnv2_update(uint64_t hash, void const *src, size_t sz);
+unsigned int fnv2_end(uint64_t hash);
+//  CRC32C (Castagnoli), using the SSE4.2 or ARMv8 CRC instructions when 
+//  the build targets them, and slicing-by-8 tables otherwise. Over data 
+//  that isn't contiguous:
+//  crc32c_end(crc32c_update(crc32c_update(crc32c_begin(), a, na), b, nb))
+uint32_t crc32c(void const *src, size_t sz);
+uint32_t crc32c_begin();
+uint32_t crc32c_update(uint32_t crc, void const *src, size_t sz);
+uint32_t crc32c_end(uint32_t crc);
+//  the table version, whether there's hardware support or not
+uint32_t crc32c_update_sw(uint32_t crc, void const *src, size_t sz);
+bool crc32c_hardware();
+//  dst ^= src, for FEC parity; with AVX2, SSE2 or NEON when the build 
+//  targets them. xor_bytes_kernel() says which.
+void xor_bytes(void *dst, void const *src, size_t sz);
+//  the plain 64-bits-at-a-time version
+void xor_bytes_sw(void *dst, void const *src, size_t sz);
+char const *xor_bytes_kernel();
 
 template<size_t Sz>
 void safecpy(char (&dst)[Sz], char const *src) {
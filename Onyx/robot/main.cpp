@@ -11,7 +11,9 @@
 #include <assert.h>
 
 #include "USBLink.h"
+#include "USBReplay.h"
 #include "ServoSet.h"
+#include "Histogram.h"
 #include "IK.h"
 #include "util.h"
 #include "Camera.h"
@@ -32,6 +34,14 @@ const float CENTER_ZPOS = -30.0f;
 #define MAX_SERVO_COUNT 16
 
 bool REAL_USB = true;
+//  log every USB packet with its time, for --replayusb
+bool RECORD_USB = false;
+//  run the servo loop against a recorded log instead of the board, 
+//  with the recorded timing unless REPLAY_FAST
+char const *REPLAY_USB = 0;
+bool REPLAY_FAST = false;
+//  do the network socket I/O on its own thread
+bool NET_THREAD = false;
 
 static double const LOCK_ADDRESS_TIME = 5.0;
 static double const STEP_DURATION = 0.008;
@@ -46,7 +56,8 @@ static IStatus *istatus;
 static ISockets *isocks;
 static INetwork *inet;
 static IPacketizer *ipackets;
-static unsigned short battery;
+//  written by the USB thread, read by the network side
+static boost::shared_ptr<TelemetryStore> telemetry(new TelemetryStore());
 
 static unsigned char firing_value;
 
@@ -73,8 +84,6 @@ static const initinfo init[] = {
     { 14, 2048 },
 };
 
-static unsigned char nst = 0;
-
 //  slew rates are amount of change per second
 #define SPEED_SLEW 2.5f
 #define HEIGHT_SLEW 25.0f
@@ -90,8 +99,6 @@ float ctl_elevation = 0;
 unsigned char ctl_pose = 3;
 unsigned char ctl_fire = 0;
 
-legpose last_pose[4];
-
 //  STRAFE_SIZE is stroke each direction -- so stride is 2*STRAFE_SIZE
 const float STRAFE_SIZE = 40.0f;
 //  STEP_SIZE is stroke each direction -- so stride is 2*STEP_SIZE
@@ -137,7 +144,6 @@ void poseleg(ServoSet &ss, int leg, float step, float speed, float strafe, float
         mstr[leg] = sst.str();
         istatus->error(mstr[leg].c_str());
     }
-    last_pose[leg] = lp;
     ss.id(leg * 3 + 1).set_goal_position(lp.a);
     ss.id(leg * 3 + 2).set_goal_position(lp.b);
     ss.id(leg * 3 + 3).set_goal_position(lp.c);
@@ -199,12 +205,32 @@ static void handle_setinput(P_SetInput const &psi) {
 double request_video_time;
 int request_video_width;
 int request_video_height;
+double request_video_interval;
 unsigned short request_video_serial;
+unsigned short request_video_stamp;
+double request_video_received;
+//  On send overflow, back off the frame rate rather than cutting video.
+//  video_backoff multiplies the requested interval.
+double video_backoff = 1;
+unsigned short video_overflows;
+double last_video_time;
+
+#define MAX_VIDEO_BACKOFF 16
+#define THUMBNAIL_QUALITY 60
 
 static void handle_requestvideo(P_RequestVideo const &prv) {
-    request_video_time = itime->now() + prv.millis * 0.001;
+    request_video_received = itime->now();
+    request_video_time = request_video_received + prv.millis * 0.001;
     request_video_width = prv.width;
     request_video_height = prv.height;
+    request_video_interval = prv.interval * 0.001;
+    request_video_stamp = prv.stamp;
+    try {
+        inet->set_fec(prv.fecData, prv.fecParity);
+    }
+    catch (std::exception const &x) {
+        istatus->error(x.what());
+    }
 }
 
 
@@ -254,11 +280,13 @@ static void handle_packets() {
     }
 
     if (want_status) {
+        TelemetrySnapshot snap;
+        telemetry->snapshot(snap);
         struct P_Status ps;
         memset(&ps, 0, sizeof(ps));
-        ps.battery = battery;
+        ps.battery = snap.battery;
         ps.hits = 21;
-        ps.status = nst;
+        ps.status = snap.status();
         Message msg;
         bool got_message = false;
         //  If too many messages, drain some, but keep the latest error 
@@ -307,10 +335,49 @@ class USBLogger : public Logger {
 public:
     virtual void log_data(LogWhat what, void const *data, size_t size)
     {
-        log(what == LogUSBWrite ? LogKeyUSBOut : LogKeyUSBIn, data, size);
+        switch (what) {
+        case LogUSBWrite: log_packet(LogKeyUSBOut, LogKeyUSBOutTimed, data, size); break;
+        case LogUSBRead: log_packet(LogKeyUSBIn, LogKeyUSBInTimed, data, size); break;
+        case LogUSBWriteLatency: log(LogKeyUSBOutLatency, data, size); break;
+        case LogUSBReadLatency: log(LogKeyUSBInLatency, data, size); break;
+        case LogUSBSubmitLatency: log(LogKeyUSBSubmitLatency, data, size); break;
+        }
+    }
+private:
+    void log_packet(LogKey key, LogKey timedKey, void const *data, size_t size)
+    {
+        if (!RECORD_USB) {
+            log(key, data, size);
+            return;
+        }
+        unsigned char buf[sizeof(double) + 256];
+        if (size > sizeof(buf) - sizeof(double)) {
+            size = sizeof(buf) - sizeof(double);
+        }
+        double now = read_clock();
+        memcpy(buf, &now, sizeof(now));
+        memcpy(buf + sizeof(now), data, size);
+        log(timedKey, buf, sizeof(now) + size);
     }
 };
 
+static void replay_report(USBReplay const &replay, double start, size_t frames,
+    LatencyHistogram &work) {
+    double t = read_clock() - start;
+    HistogramCounts none, cur;
+    LatencySummary ls;
+    work.collect(cur);
+    LatencyHistogram::summarize(cur, none, ls);
+    fprintf(stderr, "\nreplay: %ld of %ld in packets, %ld out packets in %.3f s (%s); "
+        "%.1f loops/s\n", (long)replay.received(), (long)replay.in_count(),
+        (long)replay.out_count(), t, REPLAY_FAST ? "fast" : "recorded timing", frames / t);
+    fprintf(stderr, "replay: sent matched %ld  differed %ld (first #%ld)  past the log %ld\n",
+        (long)replay.matched(), (long)replay.differed(), replay.first_difference(),
+        (long)replay.extra());
+    fprintf(stderr, "replay: loop work p50 %.3f  p99 %.3f  p99.9 %.3f  max %.3f ms\n",
+        ls.p50, ls.p99, ls.p999, ls.max);
+}
+
 void usb_thread_fn() {
     sched_param parm = { .sched_priority = 25 };
     if (pthread_setschedparam(pthread_self(), SCHED_RR, &parm) < 0) {
@@ -319,7 +386,23 @@ void usb_thread_fn() {
     }
     get_leg_params(lparam);
     boost::shared_ptr<Logger> logger(new USBLogger());
-    ServoSet ss(REAL_USB, logger);
+    boost::shared_ptr<USBReplay> replay;
+    boost::shared_ptr<ServoSet> servos;
+    if (REPLAY_USB) {
+        replay = boost::shared_ptr<USBReplay>(new USBReplay(REPLAY_USB, !REPLAY_FAST));
+        servos = boost::shared_ptr<ServoSet>(new ServoSet(replay.get(), istatus));
+        //  same packets as the recording
+        long batch = 0;
+        maybe_get(Settings::load("settings.ini"), "batch", batch);
+        servos->set_batching(batch != 0);
+    }
+    else {
+        servos = boost::shared_ptr<ServoSet>(new ServoSet(REAL_USB, logger));
+    }
+    ServoSet &ss(*servos);
+    ss.set_store(telemetry);
+    LatencyHistogram replayWork;
+    size_t replayFrames = 0;
     ss.set_power(15);
     for (size_t i = 0; i < sizeof(init)/sizeof(init[0]); ++i) {
         ss.add_servo(init[i].id, init[i].center);
@@ -327,12 +410,14 @@ void usb_thread_fn() {
     ss.set_torque(MAX_TORQUE, 1); //  not quite top torque
 
     double thetime = 0, prevtime = 0, intime = read_clock();
+    double replayStart = intime;
     float step = 0;
     SlewRateInterpolator<float> i_speed(0, SPEED_SLEW, 1, intime);
     SlewRateInterpolator<float> i_strafe(0, SPEED_SLEW, 1, intime);
     SlewRateInterpolator<float> i_turn(0, SPEED_SLEW, 1, intime);
     SlewRateInterpolator<float> i_height(0, HEIGHT_SLEW, 1, intime);
     double frames = 0;
+    unsigned char nst = 0;
     while (true) {
         float use_trot = ctl_trot;
         float use_speed = ctl_speed;
@@ -349,6 +434,11 @@ void usb_thread_fn() {
 
         thetime = read_clock();
         frames = frames + 1;
+        if (replay && replay->done()) {
+            replay_report(*replay, replayStart, replayFrames, replayWork);
+            flush_logger();
+            exit(0);
+        }
         if (thetime - intime > 10) {
             fprintf(stderr, "usb fps: %.1f\n", frames / (thetime - intime));
             frames = 0;
@@ -388,18 +478,25 @@ void usb_thread_fn() {
                 //  when standing still, start at a known pos
                 step = 0;
             }
-            poselegs(ss, step, i_speed.get(), -i_turn.get(), i_strafe.get(), i_height.get());
+            {
+                //  the network side sees all of a pose's goals, or none
+                TelemetryWrite tw(*telemetry);
+                poselegs(ss, step, i_speed.get(), -i_turn.get(), i_strafe.get(), i_height.get());
+            }
             if (ctl_fire || (firing_value != ctl_fire)) {
                 firing_value = ctl_fire;
                 do_fire(ss);
             }
         }
-        else {
+        else if (!REPLAY_FAST) {
             usleep(3000);
         }
         ss.step();
-        battery = ss.battery();
-        log(LogKeyBattery, battery);
+        if (replay) {
+            replayWork.record(read_clock() - thetime);
+            ++replayFrames;
+        }
+        log(LogKeyBattery, ss.battery());
         if (ss.queue_depth() > 30) {
             istatus->error("Servo queue overflow -- flushing.");
             int n = 100;
@@ -459,6 +556,21 @@ int main(int argc, char const *argv[]) {
         if (!strcmp(argv[i], "--fakeusb")) {
             REAL_USB = false;
         }
+        else if (!strcmp(argv[i], "--netthread")) {
+            NET_THREAD = true;
+        }
+        else if (!strcmp(argv[i], "--recordusb")) {
+            RECORD_USB = true;
+        }
+        else if (!strcmp(argv[i], "--replayusb")) {
+            if (argv[i + 1] == nullptr) {
+                goto usage;
+            }
+            REPLAY_USB = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--fast")) {
+            REPLAY_FAST = true;
+        }
         else if (!strcmp(argv[1], "--maxtorque")) {
             if (argv[2] == nullptr) {
                 goto usage;
@@ -472,7 +584,8 @@ int main(int argc, char const *argv[]) {
         }
         else {
 usage:
-            fprintf(stderr, "usage: robot [--fakeusb] [--maxtorque 1023]\n");
+            fprintf(stderr, "usage: robot [--fakeusb] [--netthread] [--maxtorque 1023] [--recordusb]\n"
+                "             [--replayusb logfile [--fast]]\n");
             exit(1);
         }
     }
@@ -480,15 +593,38 @@ usage:
     IStatus *chain = mkstatus(itime, true);
     istatus = mk_logstatus(chain);
     isocks = mksocks(port, istatus);
-    inet = listen(isocks, itime, istatus);
+    inet = listen(isocks, itime, istatus, NET_THREAD);
+    inet->set_reliable(true);
     ipackets = packetize(inet, istatus);
+    //  video can wait (or be dropped); status goes ahead of it
+    ipackets->set_send_class(R2C_Status, SendTelemetry);
+    ipackets->set_send_class(R2C_VideoFrame, SendBulk);
+    //  after a stall, act on the newest input only, and answer once
+    ipackets->set_state_channel(C2R_SetInput);
+    ipackets->set_state_channel(R2C_Status);
 
     open_logger();
     log_ratelimit(LogKeyError, false);
+    //  USBLink already limits these to one per second
+    log_ratelimit(LogKeyUSBOutLatency, false);
+    log_ratelimit(LogKeyUSBInLatency, false);
+    log_ratelimit(LogKeyUSBSubmitLatency, false);
+    log_ratelimit(LogKeyUSBOutTimed, false);
+    log_ratelimit(LogKeyUSBInTimed, false);
 
     boost::shared_ptr<boost::thread> usb_thread(new boost::thread(boost::bind(usb_thread_fn)));
 
     boost::shared_ptr<Settings> settings(Settings::load("onyx.json"));
+    //  bytes per second to each peer; 0 is unpaced
+    double send_rate = 0;
+    maybe_get(settings, "send_rate", send_rate);
+    inet->set_send_rate(send_rate);
+    //  send video once to a multicast group, which the pilot and any 
+    //  spectators join, instead of to the pilot only
+    std::string video_group;
+    if (maybe_get(settings, "video_group", video_group)) {
+        inet->set_group(group_address(video_group));
+    }
     boost::shared_ptr<Module> camera(Camera::open(settings->get_value("camera")));
     boost::shared_ptr<Property> image(camera->get_property_named("image"));
     boost::shared_ptr<ImageListener> image_listener(new ImageListener(image));
@@ -501,24 +637,51 @@ usage:
         camera->step();
         ipackets->step();
         if (inet->check_clear_overflow()) {
-            //  don't send bulky video if I'm out of send space
-            request_video_time = 0;
+            //  send bulky video less often if I'm out of send space
+            ++video_overflows;
+            video_backoff = std::min(video_backoff * 2, (double)MAX_VIDEO_BACKOFF);
         }
         handle_packets();
 
         thetime = read_clock();
         frames = frames + 1;
         if (thetime - intime > (REAL_USB ? 20 : 2)) {
+            TelemetrySnapshot snap;
+            telemetry->snapshot(snap);
             fprintf(stderr, "main fps: %.1f  battery: %.2f\n", frames / (thetime - intime),
-                (float)battery / 100.0);
+                (float)snap.battery / 100.0);
+            size_t inuse = 0, highwater = 0, heapallocs = 0;
+            inet->pool_stats(inuse, highwater, heapallocs);
+            fprintf(stderr, "fragments in use: %ld  high water: %ld  heap allocs: %ld\n",
+                (long)inuse, (long)highwater, (long)heapallocs);
+            std::vector<PeerStats> peers;
+            inet->check_clear_loss(peers);
+            for (auto ptr(peers.begin()), end(peers.end()); ptr != end; ++ptr) {
+                fprintf(stderr, "peer %s: nacks %d  retransmits %d  received %d  lost %d  recovered %d  dropped %d\n",
+                    ipaddr((*ptr).addr_).c_str(), (*ptr).nacksReceived_, (*ptr).retransmits_,
+                    (*ptr).received_, (*ptr).lost_, (*ptr).recovered_, (*ptr).dropped_);
+                if ((*ptr).peerReceived_ || (*ptr).peerLost_) {
+                    fprintf(stderr, "peer %s reports: received %d  lost %d  recovered %d\n",
+                        ipaddr((*ptr).addr_).c_str(), (*ptr).peerReceived_, (*ptr).peerLost_,
+                        (*ptr).peerRecovered_);
+                }
+            }
+            unsigned staleIn = 0, staleOut = 0;
+            ipackets->check_clear_drops(staleIn, staleOut);
+            fprintf(stderr, "stale inputs dropped: %u  status replies coalesced: %u\n",
+                staleIn, staleOut);
+            LatencySummary ls;
+            inet->dispatch_latency(ls);
+            fprintf(stderr, "dispatch latency: %u messages  p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f ms\n",
+                ls.count, ls.p50, ls.p99, ls.p999, ls.max);
             frames = 0;
             intime = thetime;
             if (!REAL_USB) {
                 fprintf(stderr, "1:%d 2:%d 3:%d  4:%d 5:%d 6:%d  7:%d 8:%d 9:%d  10:%d 11:%d 12:%d\n",
-                    last_pose[0].a, last_pose[0].b, last_pose[0].c,
-                    last_pose[1].a, last_pose[1].b, last_pose[1].c,
-                    last_pose[2].a, last_pose[2].b, last_pose[2].c,
-                    last_pose[3].a, last_pose[3].b, last_pose[3].c);
+                    snap.value[TF_GOAL][1], snap.value[TF_GOAL][2], snap.value[TF_GOAL][3],
+                    snap.value[TF_GOAL][4], snap.value[TF_GOAL][5], snap.value[TF_GOAL][6],
+                    snap.value[TF_GOAL][7], snap.value[TF_GOAL][8], snap.value[TF_GOAL][9],
+                    snap.value[TF_GOAL][10], snap.value[TF_GOAL][11], snap.value[TF_GOAL][12]);
             }
         }
 
@@ -526,18 +689,42 @@ usage:
             iovec iov[2];
             ++request_video_serial;
             Image &img = *image_listener->image_;
-            if (thetime < request_video_time) {
+            if (thetime < request_video_time &&
+                thetime >= last_video_time + request_video_interval * video_backoff) {
+                last_video_time = thetime;
                 P_VideoFrame vf;
                 memset(&vf, 0, sizeof(vf));
                 vf.serial = request_video_serial;
-                vf.width = img.width();
-                vf.height = img.height();
+                vf.stamp = request_video_stamp;
+                vf.delay = (unsigned short)std::min((thetime - request_video_received) * 1000, 65535.0);
+                vf.overflows = video_overflows;
+                video_overflows = 0;
+                vf.capture = img.capture_time();
                 memset(iov, 0, sizeof(iov));
                 iov[0].iov_base = &vf;
                 iov[0].iov_len = sizeof(vf);
-                iov[1].iov_base = const_cast<void *>(img.bits(CompressedBits));
-                iov[1].iov_len = img.size(CompressedBits);
-                ipackets->vrespond(R2C_VideoFrame, 2, iov);
+                if (request_video_width * 2 <= (int)img.width()) {
+                    //  The requester wants a smaller picture; re-compress the thumbnail.
+                    boost::shared_ptr<std::vector<char>> thumb(new std::vector<char>());
+                    img.compress(ThumbnailBits, THUMBNAIL_QUALITY, *thumb);
+                    vf.width = img.width(ThumbnailBits);
+                    vf.height = img.height(ThumbnailBits);
+                    iov[1].iov_base = &(*thumb)[0];
+                    iov[1].iov_len = thumb->size();
+                    ipackets->vrespond_nocopy(R2C_VideoFrame, 2, iov, thumb);
+                }
+                else {
+                    vf.width = img.width();
+                    vf.height = img.height();
+                    iov[1].iov_base = const_cast<void *>(img.bits(CompressedBits));
+                    iov[1].iov_len = img.size(CompressedBits);
+                    //  the network sends the bits straight out of the image, 
+                    //  and keeps a reference until it's done
+                    ipackets->vrespond_nocopy(R2C_VideoFrame, 2, iov, image_listener->image_);
+                }
+                if (video_backoff > 1) {
+                    video_backoff = std::max(video_backoff * 0.8, 1.0);
+                }
             }
             /*
             if (!*(unsigned char *)img.bits(FullBits)) {
@@ -546,7 +733,8 @@ usage:
             }
             */
         }
-        usleep(1000);
+        //  wake up as soon as a message comes in
+        inet->wait(0.001);
     }
     return 0;
 }
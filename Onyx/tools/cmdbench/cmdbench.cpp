@@ -0,0 +1,161 @@
+
+//  cmdbench replays a gait-like trace of register writes into a ServoSet
+//  talking to a Fakeusb: every frame sets goal position and moving speed
+//  for the twelve leg servos, every tenth frame ramps torque on all of
+//  them, and now and then the turret servos move. One step() runs per
+//  frame, so the queue backs up the way it does on the robot when USB
+//  falls behind. It reports the time spent queuing writes and stepping,
+//  and how deep the queue got. Then it times writes into a queue that
+//  already holds every volatile register of every servo, which is where
+//  coalescing used to cost a scan of the whole queue.
+
+#include "ServoSet.h"
+#include "fakes.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+
+#define NUM_LEG_SERVOS 12
+#define NUM_SERVOS 14
+
+struct trace_write {
+    unsigned char id;
+    unsigned char reg;
+    bool two;
+    unsigned short value;
+};
+
+static void make_trace(size_t frames, std::vector<std::vector<trace_write>> &trace) {
+    trace.resize(frames);
+    for (size_t f = 0; f != frames; ++f) {
+        std::vector<trace_write> &tw(trace[f]);
+        for (unsigned char id = 1; id <= NUM_LEG_SERVOS; ++id) {
+            trace_write w = { id, REG_GOAL_POSITION, true,
+                (unsigned short)(2048 + (f * 13 + id * 97) % 700) };
+            tw.push_back(w);
+            trace_write s = { id, REG_MOVING_SPEED, true, (unsigned short)((f + id) % 200) };
+            tw.push_back(s);
+        }
+        if (f % 10 == 0) {
+            for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+                trace_write t = { id, REG_TORQUE_LIMIT, true, (unsigned short)(500 + f % 500) };
+                tw.push_back(t);
+            }
+        }
+        if (f % 7 == 0) {
+            for (unsigned char id = NUM_LEG_SERVOS + 1; id <= NUM_SERVOS; ++id) {
+                trace_write w = { id, REG_GOAL_POSITION, true, (unsigned short)(1024 + f % 2048) };
+                tw.push_back(w);
+            }
+            trace_write l = { 13, REG_LED, false, (unsigned short)(f & 1) };
+            tw.push_back(l);
+        }
+    }
+}
+
+static void run(bool batching, std::vector<std::vector<trace_write>> const &trace) {
+    Fakeusb usb;
+    Fakestatus status;
+    ServoSet ss(&usb, &status);
+    ss.set_batching(batching);
+    for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+        ss.add_servo(id, 2048);
+    }
+
+    double writeTime = 0;
+    double stepTime = 0;
+    size_t writes = 0;
+    size_t steps = 0;
+    size_t maxDepth = 0;
+    double depthSum = 0;
+    for (auto ptr(trace.begin()), end(trace.end()); ptr != end; ++ptr) {
+        double t0 = read_clock();
+        for (auto wp((*ptr).begin()), wend((*ptr).end()); wp != wend; ++wp) {
+            if ((*wp).two) {
+                ss.id((*wp).id).set_reg2((*wp).reg, (*wp).value);
+            }
+            else {
+                ss.id((*wp).id).set_reg1((*wp).reg, (unsigned char)(*wp).value);
+            }
+            ++writes;
+        }
+        double t1 = read_clock();
+        ss.step();
+        double t2 = read_clock();
+        writeTime += t1 - t0;
+        stepTime += t2 - t1;
+        ++steps;
+        size_t depth = ss.queue_depth();
+        depthSum += depth;
+        if (depth > maxDepth) {
+            maxDepth = depth;
+        }
+        //  step() sends at most one packet per millisecond
+        usleep(1000);
+    }
+    fprintf(stdout, "%-8s %7ld writes %6.1f ns/write  %6ld steps %6.2f us/step  "
+        "queue depth avg %5.1f max %ld  %ld packets\n",
+        batching ? "batched" : "single",
+        (long)writes, writeTime * 1e9 / writes,
+        (long)steps, stepTime * 1e6 / steps,
+        depthSum / steps, (long)maxDepth, (long)usb.wereSent_.size());
+}
+
+static unsigned char const burst_regs[] = {
+    REG_LED, REG_D_GAIN, REG_I_GAIN, REG_P_GAIN,
+    REG_GOAL_POSITION, REG_GOAL_POSITION_HI, REG_MOVING_SPEED, REG_MOVING_SPEED_HI,
+    REG_TORQUE_LIMIT, REG_TORQUE_LIMIT_HI, REG_PUNCH, REG_PUNCH_HI,
+};
+
+static void run_burst(size_t rounds) {
+    Fakeusb usb;
+    Fakestatus status;
+    ServoSet ss(&usb, &status);
+    for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+        ss.add_servo(id, 2048);
+    }
+    size_t writes = 0;
+    double start = read_clock();
+    for (size_t r = 0; r != rounds; ++r) {
+        for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+            Servo &s(ss.id(id));
+            for (size_t i = 0; i != sizeof(burst_regs); ++i) {
+                s.set_reg1(burst_regs[i], (unsigned char)(r + i));
+                ++writes;
+            }
+        }
+    }
+    double t = read_clock() - start;
+    fprintf(stdout, "burst    %7ld writes %6.1f ns/write  queue depth %d\n",
+        (long)writes, t * 1e9 / writes, ss.queue_depth());
+}
+
+void usage() {
+    fprintf(stderr, "usage: cmdbench [frames]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    size_t frames = 2000;
+    try {
+        if (argc > 1) {
+            frames = boost::lexical_cast<size_t>(argv[1]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 2 || frames == 0) {
+        usage();
+    }
+    std::vector<std::vector<trace_write>> trace;
+    make_trace(frames, trace);
+    run(false, trace);
+    run(true, trace);
+    run_burst(frames);
+    return 0;
+}
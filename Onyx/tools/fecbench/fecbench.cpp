@@ -0,0 +1,212 @@
+
+//  fecbench measures the FEC parity kernel on 2048 byte fragments, as
+//  the encoder (XOR a group of data fragments into a parity fragment) and
+//  the decoder (XOR the parity and the rest of the group back into the
+//  missing fragment) use it. Then it sends video-frame-sized messages
+//  from one Network to another through Fakesockets, dropping fragments at
+//  random, at a few FEC settings, and reports how many frames arrive
+//  whole without any resends, and what the parity costs.
+
+#include "inetwork.h"
+#include "istatus.h"
+#include "itime.h"
+#include "fakes.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+
+
+#define FRAGMENT_SIZE 2048
+#define GROUP 8
+#define KERNEL_BYTES (1024 * 1024 * 1024)
+
+typedef void (*xor_fn)(void *dst, void const *src, size_t sz);
+
+static void bench_kernel(char const *name, xor_fn fn) {
+    std::vector<unsigned char> frags(GROUP * FRAGMENT_SIZE);
+    std::vector<unsigned char> parity(FRAGMENT_SIZE);
+    for (size_t i = 0; i != frags.size(); ++i) {
+        frags[i] = (unsigned char)(i * 13);
+    }
+    size_t groups = KERNEL_BYTES / (GROUP * FRAGMENT_SIZE);
+
+    double start = read_clock();
+    for (size_t g = 0; g != groups; ++g) {
+        memset(&parity[0], 0, FRAGMENT_SIZE);
+        for (size_t i = 0; i != GROUP; ++i) {
+            fn(&parity[0], &frags[i * FRAGMENT_SIZE], FRAGMENT_SIZE);
+        }
+    }
+    double enc = read_clock() - start;
+
+    //  rebuild fragment 0 from the parity and the other seven
+    std::vector<unsigned char> rebuilt(FRAGMENT_SIZE);
+    start = read_clock();
+    for (size_t g = 0; g != groups; ++g) {
+        memcpy(&rebuilt[0], &parity[0], FRAGMENT_SIZE);
+        for (size_t i = 1; i != GROUP; ++i) {
+            fn(&rebuilt[0], &frags[i * FRAGMENT_SIZE], FRAGMENT_SIZE);
+        }
+    }
+    double dec = read_clock() - start;
+    if (memcmp(&rebuilt[0], &frags[0], FRAGMENT_SIZE)) {
+        fprintf(stderr, "fecbench: %s kernel rebuilt the wrong data\n", name);
+        exit(1);
+    }
+    double gb = (double)groups * GROUP * FRAGMENT_SIZE / 1e9;
+    fprintf(stdout, "%-8s encode %6.2f GB/s  decode %6.2f GB/s\n", name, gb / enc, gb / dec);
+}
+
+//  Move what one side sent to the other side's receive queue, as coming
+//  from 'from', dropping data fragments with probability 'loss'.
+static size_t deliver(Fakesockets *src, Fakesockets *dst, sockaddr_in const &from, double loss) {
+    size_t n = 0;
+    for (auto ptr(src->wasSent_.begin()), end(src->wasSent_.end()); ptr != end; ++ptr) {
+        ++n;
+        bool control = (*ptr).data.size() >= 6 &&
+            (unsigned char)(*ptr).data[4] == 0xff && (unsigned char)(*ptr).data[5] == 0xff;
+        if (!control && rand() < loss * RAND_MAX) {
+            continue;
+        }
+        (*ptr).addr = from;
+        dst->toReceive_.push_back(*ptr);
+    }
+    src->wasSent_.clear();
+    return n;
+}
+
+static sockaddr_in mkaddr(unsigned short port) {
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+    return sin;
+}
+
+static void bench_network(unsigned fecData, unsigned fecParity, double loss,
+    size_t frames, size_t frameSize) {
+    Faketime *ftime = new Faketime();
+    IStatus *status = mkstatus(ftime, false);
+    Fakesockets *ssocks = new Fakesockets();
+    Fakesockets *rsocks = new Fakesockets();
+    INetwork *snet = listen(ssocks, ftime, status);
+    INetwork *rnet = scan(rsocks, ftime, status);
+    sockaddr_in saddr(mkaddr(7000));
+    sockaddr_in raddr(mkaddr(7001));
+
+    //  Say hello, so the two trade capabilities, and the sender has
+    //  someone to respond() to.
+    char hello = 0;
+    rnet->broadcast(1, &hello);
+    for (int i = 0; i != 6; ++i) {
+        rnet->step();
+        deliver(rsocks, ssocks, raddr, 0);
+        snet->step();
+        deliver(ssocks, rsocks, saddr, 0);
+    }
+    size_t sz = 0;
+    void const *data = 0;
+    if (!snet->receive(sz, data)) {
+        fprintf(stderr, "fecbench: no hello\n");
+        exit(1);
+    }
+    snet->set_fec(fecData, fecParity);
+
+    std::vector<unsigned char> frame(frameSize);
+    for (size_t i = 0; i != frame.size(); ++i) {
+        frame[i] = (unsigned char)(i * 31);
+    }
+    srand(1);
+    size_t got = 0;
+    size_t nfrags = 0;
+    double tsend = 0;
+    double trecv = 0;
+    for (size_t i = 0; i != frames; ++i) {
+        double start = read_clock();
+        snet->respond(frame.size(), &frame[0]);
+        snet->step();
+        tsend += read_clock() - start;
+        nfrags += deliver(ssocks, rsocks, saddr, loss);
+        start = read_clock();
+        while (!rsocks->toReceive_.empty()) {
+            rnet->step();
+        }
+        trecv += read_clock() - start;
+        while (rnet->receive(sz, data)) {
+            if (sz != frame.size() || memcmp(data, &frame[0], sz)) {
+                fprintf(stderr, "fecbench: frame %ld is corrupt\n", (long)i);
+                exit(1);
+            }
+            ++got;
+        }
+        //  the receiver's CAPS keep FEC going
+        deliver(rsocks, ssocks, raddr, 0);
+    }
+    std::vector<PeerStats> peers;
+    rnet->check_clear_loss(peers);
+    int recovered = 0;
+    for (auto ptr(peers.begin()), end(peers.end()); ptr != end; ++ptr) {
+        recovered += (*ptr).recovered_;
+    }
+    double mb = (double)frames * frameSize / (1024.0 * 1024.0);
+    char name[16];
+    if (fecData) {
+        snprintf(name, sizeof(name), "%u/%u", fecData, fecParity);
+    }
+    else {
+        strcpy(name, "none");
+    }
+    fprintf(stdout, "fec %-5s %4ld/%ld frames whole  %6ld fragments (%.1f/frame)  "
+        "%5d recovered  send %.2f ms/MB  receive %.2f ms/MB\n",
+        name, (long)got, (long)frames, (long)nfrags, (double)nfrags / frames, recovered,
+        tsend * 1000 / mb, trecv * 1000 / mb);
+
+    delete rnet;
+    delete snet;
+}
+
+void usage() {
+    fprintf(stderr, "usage: fecbench [loss [frames [framesize]]]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    double loss = 0.02;
+    size_t frames = 500;
+    size_t frameSize = 300000;
+    try {
+        if (argc > 1) {
+            loss = boost::lexical_cast<double>(argv[1]);
+        }
+        if (argc > 2) {
+            frames = boost::lexical_cast<size_t>(argv[2]);
+        }
+        if (argc > 3) {
+            frameSize = boost::lexical_cast<size_t>(argv[3]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 4 || loss < 0 || loss >= 1 || frames == 0 || frameSize == 0) {
+        usage();
+    }
+
+    bench_kernel(xor_bytes_kernel(), &xor_bytes);
+    bench_kernel("sw", &xor_bytes_sw);
+
+    fprintf(stdout, "%ld frames of %ld bytes, %.1f%% of fragments lost\n",
+        (long)frames, (long)frameSize, loss * 100);
+    static unsigned const settings[][2] = {
+        { 0, 0 }, { 16, 1 }, { 8, 1 }, { 8, 2 }, { 4, 2 },
+    };
+    for (size_t i = 0; i != sizeof(settings) / sizeof(settings[0]); ++i) {
+        bench_network(settings[i][0], settings[i][1], loss, frames, frameSize);
+    }
+    return 0;
+}
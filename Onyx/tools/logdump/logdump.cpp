@@ -1,6 +1,8 @@
 #include <logger.h>
+#include <Histogram.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 bool battery = false;
@@ -8,17 +10,19 @@ bool error = false;
 bool usbout = false;
 bool usbin = false;
 bool temperature = false;
+bool latency = false;
 bool header = false;
 bool all = false;
 bool got = false;
 
 void usage() {
-    fprintf(stderr, "usage: logdump [-beoitha] file ...\n");
+    fprintf(stderr, "usage: logdump [-beoitlha] file ...\n");
     fprintf(stderr, " -b     battery level\n");
     fprintf(stderr, " -e     errors\n");
     fprintf(stderr, " -o     usb out\n");
     fprintf(stderr, " -i     usb in\n");
     fprintf(stderr, " -t     temperature\n");
+    fprintf(stderr, " -l     usb latency\n");
     fprintf(stderr, " -h     header\n");
     fprintf(stderr, " -a     all\n");
     exit(1);
@@ -49,6 +53,28 @@ void format_usbin(logrec const *rec, void const *data, size_t size) {
     fprintf(stdout, "\n");
 }
 
+void format_usbtimed(char const *name, void const *data, size_t size) {
+    if (size < sizeof(double)) {
+        fprintf(stdout, "%s, short record\n", name);
+        return;
+    }
+    double t;
+    memcpy(&t, data, sizeof(t));
+    fprintf(stdout, "%s, %.6f, %d: ", name, t, (int)(size - sizeof(t)));
+    for (size_t i = sizeof(t); i != size; ++i) {
+        fprintf(stdout, "0x%02x ", ((unsigned char *)data)[i]);
+    }
+    fprintf(stdout, "\n");
+}
+
+void format_usbouttimed(logrec const *rec, void const *data, size_t size) {
+    format_usbtimed("usbout", data, size);
+}
+
+void format_usbintimed(logrec const *rec, void const *data, size_t size) {
+    format_usbtimed("usbin", data, size);
+}
+
 void format_temperature(logrec const *rec, void const *data, size_t size) {
     fprintf(stdout, "temp,");
     for (size_t i = 0; i != size; ++i) {
@@ -57,6 +83,28 @@ void format_temperature(logrec const *rec, void const *data, size_t size) {
     fprintf(stdout, "\n");
 }
 
+void format_latency(char const *name, void const *data, size_t size) {
+    if (size < sizeof(LatencySummary)) {
+        fprintf(stdout, "%s, short record\n", name);
+        return;
+    }
+    LatencySummary const &ls = *(LatencySummary const *)data;
+    fprintf(stdout, "%s, n %u, p50 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+        name, ls.count, ls.p50, ls.p99, ls.p999, ls.max);
+}
+
+void format_usboutlatency(logrec const *rec, void const *data, size_t size) {
+    format_latency("usboutlatency", data, size);
+}
+
+void format_usbinlatency(logrec const *rec, void const *data, size_t size) {
+    format_latency("usbinlatency", data, size);
+}
+
+void format_usbsubmitlatency(logrec const *rec, void const *data, size_t size) {
+    format_latency("usbsubmitlatency", data, size);
+}
+
 void parse_options(int &argc, char const **&argv) {
     while (argv[1]) {
         if (argv[1][0] == '-') {
@@ -83,6 +131,10 @@ void parse_options(int &argc, char const **&argv) {
                     temperature = true;
                     got = true;
                     break;
+                case 'l':   //  latency
+                    latency = true;
+                    got = true;
+                    break;
                 case 'h':   //  header
                     header = true;
                     got = true;
@@ -140,9 +192,24 @@ int main(int argc, char const *argv[]) {
             if (lr.key == LogKeyUSBIn && (all || usbin)) {
                 ffunc = &format_usbin;
             }
+            if (lr.key == LogKeyUSBOutTimed && (all || usbout)) {
+                ffunc = &format_usbouttimed;
+            }
+            if (lr.key == LogKeyUSBInTimed && (all || usbin)) {
+                ffunc = &format_usbintimed;
+            }
             if (lr.key == LogKeyTemperature && (all || temperature)) {
                 ffunc = &format_temperature;
             }
+            if (lr.key == LogKeyUSBOutLatency && (all || latency)) {
+                ffunc = &format_usboutlatency;
+            }
+            if (lr.key == LogKeyUSBInLatency && (all || latency)) {
+                ffunc = &format_usbinlatency;
+            }
+            if (lr.key == LogKeyUSBSubmitLatency && (all || latency)) {
+                ffunc = &format_usbsubmitlatency;
+            }
             if (header && ffunc != 0) {
                 fprintf(stdout, "%ld, %ld, %ld, ", nfiles, nitems, fileitem);
             }
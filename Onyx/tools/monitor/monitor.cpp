@@ -39,10 +39,15 @@ struct top_info {
 
 void timeout(void *vi) {
     info &ifo = *(info *)vi;
+    TelemetryStore const &store(*ifo.ss->store());
     for (size_t i = 0, n = ifo.regs.size(); i != n; ++i) {
         unsigned char reg = ifo.regs[i].reg;
         double v = 0;
-        if (reg & 0x80) {
+        int f = TelemetryStore::field_of(reg & 0x7f);
+        if (f >= 0 && ifo.id < TELEMETRY_MAX_SERVOS) {
+            v = store.get((TelemetryField)f, ifo.id);
+        }
+        else if (reg & 0x80) {
             v = ifo.s->get_reg2(reg & 0x7f);
         }
         else {
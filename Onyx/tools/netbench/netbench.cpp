@@ -0,0 +1,198 @@
+
+//  netbench pushes video-sized messages between two Networks over
+//  loopback, once with the plain one-datagram-per-syscall sockets, once
+//  with the recvmmsg()/sendmmsg() sockets, and once more sending with
+//  vsend_nocopy(), and reports system calls per frame and CPU time per
+//  megabyte for each.
+
+#include "inetwork.h"
+#include "istatus.h"
+#include "itime.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+
+
+//  CountingSockets forwards to a real ISockets and counts the system
+//  calls made. Broadcasts are redirected to a loopback port, so two
+//  peers can talk on one host.
+class CountingSockets : public ISockets {
+public:
+    CountingSockets(ISockets *socks, bool batched, unsigned short redirect) :
+        socks_(socks),
+        batched_(batched),
+        redirect_(redirect),
+        calls_(0) {
+    }
+    ~CountingSockets() {
+        delete socks_;
+    }
+
+    virtual int recvfrom(void *buf, size_t sz, sockaddr_in &addr) {
+        ++calls_;
+        return socks_->recvfrom(buf, sz, addr);
+    }
+    virtual int sendto(void const *buf, size_t sz, sockaddr_in const &addr) {
+        ++calls_;
+        sockaddr_in sin(fix(addr));
+        return socks_->sendto(buf, sz, sin);
+    }
+    virtual boost::shared_ptr<ISocket> connect(sockaddr_in const &addr) {
+        return socks_->connect(addr);
+    }
+    virtual int sendmsg(iovec const *vecs, size_t cnt, sockaddr_in const &addr) {
+        ++calls_;
+        sockaddr_in sin(fix(addr));
+        return socks_->sendmsg(vecs, cnt, sin);
+    }
+    virtual int recv_many(datagram *dgs, int cnt) {
+        if (!batched_) {
+            //  the default loop goes through recvfrom(), which counts
+            return ISockets::recv_many(dgs, cnt);
+        }
+        ++calls_;
+        return socks_->recv_many(dgs, cnt);
+    }
+    virtual int send_many(datagram *dgs, int cnt) {
+        if (!batched_) {
+            return ISockets::send_many(dgs, cnt);
+        }
+        ++calls_;
+        for (int i = 0; i != cnt; ++i) {
+            dgs[i].addr_ = fix(dgs[i].addr_);
+        }
+        return socks_->send_many(dgs, cnt);
+    }
+
+    ISockets *socks_;
+    bool batched_;
+    unsigned short redirect_;
+    size_t calls_;
+
+private:
+    sockaddr_in fix(sockaddr_in const &addr) {
+        sockaddr_in sin(addr);
+        if (redirect_ && (sin.sin_port == 0 || sin.sin_addr.s_addr == INADDR_BROADCAST)) {
+            sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            sin.sin_port = htons(redirect_);
+        }
+        return sin;
+    }
+};
+
+static double cpu_time() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+static void run(bool batched, bool nocopy, size_t frames, size_t frameSize, unsigned short port, ITime *itime, IStatus *status) {
+    ISockets *rs = mksocks(port, status, batched);
+    ISockets *ss = mksocks(port + 1, status, batched);
+    if (!rs || !ss) {
+        fprintf(stderr, "netbench: could not open sockets on port %d\n", port);
+        exit(1);
+    }
+    CountingSockets *rcount = new CountingSockets(rs, batched, 0);
+    CountingSockets *scount = new CountingSockets(ss, batched, port);
+    INetwork *rnet = listen(rcount, itime, status);
+    INetwork *snet = scan(scount, itime, status);
+
+    boost::shared_ptr<std::vector<unsigned char>> hold(new std::vector<unsigned char>(frameSize));
+    std::vector<unsigned char> &frame(*hold);
+    for (size_t i = 0; i != frameSize; ++i) {
+        frame[i] = (unsigned char)(i * 31);
+    }
+    iovec iov;
+    iov.iov_base = &frame[0];
+    iov.iov_len = frameSize;
+
+    size_t got = 0;
+    size_t bytes = 0;
+    double start = cpu_time();
+    double wall = read_clock();
+    for (size_t i = 0; i != frames; ++i) {
+        if (nocopy) {
+            snet->vsend_nocopy(false, 1, &iov, hold, SendBulk);
+        }
+        else {
+            snet->vsend(false, 1, &iov, SendBulk);
+        }
+        snet->step();
+        //  give the message a moment to cross loopback
+        for (int j = 0; j != 100; ++j) {
+            rnet->step();
+            size_t sz = 0;
+            void const *data = 0;
+            bool any = false;
+            while (rnet->receive(sz, data)) {
+                ++got;
+                bytes += sz;
+                any = true;
+            }
+            if (any) {
+                break;
+            }
+            usleep(50);
+        }
+    }
+    double cpu = cpu_time() - start;
+    wall = read_clock() - wall;
+
+    double mb = bytes / (1024.0 * 1024.0);
+    fprintf(stdout, "%-8s %6ld/%-6ld frames  send %6.1f syscalls/frame  recv %6.1f syscalls/frame  "
+        "%6.2f ms CPU/MB  %6.2f s wall\n",
+        nocopy ? "nocopy" : batched ? "batched" : "single",
+        (long)got, (long)frames,
+        (double)scount->calls_ / frames,
+        (double)rcount->calls_ / frames,
+        mb > 0 ? cpu * 1000 / mb : 0.0,
+        wall);
+
+    delete snet;
+    delete rnet;
+    delete scount;
+    delete rcount;
+}
+
+void usage() {
+    fprintf(stderr, "usage: netbench [frames [framesize [port]]]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    size_t frames = 1000;
+    size_t frameSize = 80000;
+    unsigned short port = 7200;
+    try {
+        if (argc > 1) {
+            frames = boost::lexical_cast<size_t>(argv[1]);
+        }
+        if (argc > 2) {
+            frameSize = boost::lexical_cast<size_t>(argv[2]);
+        }
+        if (argc > 3) {
+            port = boost::lexical_cast<unsigned short>(argv[3]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 4 || frames == 0 || frameSize == 0) {
+        usage();
+    }
+
+    ITime *itime = newclock();
+    IStatus *status = mkstatus(itime, true);
+    run(false, false, frames, frameSize, port, itime, status);
+    run(true, false, frames, frameSize, port + 2, itime, status);
+    run(true, true, frames, frameSize, port + 4, itime, status);
+    return 0;
+}
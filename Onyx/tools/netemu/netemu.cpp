@@ -0,0 +1,319 @@
+
+//  netemu runs a robot-like and a control-like Network against each other
+//  through a NetEmulator, in virtual time, under a few scripted link
+//  conditions. The control side sends small input messages at a steady
+//  rate; the robot sends video-frame-sized messages back, the way the real
+//  programs do (reliable, with FEC if asked). For each condition it reports
+//  the fraction of frames and inputs delivered, their one-way latency, and
+//  what loss recovery (NACK resends and FEC) did.
+//  Any link or traffic parameter can be overridden as key=value, e.g.
+//      netemu wifi lossbad=0.5 fec=8/1
+//  Use it to compare transport changes on the same (seeded) conditions.
+
+#include "inetwork.h"
+#include "istatus.h"
+#include "itime.h"
+#include "NetEmulator.h"
+#include "Histogram.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <boost/lexical_cast.hpp>
+#include <string>
+#include <vector>
+
+
+#define ROBOT_PORT 6969
+#define CONTROL_PORT 6970
+//  virtual time step
+#define TICK 0.001
+
+struct Scenario {
+    char const *name;
+    LinkParams link;
+    //  the robot's send rate, unless pace= is given; 0 is unpaced
+    double pace;
+};
+
+struct Traffic {
+    Traffic() : seconds(20), fps(30), frameSize(40000), inputRate(50),
+        fecData(0), fecParity(0), pace(0), real(false), seed(1) {}
+    double seconds;
+    double fps;
+    size_t frameSize;
+    double inputRate;
+    unsigned fecData;
+    unsigned fecParity;
+    double pace;
+    bool real;
+    unsigned int seed;
+};
+
+static LinkParams mklink(double latency, double jitter, double bandwidth, size_t queue,
+    double pGoodBad, double pBadGood, double lossGood, double lossBad, double reorder) {
+    LinkParams lp;
+    lp.latency = latency;
+    lp.jitter = jitter;
+    lp.bandwidth = bandwidth;
+    lp.queueBytes = queue;
+    lp.pGoodBad = pGoodBad;
+    lp.pBadGood = pBadGood;
+    lp.lossGood = lossGood;
+    lp.lossBad = lossBad;
+    lp.reorder = reorder;
+    return lp;
+}
+
+static std::vector<Scenario> scenarios() {
+    std::vector<Scenario> ret;
+    Scenario s;
+    s.pace = 0;
+    s.name = "lan";
+    s.link = mklink(0.0005, 0.0002, 50e6, 1024 * 1024, 0, 1, 0, 0, 0);
+    ret.push_back(s);
+    s.name = "wifi";
+    s.link = mklink(0.002, 0.003, 3e6, 256 * 1024, 0.005, 0.3, 0.002, 0.3, 0.001);
+    ret.push_back(s);
+    s.name = "lossy";
+    s.link = mklink(0.005, 0.005, 2e6, 256 * 1024, 0.02, 0.2, 0.01, 0.5, 0.01);
+    ret.push_back(s);
+    s.name = "congested";
+    s.link = mklink(0.01, 0.001, 0.5e6, 64 * 1024, 0, 1, 0.001, 0, 0);
+    ret.push_back(s);
+    //  The robot paces itself to under the congested link's rate, so 
+    //  frames back up in its bulk lane and the oldest get dropped while 
+    //  the one at the front is part way out. About a third of them fit.
+    s.name = "paced";
+    s.pace = 450000;
+    ret.push_back(s);
+    return ret;
+}
+
+struct Stamp {
+    unsigned int seq;
+    double sent;
+};
+
+static void run(Scenario const &sc, Traffic const &tr) {
+    VirtualTime vtime;
+    ITime *itime = tr.real ? newclock() : (ITime *)&vtime;
+    IStatus *status = mkstatus(itime, false);
+    NetEmulator emu(itime, tr.seed);
+    ISockets *rsocks = emu.endpoint(ROBOT_PORT, sc.link);
+    ISockets *csocks = emu.endpoint(CONTROL_PORT, sc.link);
+    INetwork *robot = listen(rsocks, itime, status);
+    INetwork *control = scan(csocks, itime, status);
+    robot->set_reliable(true);
+    control->set_reliable(true);
+    robot->set_fec(tr.fecData, tr.fecParity);
+    robot->set_send_rate(tr.pace > 0 ? tr.pace : sc.pace);
+
+    std::vector<char> frame(std::max(tr.frameSize, sizeof(Stamp)));
+    LatencyHistogram frameLatency, inputLatency;
+    HistogramCounts none, cur;
+    size_t framesSent = 0, framesGot = 0, inputsSent = 0, inputsGot = 0;
+    bool heard = false;
+    double start = itime->now();
+    double nextInput = start, nextFrame = start;
+    std::vector<PeerStats> robotPeers, controlPeers;
+    int lost = 0, recovered = 0, nacks = 0, retransmits = 0;
+
+    while (true) {
+        double now = itime->now();
+        if (now - start >= tr.seconds) {
+            break;
+        }
+        if (now >= nextInput) {
+            nextInput += 1.0 / tr.inputRate;
+            Stamp m = { (unsigned int)inputsSent++, now };
+            control->broadcast(sizeof(m), &m);
+        }
+        if (heard && now >= nextFrame) {
+            nextFrame += 1.0 / tr.fps;
+            Stamp m = { (unsigned int)framesSent++, now };
+            memcpy(&frame[0], &m, sizeof(m));
+            iovec iov = { &frame[0], frame.size() };
+            robot->vsend(true, 1, &iov, SendBulk);
+        }
+        control->step();
+        robot->step();
+
+        size_t sz;
+        void const *data;
+        while (robot->receive(sz, data)) {
+            if (sz == sizeof(Stamp)) {
+                heard = true;
+                ++inputsGot;
+                inputLatency.record(itime->now() - ((Stamp const *)data)->sent);
+            }
+        }
+        while (control->receive(sz, data)) {
+            if (sz == frame.size()) {
+                ++framesGot;
+                frameLatency.record(itime->now() - ((Stamp const *)data)->sent);
+            }
+        }
+        if (tr.real) {
+            usleep((useconds_t)(TICK * 1e6));
+        }
+        else {
+            vtime.sleep(TICK);
+        }
+    }
+
+    control->check_clear_loss(controlPeers);
+    for (auto ptr(controlPeers.begin()), end(controlPeers.end()); ptr != end; ++ptr) {
+        lost += (*ptr).lost_;
+        recovered += (*ptr).recovered_;
+        nacks += (*ptr).nacksSent_;
+    }
+    robot->check_clear_loss(robotPeers);
+    for (auto ptr(robotPeers.begin()), end(robotPeers.end()); ptr != end; ++ptr) {
+        retransmits += (*ptr).retransmits_;
+    }
+    LatencySummary fl, il;
+    frameLatency.collect(cur);
+    LatencyHistogram::summarize(cur, none, fl);
+    inputLatency.collect(cur);
+    LatencyHistogram::summarize(cur, none, il);
+    LinkStats down(emu.stats(ROBOT_PORT));
+
+    char fec[16];
+    snprintf(fec, sizeof(fec), "%u/%u", tr.fecData, tr.fecParity);
+    fprintf(stdout, "%-10s fec %-5s frames %5.1f%% p50 %6.1f p99 %6.1f ms  "
+        "inputs %5.1f%% p50 %5.1f p99 %6.1f ms  "
+        "link lost %ld queued out %ld  frags lost %d recovered %d  nacks %d resent %d\n",
+        sc.name, fec,
+        framesSent ? 100.0 * framesGot / framesSent : 0.0, fl.p50, fl.p99,
+        inputsSent ? 100.0 * inputsGot / inputsSent : 0.0, il.p50, il.p99,
+        (long)down.lost_, (long)down.queueDrops_, lost, recovered, nacks, retransmits);
+
+    delete control;
+    delete robot;
+}
+
+void usage() {
+    fprintf(stderr, "usage: netemu [lan|wifi|lossy|congested|paced|all] [key=value ...]\n"
+        "link:    latency jitter rate queue pgb pbg lossgood lossbad reorder\n"
+        "traffic: seconds fps framesize inputrate fec=D/P pace real seed\n");
+    exit(1);
+}
+
+static void set(std::string const &arg, LinkParams &lp, Traffic &tr, bool &fecGiven) {
+    size_t eq = arg.find('=');
+    if (eq == std::string::npos) {
+        usage();
+    }
+    std::string key(arg.substr(0, eq));
+    std::string val(arg.substr(eq + 1));
+    if (key == "fec") {
+        if (sscanf(val.c_str(), "%u/%u", &tr.fecData, &tr.fecParity) != 2) {
+            usage();
+        }
+        fecGiven = true;
+        return;
+    }
+    double d = boost::lexical_cast<double>(val);
+    if (key == "latency") {
+        lp.latency = d;
+    }
+    else if (key == "jitter") {
+        lp.jitter = d;
+    }
+    else if (key == "rate") {
+        lp.bandwidth = d;
+    }
+    else if (key == "queue") {
+        lp.queueBytes = (size_t)d;
+    }
+    else if (key == "pgb") {
+        lp.pGoodBad = d;
+    }
+    else if (key == "pbg") {
+        lp.pBadGood = d;
+    }
+    else if (key == "lossgood") {
+        lp.lossGood = d;
+    }
+    else if (key == "lossbad") {
+        lp.lossBad = d;
+    }
+    else if (key == "reorder") {
+        lp.reorder = d;
+    }
+    else if (key == "seconds") {
+        tr.seconds = d;
+    }
+    else if (key == "fps") {
+        tr.fps = d;
+    }
+    else if (key == "framesize") {
+        tr.frameSize = (size_t)d;
+    }
+    else if (key == "inputrate") {
+        tr.inputRate = d;
+    }
+    else if (key == "pace") {
+        tr.pace = d;
+    }
+    else if (key == "real") {
+        tr.real = d != 0;
+    }
+    else if (key == "seed") {
+        tr.seed = (unsigned int)d;
+    }
+    else {
+        usage();
+    }
+}
+
+int main(int argc, char const *argv[]) {
+    std::vector<Scenario> all(scenarios());
+    std::string which("all");
+    int argi = 1;
+    if (argi < argc && !strchr(argv[argi], '=')) {
+        which = argv[argi++];
+    }
+    std::vector<Scenario> todo;
+    for (auto ptr(all.begin()), end(all.end()); ptr != end; ++ptr) {
+        if (which == "all" || which == (*ptr).name) {
+            todo.push_back(*ptr);
+        }
+    }
+    if (todo.empty()) {
+        usage();
+    }
+    Traffic tr;
+    bool fecGiven = false;
+    try {
+        for (; argi < argc; ++argi) {
+            for (auto ptr(todo.begin()), end(todo.end()); ptr != end; ++ptr) {
+                set(argv[argi], (*ptr).link, tr, fecGiven);
+            }
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (tr.seconds <= 0 || tr.fps <= 0 || tr.inputRate <= 0 || tr.frameSize == 0) {
+        usage();
+    }
+
+    for (auto ptr(todo.begin()), end(todo.end()); ptr != end; ++ptr) {
+        if (fecGiven) {
+            run(*ptr, tr);
+        }
+        else {
+            //  without and with the FEC the rate controller asks for at
+            //  a few percent loss
+            Traffic t(tr);
+            run(*ptr, t);
+            t.fecData = 8;
+            t.fecParity = 1;
+            run(*ptr, t);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+
+//  reasmbench has one Network fragment video-frame-sized messages into
+//  Fakesockets, shuffles the fragments (and the fragments of a few
+//  messages together, as happens with NACK resends and several senders),
+//  and feeds them to another Network through Fakesockets. It checks every
+//  reassembled message, and reports the time spent in the receiving
+//  step() per frame and per megabyte.
+
+#include "inetwork.h"
+#include "istatus.h"
+#include "itime.h"
+#include "fakes.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+
+
+//  messages whose fragments are shuffled together
+#define INTERLEAVE 4
+
+static void fill(std::vector<unsigned char> &frame, size_t n) {
+    for (size_t i = 0; i != frame.size(); ++i) {
+        frame[i] = (unsigned char)(i * 31 + n);
+    }
+}
+
+static bool check(unsigned char const *data, size_t size, std::vector<unsigned char> const &frame) {
+    if (size != frame.size()) {
+        fprintf(stderr, "reasmbench: got a message of %ld bytes, expected %ld\n",
+            (long)size, (long)frame.size());
+        return false;
+    }
+    //  the first byte tells which of the interleaved messages this is
+    for (size_t i = 1; i != size; ++i) {
+        if (data[i] != (unsigned char)(i * 31 + data[0])) {
+            fprintf(stderr, "reasmbench: message is corrupt at byte %ld\n", (long)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+void usage() {
+    fprintf(stderr, "usage: reasmbench [frames [framesize]]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    size_t frames = 2000;
+    size_t frameSize = 300000;
+    try {
+        if (argc > 1) {
+            frames = boost::lexical_cast<size_t>(argv[1]);
+        }
+        if (argc > 2) {
+            frameSize = boost::lexical_cast<size_t>(argv[2]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 3 || frames == 0 || frameSize == 0) {
+        usage();
+    }
+    frames = (frames + INTERLEAVE - 1) / INTERLEAVE * INTERLEAVE;
+
+    Faketime *ftime = new Faketime();
+    IStatus *status = mkstatus(ftime, false);
+    Fakesockets *ssocks = new Fakesockets();
+    Fakesockets *rsocks = new Fakesockets();
+    INetwork *snet = scan(ssocks, ftime, status);
+    INetwork *rnet = listen(rsocks, ftime, status);
+
+    sockaddr_in from;
+    memset(&from, 0, sizeof(from));
+    from.sin_family = AF_INET;
+    from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    from.sin_port = htons(7000);
+
+    std::vector<unsigned char> frame(frameSize);
+    std::vector<Fakesockets::rec> frags;
+    srand(1);
+    size_t got = 0;
+    size_t nfrags = 0;
+    double t = 0;
+    for (size_t i = 0; i != frames; i += INTERLEAVE) {
+        for (size_t j = 0; j != INTERLEAVE; ++j) {
+            fill(frame, i + j);
+            snet->broadcast(frame.size(), &frame[0]);
+        }
+        snet->step();
+        frags.assign(ssocks->wasSent_.begin(), ssocks->wasSent_.end());
+        ssocks->wasSent_.clear();
+        std::random_shuffle(frags.begin(), frags.end());
+        for (auto ptr(frags.begin()), end(frags.end()); ptr != end; ++ptr) {
+            (*ptr).addr = from;
+            rsocks->toReceive_.push_back(*ptr);
+        }
+        nfrags += frags.size();
+
+        double start = read_clock();
+        while (!rsocks->toReceive_.empty()) {
+            rnet->step();
+        }
+        t += read_clock() - start;
+
+        size_t sz = 0;
+        void const *data = 0;
+        while (rnet->receive(sz, data)) {
+            if (!check((unsigned char const *)data, sz, frame)) {
+                return 1;
+            }
+            ++got;
+        }
+    }
+
+    size_t inuse = 0, highwater = 0, heapallocs = 0;
+    rnet->pool_stats(inuse, highwater, heapallocs);
+    double mb = (double)got * frameSize / (1024.0 * 1024.0);
+    fprintf(stdout, "%ld/%ld frames, %ld fragments: %.1f us/frame, %.2f ms/MB; "
+        "pool high water %ld, heap allocs %ld\n",
+        (long)got, (long)frames, (long)nfrags, t * 1e6 / frames, mb > 0 ? t * 1000 / mb : 0.0,
+        (long)highwater, (long)heapallocs);
+
+    delete rnet;
+    delete snet;
+    return got == frames ? 0 : 1;
+}
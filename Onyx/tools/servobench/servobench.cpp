@@ -0,0 +1,222 @@
+
+//  servobench drives a ServoSet with 14 servos against a Fakeusb, 
+//  setting a new goal position for every servo each gait frame the way 
+//  the robot does, and reports how many USB packets and bytes, and how 
+//  long, it takes to get each frame's writes out. It runs once with the 
+//  one-op-per-write encoding and once with OpSyncWrite/OpBulkRead 
+//  batching.
+//  With --sim, it runs against a USBSim instead, so the board answers 
+//  only as fast as the Dynamixel bus would let it. Then it runs frames at 
+//  the robot's gait rate for a while, and reports how often each servo's 
+//  position gets read, how busy the bus is, and the rate each telemetry 
+//  group got. Meanwhile another thread takes TelemetryStore snapshots as 
+//  fast as it can, and counts any that mix goals from two frames.
+
+#include "ServoSet.h"
+#include "fakes.h"
+#include "USBSim.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+
+
+#define NUM_SERVOS 14
+//  the robot's STEP_DURATION
+#define SIM_FRAME_TIME 0.008
+#define SIM_PACED_TIME 3.0
+
+static unsigned short frame_goal(size_t f, unsigned char id) {
+    return 2048 + (unsigned short)((f * 7 + id * 31) % 512);
+}
+
+static void run(bool batching, size_t frames) {
+    Fakeusb usb;
+    Fakestatus status;
+    ServoSet ss(&usb, &status);
+    ss.set_batching(batching);
+    for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+        ss.add_servo(id, 2048);
+    }
+    //  let the setup writes drain
+    while (ss.queue_depth() > 0) {
+        ss.step();
+        usleep(1000);
+    }
+
+    size_t packets = usb.wereSent_.size();
+    size_t bytes = usb.bytesSent_;
+    size_t steps = 0;
+    double start = read_clock();
+    for (size_t f = 0; f != frames; ++f) {
+        for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+            ss.id(id).set_goal_position(frame_goal(f, id));
+        }
+        size_t before = usb.wereSent_.size();
+        //  a frame is done when its writes are all in packets
+        while (ss.queue_depth() > 0 || usb.wereSent_.size() == before) {
+            ss.step();
+            ++steps;
+            usleep(1000);
+        }
+    }
+    double t = read_clock() - start;
+    packets = usb.wereSent_.size() - packets;
+    bytes = usb.bytesSent_ - bytes;
+    fprintf(stdout, "%-8s %5.2f packets/frame  %6.1f bytes/frame  %5.2f ms/frame  "
+        "syncwrite %ld  bulkread %ld  write %ld  read %ld\n",
+        batching ? "batched" : "single",
+        (double)packets / frames, (double)bytes / frames, t * 1000 / frames,
+        (long)usb.opsSent_[OpSyncWrite >> 4], (long)usb.opsSent_[OpBulkRead >> 4],
+        (long)usb.opsSent_[OpWriteServo >> 4], (long)usb.opsSent_[OpReadServo >> 4]);
+}
+
+static size_t position_reads(USBSim const &sim) {
+    size_t n = 0;
+    for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+        n += sim.servo(id)->positionReads_;
+    }
+    return n;
+}
+
+struct snapshot_reader {
+    snapshot_reader(TelemetryStore const &store) :
+        store_(store), stop_(false), snapshots_(0), torn_(0), worst_(0) {}
+    void operator()() {
+        TelemetrySnapshot snap;
+        while (!stop_.load()) {
+            double t = read_clock();
+            store_.snapshot(snap);
+            worst_ = std::max(worst_, read_clock() - t);
+            ++snapshots_;
+            //  every servo's goal should come from the same frame
+            unsigned short f7 = (snap.value[TF_GOAL][1] - frame_goal(0, 1)) & 511;
+            for (unsigned char id = 2; id <= NUM_SERVOS; ++id) {
+                if (((snap.value[TF_GOAL][id] - frame_goal(0, id)) & 511) != f7) {
+                    ++torn_;
+                    break;
+                }
+            }
+        }
+    }
+    TelemetryStore const &store_;
+    std::atomic<bool> stop_;
+    size_t snapshots_;
+    size_t torn_;
+    double worst_;
+};
+
+static void run_sim(bool batching, size_t frames) {
+    SimParams params;
+    params.servos = NUM_SERVOS;
+    USBSim sim(params, boost::shared_ptr<Logger>());
+    Fakestatus status;
+    ServoSet ss(&sim, &status);
+    ss.set_batching(batching);
+    for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+        ss.add_servo(id, 2048);
+    }
+    while (ss.queue_depth() > 0 || sim.queue_depth() > 0) {
+        ss.step();
+        usleep(1000);
+    }
+
+    //  as many frames as the bus takes
+    size_t packets = sim.out_packets();
+    double start = read_clock();
+    for (size_t f = 0; f != frames; ++f) {
+        for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+            ss.id(id).set_goal_position(frame_goal(f, id));
+        }
+        size_t before = sim.out_packets();
+        while (ss.queue_depth() > 0 || sim.out_packets() == before) {
+            ss.step();
+            usleep(1000);
+        }
+    }
+    double t = read_clock() - start;
+    packets = sim.out_packets() - packets;
+    fprintf(stdout, "%-8s %6.1f frames/s  %5.2f packets/frame\n",
+        batching ? "batched" : "single", frames / t, (double)packets / frames);
+
+    //  frames at the robot's gait rate, long enough to measure the
+    //  telemetry rates over
+    size_t reads = position_reads(sim);
+    double bus = sim.bus_time();
+    start = read_clock();
+    double next = start;
+    size_t f = 0;
+    snapshot_reader reader(*ss.store());
+    boost::thread thread(boost::ref(reader));
+    while ((t = read_clock() - start) < SIM_PACED_TIME) {
+        if (read_clock() >= next) {
+            TelemetryWrite tw(*ss.store());
+            for (unsigned char id = 1; id <= NUM_SERVOS; ++id) {
+                ss.id(id).set_goal_position(frame_goal(f, id));
+            }
+            ++f;
+            next += SIM_FRAME_TIME;
+        }
+        ss.step();
+        usleep(1000);
+    }
+    reader.stop_.store(true);
+    thread.join();
+    reads = position_reads(sim) - reads;
+    bus = sim.bus_time() - bus;
+    fprintf(stdout, "         at %.0f frames/s: %5.1f position reads/servo/s  %5.1f%% bus  "
+        "read budget %.2f ms/packet\n",
+        1 / SIM_FRAME_TIME, (double)reads / NUM_SERVOS / t, std::min(bus / t, 1.0) * 100,
+        ss.telemetry().budget() * 1000);
+    TelemetryScheduler const &ts(ss.telemetry());
+    for (size_t i = 0; i != ts.num_groups(); ++i) {
+        TelemetryGroup const &g(ts.group(i));
+        if (g.rate > 0) {
+            fprintf(stdout, "         %-12s %6.1f Hz of %6.1f\n", g.name.c_str(), ts.achieved(i), g.rate);
+        }
+        else {
+            fprintf(stdout, "         %-12s %6ld of %d servos once\n", g.name.c_str(),
+                (long)ts.complete(i), NUM_SERVOS);
+        }
+    }
+    fprintf(stdout, "         snapshots %.0f/s  torn %ld  slowest %.1f us\n",
+        reader.snapshots_ / t, (long)reader.torn_, reader.worst_ * 1e6);
+}
+
+void usage() {
+    fprintf(stderr, "usage: servobench [--sim] [frames]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    size_t frames = 200;
+    bool sim = false;
+    if (argc > 1 && !strcmp(argv[1], "--sim")) {
+        sim = true;
+        --argc;
+        ++argv;
+    }
+    try {
+        if (argc > 1) {
+            frames = boost::lexical_cast<size_t>(argv[1]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 2 || frames == 0) {
+        usage();
+    }
+    if (sim) {
+        run_sim(false, frames);
+        run_sim(true, frames);
+        return 0;
+    }
+    run(false, frames);
+    run(true, frames);
+    return 0;
+}
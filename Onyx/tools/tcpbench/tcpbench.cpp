@@ -0,0 +1,174 @@
+
+//  tcpbench streams data through a TCPSocket (from ISockets::connect())
+//  to a loopback server that echoes it back, and checks every byte that
+//  comes back. It runs with a small and a large buffer cap, reading
+//  either with peek() into a buffer or in place with peek_spans(), and
+//  reports throughput and step() calls for each.
+
+#include "inetwork.h"
+#include "istatus.h"
+#include "itime.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+
+
+#define CHUNK (64 * 1024)
+#define UDP_PORT 7199
+
+static unsigned char pattern(size_t i) {
+    return (unsigned char)(i * 131 + (i >> 16));
+}
+
+static void echo(int fd) {
+    std::vector<char> buf(CHUNK);
+    while (true) {
+        int r = ::read(fd, &buf[0], buf.size());
+        if (r <= 0) {
+            break;
+        }
+        for (int done = 0; done < r;) {
+            int w = ::write(fd, &buf[done], r - done);
+            if (w <= 0) {
+                ::close(fd);
+                return;
+            }
+            done += w;
+        }
+    }
+    ::close(fd);
+}
+
+static bool run(ISockets *socks, int lfd, sockaddr_in const &addr, size_t total,
+    size_t maxBuffer, bool spans) {
+    boost::shared_ptr<ISocket> sock(socks->connect(addr));
+    int sfd = ::accept(lfd, 0, 0);
+    if (sfd < 0) {
+        perror("tcpbench: accept");
+        return false;
+    }
+    boost::thread server(boost::bind(&echo, sfd));
+    sock->set_max_buffer(maxBuffer);
+
+    std::vector<unsigned char> out(CHUNK);
+    std::vector<unsigned char> in(CHUNK);
+    size_t sent = 0;
+    size_t got = 0;
+    size_t steps = 0;
+    bool ok = true;
+    double start = read_clock();
+    while (ok && got != total) {
+        while (sent != total) {
+            size_t n = std::min((size_t)CHUNK, total - sent);
+            for (size_t i = 0; i != n; ++i) {
+                out[i] = pattern(sent + i);
+            }
+            size_t s = sock->send(&out[0], n);
+            sent += s;
+            if (s < n) {
+                break;
+            }
+        }
+        if (!sock->step()) {
+            fprintf(stderr, "tcpbench: connection lost\n");
+            ok = false;
+            break;
+        }
+        ++steps;
+        if (spans) {
+            iovec v[2];
+            size_t n = sock->peek_spans(v);
+            size_t taken = 0;
+            for (size_t j = 0; j != n && ok; ++j) {
+                unsigned char const *p = (unsigned char const *)v[j].iov_base;
+                for (size_t i = 0; i != v[j].iov_len; ++i) {
+                    if (p[i] != pattern(got + taken + i)) {
+                        ok = false;
+                        break;
+                    }
+                }
+                taken += v[j].iov_len;
+            }
+            sock->recvd(taken);
+            got += taken;
+        }
+        else {
+            size_t n;
+            while (ok && (n = sock->peek(&in[0], in.size())) > 0) {
+                for (size_t i = 0; i != n; ++i) {
+                    if (in[i] != pattern(got + i)) {
+                        ok = false;
+                        break;
+                    }
+                }
+                sock->recvd(n);
+                got += n;
+            }
+        }
+        if (!ok) {
+            fprintf(stderr, "tcpbench: data is corrupt near byte %ld\n", (long)got);
+        }
+    }
+    double t = read_clock() - start;
+    sock.reset();
+    server.join();
+    if (ok) {
+        fprintf(stdout, "cap %5ld kB  %-5s  %ld MB echoed in %.3f s: %7.1f MB/s, %.1f kB/step\n",
+            (long)maxBuffer / 1024, spans ? "spans" : "copy", (long)(total >> 20), t,
+            total / t / (1024.0 * 1024.0), (double)total / steps / 1024.0);
+    }
+    return ok;
+}
+
+void usage() {
+    fprintf(stderr, "usage: tcpbench [megabytes]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    size_t mb = 256;
+    try {
+        if (argc > 1) {
+            mb = boost::lexical_cast<size_t>(argv[1]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 2 || mb == 0) {
+        usage();
+    }
+
+    int lfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (lfd < 0 || ::bind(lfd, (sockaddr const *)&addr, sizeof(addr)) < 0 ||
+        ::listen(lfd, 4) < 0 || ::getsockname(lfd, (sockaddr *)&addr, &alen) < 0) {
+        perror("tcpbench: listen");
+        return 1;
+    }
+
+    ITime *itime = newclock();
+    IStatus *status = mkstatus(itime, true);
+    ISockets *socks = mksocks(UDP_PORT, status);
+
+    static size_t const caps[] = { 64 * 1024, 4 * 1024 * 1024 };
+    bool ok = true;
+    for (size_t i = 0; ok && i != sizeof(caps) / sizeof(caps[0]); ++i) {
+        ok = run(socks, lfd, addr, mb << 20, caps[i], false) &&
+            run(socks, lfd, addr, mb << 20, caps[i], true);
+    }
+    ::close(lfd);
+    return ok ? 0 : 1;
+}
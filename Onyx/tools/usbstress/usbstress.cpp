@@ -0,0 +1,132 @@
+
+//  usbstress pushes packets through a pair of PacketRings the same way
+//  USBLink does: the main thread produces into the out ring and consumes
+//  from the in ring, while a fake transfer thread stands in for the
+//  libusb thread, taking each out packet and echoing it into the in ring.
+//  Every packet carries a sequence number and a fill pattern, which are
+//  checked on the way back.
+
+#include "PacketRing.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+#define RING_SIZE 128
+
+static PacketRing<RING_SIZE> outRing;
+static PacketRing<RING_SIZE> inRing;
+static volatile bool running = true;
+static size_t maxOutDepth;
+
+static void fill(unsigned char *buf, size_t sz, unsigned int seq) {
+    memcpy(buf, &seq, sizeof(seq));
+    for (size_t i = sizeof(seq); i != sz; ++i) {
+        buf[i] = (unsigned char)(seq + i);
+    }
+}
+
+static bool check(unsigned char const *buf, size_t sz, unsigned int seq) {
+    unsigned int got;
+    memcpy(&got, buf, sizeof(got));
+    if (got != seq) {
+        fprintf(stderr, "usbstress: expected packet %u, got %u\n", seq, got);
+        return false;
+    }
+    for (size_t i = sizeof(seq); i != sz; ++i) {
+        if (buf[i] != (unsigned char)(seq + i)) {
+            fprintf(stderr, "usbstress: packet %u is corrupt at byte %ld\n", seq, (long)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+//  The fake transfer: an out transfer "completes" by handing its data
+//  to the next in transfer.
+static void fake_transfer() {
+    while (running) {
+        Packet *o = outRing.begin_read();
+        if (!o) {
+            sched_yield();
+            continue;
+        }
+        Packet *i;
+        while (!(i = inRing.begin_write())) {
+            if (!running) {
+                return;
+            }
+            sched_yield();
+        }
+        i->set_size(o->size());
+        memcpy(i->buffer(), o->buffer(), o->size());
+        inRing.end_write();
+        outRing.end_read();
+    }
+}
+
+void usage() {
+    fprintf(stderr, "usage: usbstress [packets]\n");
+    exit(1);
+}
+
+int main(int argc, char const *argv[]) {
+    unsigned int count = 100000;
+    try {
+        if (argc > 1) {
+            count = boost::lexical_cast<unsigned int>(argv[1]);
+        }
+    }
+    catch (boost::bad_lexical_cast const &) {
+        usage();
+    }
+    if (argc > 2 || count == 0) {
+        usage();
+    }
+
+    boost::thread thread(&fake_transfer);
+
+    double start = read_clock();
+    unsigned int sent = 0;
+    unsigned int received = 0;
+    size_t bytes = 0;
+    bool ok = true;
+    while (ok && received != count) {
+        Packet *p;
+        if (sent != count && (p = outRing.begin_write()) != 0) {
+            //  vary the size between the sequence number and a full packet
+            size_t sz = sizeof(unsigned int) + sent % (p->max_size() - sizeof(unsigned int) + 1);
+            fill(p->buffer(), sz, sent);
+            p->set_size(sz);
+            outRing.end_write();
+            ++sent;
+            size_t depth = outRing.size();
+            if (depth > maxOutDepth) {
+                maxOutDepth = depth;
+            }
+        }
+        while (Packet const *q = inRing.begin_read()) {
+            if (!check(q->buffer(), q->size(), received)) {
+                ok = false;
+                break;
+            }
+            bytes += q->size();
+            inRing.end_read();
+            ++received;
+        }
+    }
+    double t = read_clock() - start;
+    running = false;
+    thread.join();
+
+    if (!ok) {
+        return 1;
+    }
+    fprintf(stdout, "%u packets, %ld bytes in %.3f s: %.0f packets/s, max out depth %ld/%d\n",
+        received, (long)bytes, t, received / t, (long)maxOutDepth, RING_SIZE);
+    return 0;
+}
@@ -0,0 +1,72 @@
+
+//  cksum times the UDP fragment checksums in Onyx/lib/util.cpp over 
+//  fragment-sized buffers: the byte-at-a-time FNV hash the network 
+//  used to use everywhere, the slicing-by-8 table CRC32C, and CRC32C 
+//  with the CPU's CRC instructions when this build has them.
+
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+
+//  payload plus header of one full fragment
+#define FRAGMENT_SIZE 2044
+#define BUFFERS 64
+
+static volatile uint32_t sink;
+
+static uint32_t fnv(unsigned char const *p, size_t sz) {
+  return fnv2_hash(p, sz);
+}
+
+static uint32_t crc_sw(unsigned char const *p, size_t sz) {
+  return crc32c_end(crc32c_update_sw(crc32c_begin(), p, sz));
+}
+
+static uint32_t crc(unsigned char const *p, size_t sz) {
+  return crc32c(p, sz);
+}
+
+static void run(char const *name, uint32_t (*fn)(unsigned char const *, size_t),
+    std::vector<unsigned char> const &data, size_t iters) {
+  uint32_t x = 0;
+  double start = read_clock();
+  for (size_t i = 0; i != iters; ++i) {
+    x ^= fn(&data[(i % BUFFERS) * FRAGMENT_SIZE], FRAGMENT_SIZE);
+  }
+  double t = read_clock() - start;
+  sink = x;
+  double bytes = (double)iters * FRAGMENT_SIZE;
+  fprintf(stdout, "%-12s %7.2f GB/s  %7.1f ns/fragment\n", name,
+    bytes / t * 1e-9, t * 1e9 / iters);
+}
+
+int main(int argc, char const *argv[]) {
+  size_t iters = 200000;
+  if (argc > 1) {
+    iters = strtoul(argv[1], 0, 10);
+  }
+  if (!iters) {
+    fprintf(stderr, "usage: cksum [fragments]\n");
+    return 1;
+  }
+  std::vector<unsigned char> data(BUFFERS * FRAGMENT_SIZE);
+  for (size_t i = 0; i != data.size(); ++i) {
+    data[i] = (unsigned char)rand();
+  }
+  if (crc32c("123456789", 9) != 0xe3069283 ||
+      crc_sw((unsigned char const *)"123456789", 9) != 0xe3069283) {
+    fprintf(stderr, "cksum: CRC32C check value is wrong\n");
+    return 1;
+  }
+  run("fnv2", &fnv, data, iters);
+  run("crc32c-sw", &crc_sw, data, iters);
+  if (crc32c_hardware()) {
+    run("crc32c-hw", &crc, data, iters);
+  }
+  else {
+    fprintf(stdout, "crc32c-hw    not in this build (needs SSE4.2 or ARMv8 CRC)\n");
+  }
+  return 0;
+}